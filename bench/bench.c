@@ -0,0 +1,589 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Benchmarks of the realtime paths.  Run with the names of the benchmarks
+   to run, or none to run them all.  Times are the best of a few runs so
+   that they show the cost of the code rather than of the machine.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+#include "../pckt/alloc.h"
+#include "../pckt/dsp.h"
+#include "../pckt/drum.h"
+#include "../pckt/sound.h"
+#include "../tests/test.h"
+
+#define RATE 48000
+#define BLOCK 64        /* Frames per block, a common host setting.  */
+#define NVOICES 32
+#define NDRUMS 8
+#define NRUNS 5
+
+typedef struct {
+  const char *name;
+  void (*run) ();
+} Bench;
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec * 1e-9);
+}
+
+/* Get a drum with a sample of NFRAMES frames at RATE from ALLOCATOR on
+   every channel, decaying to a third over its length, and bleed falling
+   off with the channel number.  */
+static PcktDrum *
+drum_new (size_t nframes, uint32_t seed, const PcktAllocator *allocator)
+{
+  PcktDrum *drum = pckt_drum_new ();
+  float *frames = malloc (nframes * sizeof (float));
+  if (!drum || !frames)
+    {
+      pckt_drum_free (drum);
+      free (frames);
+      return NULL;
+    }
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      PcktSample *sample = pckt_sample_new ();
+      pckt_sample_set_allocator (sample, allocator);
+      test_noise (frames, nframes, &seed);
+      for (size_t i = 0; i < nframes; ++i)
+        frames[i] *= expf (-(float) i / nframes);
+      pckt_sample_rate (sample, RATE);
+      pckt_sample_write (sample, frames, nframes);
+      pckt_sample_analyze (sample);
+      pckt_drum_add_sample (drum, sample, ch, NULL);
+      pckt_drum_set_bleed (drum, ch, 1.f / (ch + 1));
+    }
+  free (frames);
+  return drum;
+}
+
+/* Hit all voices of POOL with DRUMS in turn at forces of 0.2 to 1, then
+   give every sound SMOOTHNESS, STIFFNESS, interpolation INTRPL unless it's
+   PCKT_INTRPL_NONE and PITCH.  */
+static void
+hit_all (PcktSoundPool *pool, PcktDrum **drums, float smoothness,
+         float stiffness, PcktInterpolation intrpl, float pitch)
+{
+  for (uint32_t v = 0; v < NVOICES; ++v)
+    {
+      PcktDrum *drum = drums[v % NDRUMS];
+      PcktSound *sound = pckt_soundpool_get (pool, drum, 0);
+      pckt_drum_hit (drum, sound, .2f + (.8f * v / NVOICES));
+      sound->smoothness = smoothness;
+      sound->stiffness = stiffness;
+      if (intrpl != PCKT_INTRPL_NONE)
+        sound->interpolation = intrpl;
+      sound->pitch = pitch;
+    }
+}
+
+/* Report the time of one block of BLOCK frames, out of NBLOCKS blocks
+   rendered in SECONDS, and per frame of each of NSTREAMS voice channels.  */
+static void
+report (const char *name, double seconds, size_t nblocks, size_t nstreams)
+{
+  double block = seconds / nblocks;
+  printf ("%-36s %9.3f us/block %8.3f ns/frame\n", name, block * 1e6,
+          block * 1e9 / (BLOCK * (nstreams ? nstreams : 1)));
+}
+
+
+/* Open a counter of data TLB misses of this thread, or get -1 where there
+   is none or perf events are not allowed.  */
+static int
+tlb_counter_open ()
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset (&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof attr;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Start counting with COUNTER if START, else stop and get the count.  */
+static uint64_t
+tlb_counter_toggle (int counter, bool start)
+{
+  uint64_t count = 0;
+#ifdef __linux__
+  if (counter < 0)
+    return 0;
+  if (start)
+    {
+      ioctl (counter, PERF_EVENT_IOC_RESET, 0);
+      ioctl (counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  else
+    {
+      ioctl (counter, PERF_EVENT_IOC_DISABLE, 0);
+      if (read (counter, &count, sizeof count) != sizeof count)
+        count = 0;
+    }
+#else
+  (void) counter;
+  (void) start;
+#endif
+  return count;
+}
+
+/* A full pool of voices playing NDRUMS drums on all channels, rendered
+   into OUTS.  */
+typedef struct {
+  PcktSoundPool *pool;
+  PcktDrum *drums[NDRUMS];
+  float outs[PCKT_NCHANNELS][BLOCK];
+  float *out[PCKT_NCHANNELS];
+  int counter;  /* Of data TLB misses while rendering, if not negative.  */
+  uint64_t misses;
+} Mixer;
+
+/* Settings of every voice of a mixer, see `hit_all', and whether they are
+   choked before rendering.  */
+typedef struct {
+  const char *name;
+  float smoothness;
+  float stiffness;
+  PcktInterpolation interpolation;
+  float pitch;
+  bool choke;
+} Voices;
+
+/* Set up MIXER with drums of NFRAMES frames from ALLOCATOR, or NFRAMES
+   divided by one more than their index if VARIED.  */
+static void
+mixer_init (Mixer *mixer, size_t nframes, bool varied,
+            const PcktAllocator *allocator)
+{
+  mixer->pool = pckt_soundpool_new (NVOICES);
+  for (size_t d = 0; d < NDRUMS; ++d)
+    mixer->drums[d] = drum_new (varied ? nframes / (d + 1) : nframes, d + 1,
+                                allocator);
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    mixer->out[ch] = mixer->outs[ch];
+  mixer->counter = -1;
+  mixer->misses = 0;
+}
+
+static void
+mixer_destroy (Mixer *mixer)
+{
+  pckt_soundpool_free (mixer->pool); /* Before the samples go.  */
+  for (size_t d = 0; d < NDRUMS; ++d)
+    pckt_drum_free (mixer->drums[d]);
+}
+
+/* Render one block of MIXER and get the time it took.  */
+static double
+mixer_render (Mixer *mixer)
+{
+  memset (mixer->outs, 0, sizeof mixer->outs);
+  double start = now ();
+  pckt_soundpool_process (mixer->pool, mixer->out, BLOCK, RATE);
+  return now () - start;
+}
+
+/* Get the best time of NRUNS runs of rendering NBLOCKS blocks of MIXER
+   from the start of the sounds of VOICES, counting data TLB misses of all
+   runs if MIXER has a counter.  */
+static double
+mixer_time (Mixer *mixer, const Voices *voices, size_t nblocks)
+{
+  double best = INFINITY;
+  for (size_t run = 0; run < NRUNS; ++run)
+    {
+      pckt_soundpool_clear (mixer->pool);
+      hit_all (mixer->pool, mixer->drums, voices->smoothness,
+               voices->stiffness, voices->interpolation, voices->pitch);
+      if (voices->choke)
+        for (size_t d = 0; d < NDRUMS; ++d)
+          pckt_soundpool_choke (mixer->pool, mixer->drums[d]);
+
+      double seconds = 0;
+      tlb_counter_toggle (mixer->counter, true);
+      for (size_t b = 0; b < nblocks; ++b)
+        seconds += mixer_render (mixer);
+      mixer->misses += tlb_counter_toggle (mixer->counter, false);
+      best = fmin (best, seconds);
+    }
+  report (voices->name, best, nblocks, NVOICES * PCKT_NCHANNELS);
+  return best;
+}
+
+/* Mixing of a full pool of voices on all channels, the common path of
+   `pckt_soundpool_process', with and without the per frame effects.  */
+static void
+bench_mix ()
+{
+  const size_t nblocks = 300; /* Shorter than the samples and chokes.  */
+  const Voices variants[] = {
+    {"mix plain", 0, 0, PCKT_INTRPL_NONE, 1, false},
+    {"mix smooth and stiff", .5f, .25f, PCKT_INTRPL_NONE, 1, false},
+    {"mix choked", 0, 0, PCKT_INTRPL_NONE, 1, true}
+  };
+  Mixer mixer;
+  mixer_init (&mixer, RATE, false, NULL);
+  for (size_t i = 0; i < sizeof variants / sizeof variants[0]; ++i)
+    mixer_time (&mixer, variants + i, nblocks);
+  mixer_destroy (&mixer);
+}
+
+
+/* Kernels run on one block of BLOCK frames in BUF, mixing into DEST.  */
+typedef struct {
+  const char *name;
+  float (*run) (float *, float *);
+} Kernel;
+
+static volatile float sink; /* Keeps the results of kernels alive.  */
+
+static float
+kernel_mix (float *buf, float *dest)
+{
+  pckt_dsp_mix (dest, buf, BLOCK);
+  return dest[0];
+}
+
+static float
+scalar_mix (float *buf, float *dest)
+{
+  for (size_t i = 0; i < BLOCK; ++i)
+    dest[i] += buf[i];
+  return dest[0];
+}
+
+static float
+kernel_envelope (float *buf, float *dest)
+{
+  PcktDspEnvelope envelope;
+  pckt_dsp_envelope_exp (&envelope, .9f, .9999f);
+  (void) dest;
+  return pckt_dsp_envelope_apply (&envelope, buf, BLOCK);
+}
+
+static float
+scalar_envelope (float *buf, float *dest)
+{
+  float gain = .9f;
+  (void) dest;
+  for (size_t i = 0; i < BLOCK; ++i)
+    {
+      gain *= .9999f;
+      buf[i] *= gain;
+    }
+  return gain;
+}
+
+static float
+kernel_smooth (float *buf, float *dest)
+{
+  static PcktDspSmoother smoother;
+  if (smoother.gain == 0)
+    pckt_dsp_smoother_init (&smoother, .5f);
+  (void) dest;
+  return pckt_dsp_smooth (&smoother, buf, BLOCK, 0);
+}
+
+static float
+scalar_smooth (float *buf, float *dest)
+{
+  float tail = 0;
+  (void) dest;
+  for (size_t i = 0; i < BLOCK; ++i)
+    {
+      buf[i] = (buf[i] * .5f) + (tail * .5f);
+      tail = buf[i];
+    }
+  return tail;
+}
+
+/* Vector kernels against the scalar loops they replaced.  */
+static void
+bench_kernels ()
+{
+  const Kernel kernels[] = {
+    {"kernel mix", kernel_mix},
+    {"scalar mix", scalar_mix},
+    {"kernel envelope", kernel_envelope},
+    {"scalar envelope", scalar_envelope},
+    {"kernel smooth", kernel_smooth},
+    {"scalar smooth", scalar_smooth}
+  };
+  const size_t nblocks = 200000;
+  float src[BLOCK], buf[BLOCK], dest[BLOCK];
+  uint32_t seed = 1;
+  test_noise (src, BLOCK, &seed);
+  memset (dest, 0, sizeof dest);
+
+  for (size_t k = 0; k < sizeof kernels / sizeof kernels[0]; ++k)
+    {
+      double best = INFINITY;
+      for (size_t run = 0; run < NRUNS; ++run)
+        {
+          double start = now ();
+          for (size_t b = 0; b < nblocks; ++b)
+            {
+              memcpy (buf, src, sizeof buf);
+              sink = kernels[k].run (buf, dest) + buf[b % BLOCK];
+            }
+          best = fmin (best, now () - start);
+        }
+      report (kernels[k].name, best, nblocks, 1);
+    }
+}
+
+/* Get the energy of the next block of voice V of POOL, rendered from a
+   copy of its sound so that POOL is left as it is.  */
+static float
+get_voice_energy (PcktSoundPool *pool, uint32_t v)
+{
+  PcktSound sound = *pckt_soundpool_at (pool, v);
+  float outs[PCKT_NCHANNELS][BLOCK];
+  float *out[PCKT_NCHANNELS];
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    out[ch] = outs[ch];
+  memset (outs, 0, sizeof outs);
+  pckt_sound_process (&sound, out, BLOCK, RATE);
+
+  float energy = 0;
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    energy += pckt_dsp_dot (outs[ch], outs[ch], BLOCK);
+  return energy;
+}
+
+/* Voice stealing metrics, by their cost per block and by how quiet the
+   voice they steal actually is among the playing ones.  Drums of varied
+   length are hit at random every other block in a full pool, the same
+   sequence for every metric.  */
+static void
+bench_steal ()
+{
+  const size_t nblocks = 4000;
+  const struct {
+    const char *name;
+    PcktStealMetric metric;
+  } metrics[] = {
+    {"steal variance", PCKT_STEAL_VARIANCE},
+    {"steal peak", PCKT_STEAL_PEAK},
+    {"steal gain", PCKT_STEAL_GAIN}
+  };
+  Mixer mixer;
+  mixer_init (&mixer, RATE, true, NULL);
+
+  for (size_t m = 0; m < sizeof metrics / sizeof metrics[0]; ++m)
+    {
+      pckt_soundpool_set_steal_metric (mixer.pool, metrics[m].metric);
+      size_t nsteals = 0, nquietest = 0, ranks = 0;
+      double best = INFINITY;
+      for (size_t run = 0; run < NRUNS; ++run)
+        {
+          pckt_soundpool_clear (mixer.pool);
+          hit_all (mixer.pool, mixer.drums, 0, 0, PCKT_INTRPL_NONE, 1);
+          nsteals = nquietest = ranks = 0;
+
+          uint32_t seed = 1;
+          double seconds = 0;
+          for (size_t b = 0; b < nblocks; ++b)
+            {
+              if (b % 2)
+                {
+                  float energy[NVOICES];
+                  for (uint32_t v = 0; v < NVOICES; ++v)
+                    energy[v] = get_voice_energy (mixer.pool, v);
+
+                  seed = (seed * 1664525u) + 1013904223u;
+                  PcktDrum *drum = mixer.drums[(seed >> 16) % NDRUMS];
+                  PcktSound *sound = pckt_soundpool_get (mixer.pool, NULL, 0);
+                  uint32_t v = sound - pckt_soundpool_at (mixer.pool, 0);
+                  if (energy[v] > 0)
+                    {
+                      size_t rank = 0;
+                      for (uint32_t i = 0; i < NVOICES; ++i)
+                        rank += energy[i] < energy[v];
+                      ranks += rank;
+                      nquietest += rank == 0;
+                      ++nsteals;
+                    }
+                  pckt_drum_hit (drum, sound, (float) (seed >> 24) / 255);
+                }
+              seconds += mixer_render (&mixer);
+            }
+          best = fmin (best, seconds);
+        }
+
+      report (metrics[m].name, best, nblocks, NVOICES * PCKT_NCHANNELS);
+      printf ("%-36s %5.1f%% quietest, mean rank %.2f of %d\n", "",
+              100. * nquietest / (nsteals ? nsteals : 1),
+              (double) ranks / (nsteals ? nsteals : 1), NVOICES);
+    }
+
+  mixer_destroy (&mixer);
+}
+
+/* Interpolation of pitched voices in the mix, the cost of SINC per voice
+   against the cheaper methods and against voices at their own pitch.
+   Pitched up, SINC stretches its kernel over more frames.  */
+static void
+bench_sinc ()
+{
+  const size_t nblocks = 300;
+  const Voices variants[] = {
+    {"interpolate none", 0, 0, PCKT_INTRPL_CONSTANT, 1, false},
+    {"interpolate constant", 0, 0, PCKT_INTRPL_CONSTANT, 1.37f, false},
+    {"interpolate linear", 0, 0, PCKT_INTRPL_LINEAR, 1.37f, false},
+    {"interpolate sinc", 0, 0, PCKT_INTRPL_SINC, 1.37f, false},
+    {"interpolate sinc down", 0, 0, PCKT_INTRPL_SINC, .73f, false}
+  };
+  Mixer mixer;
+  mixer_init (&mixer, RATE, false, NULL);
+  for (size_t i = 0; i < sizeof variants / sizeof variants[0]; ++i)
+    mixer_time (&mixer, variants + i, nblocks);
+  mixer_destroy (&mixer);
+}
+
+/* Mixing of voices from samples in the compact formats, by the memory of
+   the samples and the cost of unpacking them as they are read.  */
+static void
+bench_packed ()
+{
+  const size_t nblocks = 300;
+  const struct {
+    PcktSampleFormat format;
+    Voices voices[2];
+  } formats[] = {
+    {PCKT_SAMPLE_FLOAT, {
+        {"packed float", 0, 0, PCKT_INTRPL_LINEAR, 1, false},
+        {"packed float pitched", 0, 0, PCKT_INTRPL_LINEAR, 1.37f, false}}},
+    {PCKT_SAMPLE_INT16, {
+        {"packed int16", 0, 0, PCKT_INTRPL_LINEAR, 1, false},
+        {"packed int16 pitched", 0, 0, PCKT_INTRPL_LINEAR, 1.37f, false}}},
+    {PCKT_SAMPLE_INT24, {
+        {"packed int24", 0, 0, PCKT_INTRPL_LINEAR, 1, false},
+        {"packed int24 pitched", 0, 0, PCKT_INTRPL_LINEAR, 1.37f, false}}}
+  };
+
+  for (size_t f = 0; f < sizeof formats / sizeof formats[0]; ++f)
+    {
+      Mixer mixer;
+      size_t memory = 0;
+      mixer_init (&mixer, RATE, false, NULL);
+      for (size_t d = 0; d < NDRUMS; ++d)
+        {
+          pckt_drum_compact (mixer.drums[d], formats[f].format);
+          for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+            memory += pckt_sample_get_memory
+              (pckt_drum_get_sample (mixer.drums[d], ch, 0, NULL));
+        }
+
+      for (size_t v = 0; v < 2; ++v)
+        mixer_time (&mixer, formats[f].voices + v, nblocks);
+      printf ("%-36s %9.3f MiB of samples\n", "", memory / (1024. * 1024.));
+      mixer_destroy (&mixer);
+    }
+}
+
+/* Mixing of voices from samples in each kind of pages, by throughput and
+   by data TLB misses.  Samples are one huge page each so that the huge
+   page allocators use them.  */
+static void
+bench_pages ()
+{
+  const size_t nblocks = 300;
+  const size_t nframes = ((size_t) 2 << 20) / sizeof (float);
+  const struct {
+    Voices voices;
+    const PcktAllocator *allocator;
+  } allocators[] = {
+    {{"pages heap", 0, 0, PCKT_INTRPL_NONE, 1, false},
+     pckt_allocator_heap ()},
+    {{"pages small", 0, 0, PCKT_INTRPL_NONE, 1, false},
+     pckt_allocator_pages (PCKT_PAGES_SMALL, -1)},
+    {{"pages transparent", 0, 0, PCKT_INTRPL_NONE, 1, false},
+     pckt_allocator_pages (PCKT_PAGES_TRANSPARENT, -1)},
+    {{"pages huge", 0, 0, PCKT_INTRPL_NONE, 1, false},
+     pckt_allocator_pages (PCKT_PAGES_HUGE, -1)}
+  };
+  int counter = tlb_counter_open ();
+
+  for (size_t a = 0; a < sizeof allocators / sizeof allocators[0]; ++a)
+    {
+      Mixer mixer;
+      mixer_init (&mixer, nframes, false, allocators[a].allocator);
+      mixer.counter = counter;
+      mixer_time (&mixer, &allocators[a].voices, nblocks);
+      if (counter >= 0)
+        printf ("%-36s %9.1f dTLB misses/block\n", "",
+                (double) mixer.misses / (NRUNS * nblocks));
+      else
+        printf ("%-36s no dTLB miss counter\n", "");
+      mixer_destroy (&mixer);
+    }
+
+#ifdef __linux__
+  if (counter >= 0)
+    close (counter);
+#endif
+}
+
+static const Bench benches[] = {
+  {"mix", bench_mix},
+  {"kernels", bench_kernels},
+  {"steal", bench_steal},
+  {"sinc", bench_sinc},
+  {"packed", bench_packed},
+  {"pages", bench_pages}
+};
+
+int
+main (int argc, char **argv)
+{
+  size_t nbenches = sizeof benches / sizeof benches[0];
+  for (size_t i = 0; i < nbenches; ++i)
+    {
+      bool wanted = argc < 2;
+      for (int arg = 1; arg < argc; ++arg)
+        wanted = wanted || !strcmp (argv[arg], benches[i].name);
+      if (wanted)
+        benches[i].run ();
+    }
+  return EXIT_SUCCESS;
+}
@@ -18,6 +18,7 @@
 /* Standard headers.  */
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 /* LV2 headers.  */
 #include <lv2/lv2plug.in/ns/lv2core/lv2.h>
@@ -35,10 +36,18 @@
 #include "../pckt/kit.h"
 #include "../pckt/sound.h"
 #include "../pckt/drum.h"
+#include "../pckt/util.h"
 #include "indiepocket_io.h"
 
-#define MAX_NUM_SOUNDS 32
-#define NUM_DRUM_META_PROPS 4
+#define DEFAULT_NUM_SOUNDS 32
+#define MAX_NUM_SOUNDS 256
+#define NUM_STREAMS 256
+#define SAMPLE_FORMAT_ENV "PCKT_SAMPLE_FORMAT"
+#define SAMPLE_BUDGET_ENV "PCKT_SAMPLE_BUDGET"
+#define SAMPLE_PAGES_ENV "PCKT_SAMPLE_PAGES"
+#define SAMPLE_INTERPOLATION_ENV "PCKT_SAMPLE_INTERPOLATION"
+#define NUM_DRUM_META_PROPS 5
+#define MAX_ROLE_NAME 64
 
 /* Meta drum property struct.  */
 typedef struct {
@@ -65,6 +74,21 @@ typedef struct {
   bool kit_changed;
   bool kit_is_loading;
   PcktSoundPool *pool;
+  PcktStreamer *streamer;
+  PcktSampleFormat sample_format;
+  size_t sample_budget; /* Bytes of sample memory, zero if unlimited.  */
+  size_t sample_memory; /* Bytes of sample memory taken by the kit.  */
+  PcktPageSize sample_pages;
+  PcktInterpolation sample_interpolation; /* Of kits, NONE for default.  */
+  int audio_node;        /* NUMA node running `run', or -1 if unknown.  */
+  bool find_audio_node;  /* Set until AUDIO_NODE is found after activation.  */
+  uint32_t polyphony;
+  bool pretune;
+  uint32_t tuning_serials[INT8_MAX + 1];
+  uint32_t note_hits[INT8_MAX + 1];  /* Note on count per MIDI note.  */
+  char *note_names[INT8_MAX + 1];    /* Meta names of notes, for worker.  */
+  char *priority;       /* Meta names to load first, for worker.  */
+  char *saved_priority; /* Last restored PRIORITY, for state.  */
   bool is_active;
   IDrumMetaProp drum_meta_props[NUM_DRUM_META_PROPS];
 } IndiePocket;
@@ -82,19 +106,62 @@ typedef struct {
   int8_t id;
 } IPcktDrumMsg;
 
+typedef struct {
+  LV2_Atom atom;
+  PcktSoundPool *pool;
+  uint32_t nsounds;
+} IPcktSoundPoolMsg;
+
 typedef struct {
   LV2_Atom atom;
   PcktDrumMeta *meta;
   int8_t id;
 } IPcktDrumMetaMsg;
 
+typedef struct {
+  LV2_Atom atom;
+  PcktDrum *drum;
+  PcktDrumTuning *tuning;
+  float value;
+  uint32_t serial;
+  int8_t id;
+} IPcktDrumTuningMsg;
+
+typedef struct {
+  LV2_Atom atom;
+  char *names;
+} IPcktPriorityMsg;
+
+typedef struct {
+  LV2_Atom atom;
+  PcktKit *kit;
+  PcktDrum *drum;
+} IPcktWarmMsg;
+
+typedef struct {
+  LV2_Atom atom;
+  PcktKit *kit;
+  size_t bytes;
+} IPcktSampleMemoryMsg;
+
 typedef struct {
   IndiePocket *plugin;
   LV2_Worker_Respond_Function respond;
   LV2_Worker_Respond_Handle handle;
   PcktKit *kit;
+  bool preview;
+  bool previewed[INT8_MAX + 1]; /* IDs holding a preview to replace.  */
 } IPcktDrumLoadedHandle;
 
+/* Drum meta ordered by how soon it should be loaded.  */
+typedef struct {
+  PcktDrumMeta *meta;
+  uint32_t hits;  /* Note ons of drums with the same name.  */
+  size_t rank;    /* Position in the saved priority list.  */
+  uint8_t role;   /* Kick, snare, hihat or anything else.  */
+  size_t index;   /* Position in the kit.  */
+} IPrioritizedMeta;
+
 /* Set up plugin.  */
 static LV2_Handle
 instantiate (const LV2_Descriptor *descriptor, double rate,
@@ -139,9 +206,57 @@ instantiate (const LV2_Descriptor *descriptor, double rate,
   plugin->kit_filename = NULL;
   plugin->kit_changed = false;
   plugin->kit_is_loading = false;
-  plugin->pool = pckt_soundpool_new (MAX_NUM_SOUNDS);
+  plugin->pool = pckt_soundpool_new (DEFAULT_NUM_SOUNDS);
+  plugin->polyphony = DEFAULT_NUM_SOUNDS;
+  plugin->pretune = false;
   plugin->is_active = false;
 
+  if (!plugin->pool)
+    {
+      lv2_log_error (&plugin->logger, "Could not allocate sound pool");
+      free (plugin);
+      return NULL;
+    }
+
+  /* Without a streamer mapped samples are read straight from the page
+     cache in the audio thread.  */
+  plugin->streamer = pckt_streamer_new (NUM_STREAMS);
+  if (!plugin->streamer)
+    lv2_log_warning (&plugin->logger, "Could not start sample streamer\n");
+  pckt_soundpool_set_streamer (plugin->pool, plugin->streamer);
+
+  /* Trade some precision for memory if asked to.  */
+  const char *format = getenv (SAMPLE_FORMAT_ENV);
+  plugin->sample_format = PCKT_SAMPLE_FLOAT;
+  if (format && !strcmp (format, "int16"))
+    plugin->sample_format = PCKT_SAMPLE_INT16;
+  else if (format && !strcmp (format, "int24"))
+    plugin->sample_format = PCKT_SAMPLE_INT24;
+
+  /* Default sample memory budget in megabytes, see `pckt_kit_cool'.  */
+  const char *budget = getenv (SAMPLE_BUDGET_ENV);
+  plugin->sample_budget = budget ? strtoul (budget, NULL, 10) << 20 : 0;
+
+  /* Pages to back samples with, see `pckt_allocator_pages'.  */
+  const char *pages = getenv (SAMPLE_PAGES_ENV);
+  plugin->sample_pages = PCKT_PAGES_SMALL;
+  if (pages && !strcmp (pages, "transparent"))
+    plugin->sample_pages = PCKT_PAGES_TRANSPARENT;
+  else if (pages && !strcmp (pages, "huge"))
+    plugin->sample_pages = PCKT_PAGES_HUGE;
+
+  /* Interpolation of kits, both when loading and pitching samples.  Loading
+     resamples with sinc unless another one is asked for.  */
+  const char *intrpl = getenv (SAMPLE_INTERPOLATION_ENV);
+  plugin->sample_interpolation = PCKT_INTRPL_NONE;
+  if (intrpl && !strcmp (intrpl, "constant"))
+    plugin->sample_interpolation = PCKT_INTRPL_CONSTANT;
+  else if (intrpl && !strcmp (intrpl, "linear"))
+    plugin->sample_interpolation = PCKT_INTRPL_LINEAR;
+  else if (intrpl && !strcmp (intrpl, "sinc"))
+    plugin->sample_interpolation = PCKT_INTRPL_SINC;
+  plugin->audio_node = -1;
+
   plugin->drum_meta_props[0].urid = plugin->uris.pckt_tuning;
   plugin->drum_meta_props[0].get = pckt_drum_meta_get_tuning;
   plugin->drum_meta_props[0].set = pckt_drum_meta_set_tuning;
@@ -158,6 +273,10 @@ instantiate (const LV2_Descriptor *descriptor, double rate,
   plugin->drum_meta_props[3].get = pckt_drum_meta_get_sample_overlap;
   plugin->drum_meta_props[3].set = pckt_drum_meta_set_sample_overlap;
 
+  plugin->drum_meta_props[4].urid = plugin->uris.pckt_voiceLimit;
+  plugin->drum_meta_props[4].get = pckt_drum_meta_get_voice_limit;
+  plugin->drum_meta_props[4].set = pckt_drum_meta_set_voice_limit;
+
   return (LV2_Handle) plugin;
 }
 
@@ -191,6 +310,7 @@ activate (LV2_Handle instance)
 {
   IndiePocket *plugin = (IndiePocket *) instance;
   plugin->is_active = true;
+  plugin->find_audio_node = true;
 }
 
 /* Send drum meta to notification port.  */
@@ -213,6 +333,20 @@ write_drum_message (IndiePocket *plugin, int8_t index, PcktDrumMeta *drum)
   lv2_atom_forge_pop (&plugin->forge, &frame);
 }
 
+/* Send sample memory budget and usage to notification port.  */
+static void
+write_sample_memory_message (IndiePocket *plugin)
+{
+  lv2_atom_forge_frame_time (&plugin->forge, plugin->frame_offset);
+  ipio_write_plugin_property (&plugin->forge, &plugin->uris,
+                              plugin->uris.pckt_sampleBudget,
+                              (int64_t) plugin->sample_budget);
+  lv2_atom_forge_frame_time (&plugin->forge, plugin->frame_offset);
+  ipio_write_plugin_property (&plugin->forge, &plugin->uris,
+                              plugin->uris.pckt_sampleMemory,
+                              (int64_t) plugin->sample_memory);
+}
+
 /* Send kit info to notification port.  */
 static void
 write_kit_message (IndiePocket *plugin, bool with_empty, bool with_drums)
@@ -255,6 +389,12 @@ handle_patch_get (IndiePocket *plugin, uint32_t urid,
       write_kit_message (plugin, true, true);
       return;
     }
+  else if ((urid == plugin->uris.pckt_sampleBudget)
+           || (urid == plugin->uris.pckt_sampleMemory))
+    {
+      write_sample_memory_message (plugin);
+      return;
+    }
 
   IDrumMetaProp *prop = get_drum_meta_property (plugin, urid);
 
@@ -283,6 +423,87 @@ handle_patch_get (IndiePocket *plugin, uint32_t urid,
     lv2_log_error (&plugin->logger, "Got patch:Get without a subject\n");
 }
 
+/* Ask worker to warm the samples of DRUM wanted by hits, or if DRUM is NULL
+   only to cool the least recently hit samples of the kit to its budget.  */
+static void
+schedule_warm_samples (IndiePocket *plugin, PcktDrum *drum)
+{
+  IPcktWarmMsg msg = {
+    {sizeof (PcktKit *) + sizeof (PcktDrum *), plugin->uris.pckt_warmSamples},
+    plugin->kit,
+    drum
+  };
+
+  plugin->schedule->schedule_work (plugin->schedule->handle,
+                                   sizeof (IPcktWarmMsg), &msg);
+}
+
+/* Set the sample memory budget to BYTES and ask worker to apply it to the
+   current kit.  */
+static void
+schedule_sample_budget (IndiePocket *plugin, size_t bytes)
+{
+  IPcktSampleMemoryMsg msg = {
+    {sizeof (PcktKit *) + sizeof (size_t), plugin->uris.pckt_sampleBudget},
+    plugin->kit,
+    bytes
+  };
+
+  __atomic_store_n (&plugin->sample_budget, bytes, __ATOMIC_RELEASE);
+  plugin->schedule->schedule_work (plugin->schedule->handle,
+                                   sizeof (IPcktSampleMemoryMsg), &msg);
+}
+
+/* Ask worker to render tuned copies of the samples of DRUM with ID, or drop
+   its current copies if pre-rendering is off or the drum isn't tuned.  This
+   makes any render already scheduled for the drum obsolete.  */
+static void
+schedule_drum_tuning (IndiePocket *plugin, PcktDrum *drum, int8_t id)
+{
+  const PcktDrumMeta *meta = pckt_drum_get_meta (drum);
+  IPcktDrumTuningMsg msg = {
+    {
+      sizeof (PcktDrum *) + sizeof (PcktDrumTuning *) + sizeof (float)
+      + sizeof (uint32_t) + sizeof (int8_t),
+      plugin->uris.pckt_DrumTuning
+    },
+    drum,
+    NULL,
+    plugin->pretune ? pckt_drum_meta_get_tuning (meta) : 0,
+    plugin->tuning_serials[id] + 1,
+    id
+  };
+
+  __atomic_store_n (&plugin->tuning_serials[id], msg.serial,
+                    __ATOMIC_RELEASE);
+
+  if (msg.value == 0)
+    {
+      msg.tuning = pckt_drum_swap_tuning (drum, NULL);
+      if (!msg.tuning)
+        return;
+      /* Sounds of the drum may be playing the dropped copies.  */
+      pckt_soundpool_stop (plugin->pool, drum);
+      msg.atom.type = plugin->uris.pckt_freeDrumTuning;
+    }
+
+  plugin->schedule->schedule_work (plugin->schedule->handle,
+                                   sizeof (IPcktDrumTuningMsg), &msg);
+}
+
+/* Update pre-rendered tunings of all drums using META, or of every drum in
+   the kit if META is NULL.  */
+static void
+schedule_kit_tunings (IndiePocket *plugin, const PcktDrumMeta *meta)
+{
+  for (uint8_t id = 0; id <= INT8_MAX; ++id)
+    {
+      PcktDrum *drum = pckt_kit_get_drum (plugin->kit, id);
+      if (drum && (!meta || pckt_drum_get_meta (drum) == meta))
+        schedule_drum_tuning (plugin, drum, id);
+    }
+}
+
 /* Handle incoming patch:Set event in audio thread.  */
 static void
 handle_patch_set (IndiePocket *plugin, uint32_t urid,
@@ -296,6 +517,20 @@ handle_patch_set (IndiePocket *plugin, uint32_t urid,
                                        data);
       return;
     }
+  else if (urid == plugin->uris.pckt_sampleBudget)
+    {
+      int64_t bytes = -1;
+      if (value && (value->type == plugin->forge.Long))
+        bytes = ((const LV2_Atom_Long *) value)->body;
+      else if (value && (value->type == plugin->forge.Int))
+        bytes = ((const LV2_Atom_Int *) value)->body;
+
+      if (bytes >= 0)
+        schedule_sample_budget (plugin, (size_t) bytes);
+      else
+        lv2_log_error (&plugin->logger, "Invalid sample budget\n");
+      return;
+    }
 
   IDrumMetaProp *prop = get_drum_meta_property (plugin, urid);
 
@@ -313,10 +548,11 @@ handle_patch_set (IndiePocket *plugin, uint32_t urid,
       float val = ((const LV2_Atom_Float *) value)->body;
       PcktDrumMeta *meta = pckt_kit_get_drum_meta (plugin->kit, id);
 
-      if (meta)
-        prop->set (meta, val);
-      else
+      if (!meta)
         lv2_log_error (&plugin->logger, "Unknown drum #%d\n", id);
+      else if (prop->set (meta, val) && (urid == plugin->uris.pckt_tuning)
+               && plugin->pretune && !plugin->kit_changed)
+        schedule_kit_tunings (plugin, meta);
     }
   else
     lv2_log_error (&plugin->logger,
@@ -385,10 +621,7 @@ write_output (IndiePocket *plugin, uint32_t nframes, uint32_t offset)
                  ? ((float *) plugin->ports[port]) + offset
                  :  NULL);
 
-  PcktSound *sound;
-  uint32_t i = 0;
-  while ((sound = pckt_soundpool_at (plugin->pool, i++)))
-    pckt_sound_process (sound, out, nframes, plugin->samplerate);
+  pckt_soundpool_process (plugin->pool, out, nframes, plugin->samplerate);
 }
 
 /* Write NFRAMES frames to audio output ports. This function runs in
@@ -400,12 +633,56 @@ run (LV2_Handle instance, uint32_t nframes)
   uint32_t offset = 0;
   plugin->frame_offset = 0;
 
+  /* Let samples loaded from now on be placed near this thread.  */
+  if (plugin->find_audio_node)
+    {
+      __atomic_store_n (&plugin->audio_node, pckt_numa_node (),
+                        __ATOMIC_RELEASE);
+      plugin->find_audio_node = false;
+    }
+
   /* Connect forge to notify output port.  */
   LV2_Atom_Sequence *notify = (LV2_Atom_Sequence *) plugin->ports[IPIO_NOTIFY];
   lv2_atom_forge_set_buffer (&plugin->forge, (uint8_t *) notify,
                              notify->atom.size);
   lv2_atom_forge_sequence_head (&plugin->forge, &plugin->notify_frame, 0);
 
+  /* Ask worker for a new sound pool if polyphony has changed.  */
+  const float *polyphony = (const float *) plugin->ports[IPIO_POLYPHONY];
+  if (polyphony)
+    {
+      uint32_t nsounds = (*polyphony < 1) ? 1 : (uint32_t) (*polyphony + .5f);
+      if (nsounds > MAX_NUM_SOUNDS)
+        nsounds = MAX_NUM_SOUNDS;
+      if (nsounds != plugin->polyphony)
+        {
+          IPcktSoundPoolMsg msg = {
+            {
+              sizeof (PcktSoundPool *) + sizeof (uint32_t),
+              plugin->uris.pckt_SoundPool
+            },
+            NULL,
+            nsounds
+          };
+          plugin->schedule->schedule_work (plugin->schedule->handle,
+                                           sizeof (IPcktSoundPoolMsg), &msg);
+          plugin->polyphony = nsounds;
+        }
+    }
+
+  /* Render or drop tuned samples if pre-rendering was toggled.  */
+  const float *pretune = (const float *) plugin->ports[IPIO_PRETUNE];
+  if (pretune && ((*pretune > .5f) != plugin->pretune))
+    {
+      plugin->pretune = (*pretune > .5f);
+      schedule_kit_tunings (plugin, NULL);
+    }
+
+  /* Report how often streamed samples have run dry.  */
+  float *underruns = (float *) plugin->ports[IPIO_UNDERRUNS];
+  if (underruns)
+    *underruns = (float) pckt_streamer_get_underruns (plugin->streamer);
+
   if (plugin->kit_changed)
     {
       plugin->kit_changed = false;
@@ -414,6 +691,9 @@ run (LV2_Handle instance, uint32_t nframes)
          might have been freed.  */
       pckt_soundpool_clear (plugin->pool);
 
+      if (plugin->pretune)
+        schedule_kit_tunings (plugin, NULL);
+
       /* Tell UI there's a new kit.  */
       write_kit_message (plugin, true, plugin->kit_is_loading ? false : true);
     }
@@ -432,6 +712,10 @@ run (LV2_Handle instance, uint32_t nframes)
       const uint8_t * const msg = (const uint8_t *) (event + 1);
       if (lv2_midi_message_type (msg) == LV2_MIDI_MSG_NOTE_ON)
         {
+          /* Count notes for the worker to load their drums first.  */
+          uint32_t *hits = &plugin->note_hits[msg[1] & INT8_MAX];
+          __atomic_store_n (hits, *hits + 1, __ATOMIC_RELAXED);
+
           if (event->time.frames > offset)
             {
               write_output (plugin, event->time.frames - offset, offset);
@@ -442,9 +726,14 @@ run (LV2_Handle instance, uint32_t nframes)
           PcktDrum *drum = pckt_kit_get_drum (plugin->kit, (int8_t) msg[1]);
           if (drum)
             {
-              PcktSound *sound = pckt_soundpool_get (plugin->pool, drum);
+              PcktSound *sound;
+              sound = pckt_soundpool_get (plugin->pool, drum,
+                                          pckt_drum_get_voice_limit (drum));
               if (sound)
                 pckt_drum_hit (drum, sound, ((float) msg[2]) / 127);
+              /* Load velocity layers the hit had to fall back from.  */
+              if (pckt_drum_take_wanted (drum))
+                schedule_warm_samples (plugin, drum);
             }
 
           /* Choke any sounds affected by the note.  */
@@ -471,11 +760,16 @@ static void
 cleanup (LV2_Handle instance)
 {
   IndiePocket *plugin = (IndiePocket *) instance;
+  pckt_soundpool_free (plugin->pool);
+  pckt_streamer_free (plugin->streamer);
   if (plugin->kit)
     pckt_kit_free (plugin->kit);
   if (plugin->kit_filename)
     free (plugin->kit_filename);
-  pckt_soundpool_free (plugin->pool);
+  for (uint8_t id = 0; id <= INT8_MAX; ++id)
+    free (plugin->note_names[id]);
+  free (plugin->priority);
+  free (plugin->saved_priority);
   free (plugin);
 }
 
@@ -491,20 +785,164 @@ on_drum_loaded (void *data, PcktDrum *drum, int8_t id, const int8_t *chokers,
     id
   };
 
-  if (pckt_kit_get_drum (handle->kit, id))
+  if (id < 0)
+    {
+      pckt_drum_free (drum);
+      return;
+    }
+  else if (pckt_kit_get_drum (handle->kit, id) && !handle->previewed[id])
     {
       lv2_log_note (&handle->plugin->logger, "ID %d is occupied\n", id);
       pckt_drum_free (drum);
       return;
     }
 
+  /* Remember which drum a note plays to prioritize the next kit.  */
+  handle->previewed[id] = handle->preview;
+  if (!handle->preview)
+    {
+      const char *name = pckt_drum_meta_get_name (pckt_drum_get_meta (drum));
+      char **note_name = &handle->plugin->note_names[id];
+      free (*note_name);
+      *note_name = name ? malloc (strlen (name) + 1) : NULL;
+      if (*note_name)
+        strcpy (*note_name, name);
+    }
+
   for (uint8_t i = 0; i < nchokers; ++i)
     pckt_kit_set_choke (handle->kit, chokers[i], id, true);
 
+  if (handle->plugin->sample_interpolation != PCKT_INTRPL_NONE)
+    pckt_drum_set_interpolation (drum, handle->plugin->sample_interpolation);
+
+  /* Convert samples to the host rate up front so that only pitched sounds
+     need to be interpolated in realtime.  */
+  if (!pckt_drum_resample (drum, handle->plugin->samplerate,
+                           PCKT_INTRPL_NONE))
+    lv2_log_warning (&handle->plugin->logger, "Failed to resample drum %d\n",
+                     id);
+  if (!pckt_drum_compact (drum, handle->plugin->sample_format))
+    lv2_log_warning (&handle->plugin->logger, "Failed to compact drum %d\n",
+                     id);
+
+  /* Give samples on the heap a file to be paged out to if the kit would
+     take more memory than its budget.  */
+  pckt_kit_spill_drum (handle->kit, drum, pckt_spill_dir ());
+
   /* Tell audio thread to add this drum to current kit.  */
   handle->respond (handle->handle, sizeof (IPcktDrumMsg), &message);
 }
 
+/* Guess the role of drum meta NAME from words like "kick" in it, where
+   lower roles are more likely to be played.  */
+static uint8_t
+get_meta_role (const char *name)
+{
+  static const char * const roles[] = {"kick", "bass", "snare", "hat"};
+  static const uint8_t nroles = sizeof (roles) / sizeof (roles[0]);
+  char lower[MAX_ROLE_NAME];
+  size_t i;
+
+  if (!name)
+    return nroles;
+
+  for (i = 0; name[i] && i < MAX_ROLE_NAME - 1; ++i)
+    lower[i] = (char) tolower ((unsigned char) name[i]);
+  lower[i] = '\0';
+
+  for (uint8_t role = 0; role < nroles; ++role)
+    {
+      if (strstr (lower, roles[role]))
+        return role;
+    }
+
+  return nroles;
+}
+
+/* Get the position of NAME in the newline separated list PRIORITY, or
+   SIZE_MAX if it isn't listed.  */
+static size_t
+get_meta_rank (const char *priority, const char *name)
+{
+  if (!priority || !name)
+    return SIZE_MAX;
+
+  size_t length = strlen (name);
+  size_t rank = 0;
+  for (const char *line = priority; *line; ++rank)
+    {
+      const char *end = strchr (line, '\n');
+      size_t n = end ? (size_t) (end - line) : strlen (line);
+      if (n == length && !strncmp (line, name, length))
+        return rank;
+      if (!end)
+        break;
+      line = end + 1;
+    }
+
+  return SIZE_MAX;
+}
+
+static int
+prioritized_meta_cmp (const void *lhs, const void *rhs)
+{
+  const IPrioritizedMeta *a = (const IPrioritizedMeta *) lhs;
+  const IPrioritizedMeta *b = (const IPrioritizedMeta *) rhs;
+  if (a->hits != b->hits)
+    return (a->hits > b->hits) ? -1 : 1;
+  else if (a->rank != b->rank)
+    return (a->rank < b->rank) ? -1 : 1;
+  else if (a->role != b->role)
+    return (a->role < b->role) ? -1 : 1;
+  return (a->index < b->index) ? -1 : (a->index > b->index);
+}
+
+/* Fill METAS with the drum metas of KIT in the order they should be loaded
+   and return how many there are.  Drums of recently played notes come
+   first, then those of the priority list saved with the plugin state and
+   last those with a name suggesting they are played a lot.  */
+static size_t
+prioritize_metas (const IndiePocket *plugin, PcktKit *kit,
+                  IPrioritizedMeta *metas)
+{
+  size_t nmetas = 0;
+
+  PCKT_KIT_EACH_DRUM_META (kit, meta)
+    {
+      if (nmetas > INT8_MAX)
+        break;
+
+      const char *name = pckt_drum_meta_get_name (meta);
+      IPrioritizedMeta *item = &metas[nmetas];
+      item->meta = meta;
+      item->hits = 0;
+      item->rank = get_meta_rank (plugin->priority, name);
+      item->role = get_meta_role (name);
+      item->index = nmetas++;
+
+      for (uint8_t id = 0; name && id <= INT8_MAX; ++id)
+        {
+          if (plugin->note_names[id] && !strcmp (plugin->note_names[id], name))
+            item->hits += __atomic_load_n (&plugin->note_hits[id],
+                                           __ATOMIC_RELAXED);
+        }
+    }
+
+  qsort (metas, nmetas, sizeof (IPrioritizedMeta), prioritized_meta_cmp);
+  return nmetas;
+}
+
+/* Get the allocator of the samples of kits loaded next by PLUGIN, or NULL
+   for the heap.  */
+static const PcktAllocator *
+get_sample_allocator (IndiePocket *plugin)
+{
+  int node = __atomic_load_n (&plugin->audio_node, __ATOMIC_ACQUIRE);
+  if (plugin->sample_pages == PCKT_PAGES_SMALL && node < 0)
+    return NULL;
+  return pckt_allocator_pages (plugin->sample_pages, node);
+}
+
 /* Handle scheduled non-realtime work.  */
 static LV2_Worker_Status
 work (LV2_Handle instance, LV2_Worker_Respond_Function respond,
@@ -518,10 +956,98 @@ work (LV2_Handle instance, LV2_Worker_Respond_Function respond,
     {
       const IPcktKitMsg *msg = (const IPcktKitMsg *) data;
       lv2_log_note (&plugin->logger, "Freeing kit %s\n", msg->kit_filename);
+      /* Streams of the kit were closed before it was sent here but the
+         streamer may still be reading from them.  */
+      pckt_streamer_sync (plugin->streamer);
       pckt_kit_free (msg->kit);
       free (msg->kit_filename);
       return LV2_WORKER_SUCCESS;
     }
+  else if (atom->type == plugin->uris.pckt_freeDrum)
+    {
+      const IPcktDrumMsg *msg = (const IPcktDrumMsg *) data;
+      pckt_streamer_sync (plugin->streamer);
+      pckt_kit_free_drum (msg->drum);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_warmSamples)
+    {
+      const IPcktWarmMsg *msg = (const IPcktWarmMsg *) data;
+      IPcktSampleMemoryMsg memory_msg = {
+        {sizeof (PcktKit *) + sizeof (size_t), plugin->uris.pckt_sampleMemory},
+        msg->kit,
+        0
+      };
+      pckt_drum_warm (msg->drum);
+      memory_msg.bytes = pckt_kit_cool (msg->kit);
+      /* Tell audio thread how much memory the kit takes.  */
+      respond (handle, sizeof (IPcktSampleMemoryMsg), &memory_msg);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_sampleBudget)
+    {
+      IPcktSampleMemoryMsg msg = *(const IPcktSampleMemoryMsg *) data;
+      pckt_kit_set_budget (msg.kit, msg.bytes);
+      msg.atom.type = plugin->uris.pckt_sampleMemory;
+      msg.bytes = pckt_kit_cool (msg.kit);
+      respond (handle, sizeof (IPcktSampleMemoryMsg), &msg);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_priority)
+    {
+      const IPcktPriorityMsg *msg = (const IPcktPriorityMsg *) data;
+      free (plugin->priority);
+      plugin->priority = msg->names;
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_freeSoundPool)
+    {
+      const IPcktSoundPoolMsg *msg = (const IPcktSoundPoolMsg *) data;
+      pckt_soundpool_free (msg->pool);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_freeDrumTuning)
+    {
+      const IPcktDrumTuningMsg *msg = (const IPcktDrumTuningMsg *) data;
+      pckt_streamer_sync (plugin->streamer);
+      pckt_drum_tuning_free (msg->tuning);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_DrumTuning)
+    {
+      IPcktDrumTuningMsg msg = *(const IPcktDrumTuningMsg *) data;
+
+      /* Skip the render if the drum has been retuned since.  */
+      if (msg.serial != __atomic_load_n (&plugin->tuning_serials[msg.id],
+                                         __ATOMIC_ACQUIRE))
+        return LV2_WORKER_SUCCESS;
+
+      msg.tuning = pckt_drum_tuning_new (msg.drum, msg.value,
+                                         PCKT_INTRPL_NONE);
+      if (!msg.tuning)
+        {
+          lv2_log_error (&plugin->logger, "Could not tune drum %d\n",
+                         msg.id);
+          return LV2_WORKER_ERR_UNKNOWN;
+        }
+      /* Tell audio thread to play the tuned samples.  */
+      respond (handle, sizeof (IPcktDrumTuningMsg), &msg);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_SoundPool)
+    {
+      IPcktSoundPoolMsg msg = *(const IPcktSoundPoolMsg *) data;
+      msg.pool = pckt_soundpool_new (msg.nsounds);
+      if (!msg.pool)
+        {
+          lv2_log_error (&plugin->logger, "Could not allocate %u sounds\n",
+                         msg.nsounds);
+          return LV2_WORKER_ERR_UNKNOWN;
+        }
+      /* Tell audio thread to use new sound pool.  */
+      respond (handle, sizeof (IPcktSoundPoolMsg), &msg);
+      return LV2_WORKER_SUCCESS;
+    }
 
   const LV2_Atom_Object *obj = (const LV2_Atom_Object *) data;
   const LV2_Atom *kit_path = ipio_atom_get_kit_file (&plugin->uris, obj);
@@ -534,8 +1060,16 @@ work (LV2_Handle instance, LV2_Worker_Respond_Function respond,
   PcktKitFactory *factory = pckt_kit_factory_new (filename, &err);
   if (factory)
     {
+      /* Decode samples at the host rate, cached ones are then ready as is.  */
+      pckt_kit_factory_set_rate (factory, plugin->samplerate);
+      pckt_kit_factory_set_interpolation (factory,
+                                          plugin->sample_interpolation);
+      pckt_kit_factory_set_allocator (factory,
+                                      get_sample_allocator (plugin));
       lv2_log_note (&plugin->logger, "Loading %s\n", filename);
       kit = pckt_kit_new ();
+      pckt_kit_set_budget (kit, __atomic_load_n (&plugin->sample_budget,
+                                                 __ATOMIC_ACQUIRE));
       err = pckt_kit_factory_load_metas (factory, kit);
       if (err == PCKTE_SUCCESS)
         {
@@ -589,11 +1123,26 @@ work (LV2_Handle instance, LV2_Worker_Respond_Function respond,
   if (factory)
     {
       IPcktDrumLoadedHandle on_load_handle = {
-        plugin, respond, handle, kit
+        plugin, respond, handle, kit, false, {false}
       };
+      IPrioritizedMeta metas[INT8_MAX + 1];
+      size_t nmetas = prioritize_metas (plugin, kit, metas);
 
-      PCKT_KIT_EACH_DRUM_META (kit, meta)
+      /* Make the kit playable early with the loudest hit of every drum,
+         unless it's mapped from the kit cache and loads at once anyway.
+         The full drums replace these as they are loaded.  */
+      if (!pckt_kit_factory_is_cached (factory))
         {
+          on_load_handle.preview = true;
+          for (size_t i = 0; i < nmetas; ++i)
+            pckt_kit_factory_preview_drums (factory, metas[i].meta,
+                                            on_drum_loaded, &on_load_handle);
+          on_load_handle.preview = false;
+        }
+
+      for (size_t i = 0; i < nmetas; ++i)
+        {
+          PcktDrumMeta *meta = metas[i].meta;
           IPcktDrumMetaMsg meta_msg = {
             {
               sizeof (PcktDrumMeta *) + sizeof (int8_t),
@@ -631,7 +1180,36 @@ work_response (LV2_Handle instance, uint32_t size, const void *data)
   if (atom->type == plugin->uris.pckt_Drum)
     {
       const IPcktDrumMsg *msg = (const IPcktDrumMsg *) atom;
+      PcktDrum *old_drum = pckt_kit_get_drum (plugin->kit, msg->id);
       pckt_kit_add_drum (plugin->kit, msg->drum, msg->id);
+      if (old_drum && (old_drum != msg->drum)
+          && (pckt_kit_get_drum (plugin->kit, msg->id) == msg->drum))
+        {
+          /* Stop sounds of the replaced preview drum, drop any tuning
+             rendered for it and tell worker to free it.  */
+          IPcktDrumMsg freemsg = *msg;
+          pckt_soundpool_stop (plugin->pool, old_drum);
+          __atomic_store_n (&plugin->tuning_serials[msg->id],
+                            plugin->tuning_serials[msg->id] + 1,
+                            __ATOMIC_RELEASE);
+          freemsg.atom.type = plugin->uris.pckt_freeDrum;
+          freemsg.drum = old_drum;
+          plugin->schedule->schedule_work (plugin->schedule->handle,
+                                           sizeof (IPcktDrumMsg), &freemsg);
+        }
+      if (plugin->pretune
+          && (pckt_kit_get_drum (plugin->kit, msg->id) == msg->drum))
+        schedule_drum_tuning (plugin, msg->drum, msg->id);
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_sampleMemory)
+    {
+      const IPcktSampleMemoryMsg *msg = (const IPcktSampleMemoryMsg *) atom;
+      if (msg->kit == plugin->kit)
+        {
+          plugin->sample_memory = msg->bytes;
+          write_sample_memory_message (plugin);
+        }
       return LV2_WORKER_SUCCESS;
     }
   else if (atom->type == plugin->uris.pckt_DrumMeta)
@@ -641,6 +1219,44 @@ work_response (LV2_Handle instance, uint32_t size, const void *data)
       write_drum_message (plugin, msg->id, msg->meta);
       return LV2_WORKER_SUCCESS;
     }
+  else if (atom->type == plugin->uris.pckt_DrumTuning)
+    {
+      /* Swap in the tuned samples unless the drum has been replaced or
+         retuned since, and tell worker to free the copies left over.
+         Sounds playing the replaced copies are stopped first.  */
+      IPcktDrumTuningMsg msg = *(const IPcktDrumTuningMsg *) atom;
+      if ((msg.serial == plugin->tuning_serials[msg.id])
+          && (pckt_kit_get_drum (plugin->kit, msg.id) == msg.drum))
+        {
+          msg.tuning = pckt_drum_swap_tuning (msg.drum, msg.tuning);
+          if (msg.tuning)
+            pckt_soundpool_stop (plugin->pool, msg.drum);
+        }
+      if (msg.tuning)
+        {
+          msg.atom.type = plugin->uris.pckt_freeDrumTuning;
+          plugin->schedule->schedule_work (plugin->schedule->handle,
+                                           sizeof (IPcktDrumTuningMsg), &msg);
+        }
+      return LV2_WORKER_SUCCESS;
+    }
+  else if (atom->type == plugin->uris.pckt_SoundPool)
+    {
+      /* Keep playing sounds in the new pool and tell worker to free the old
+         one.  */
+      IPcktSoundPoolMsg msg = *(const IPcktSoundPoolMsg *) atom;
+      PcktSoundPool *old_pool = plugin->pool;
+      PcktStealMetric metric = pckt_soundpool_get_steal_metric (old_pool);
+      pckt_soundpool_set_steal_metric (msg.pool, metric);
+      pckt_soundpool_set_streamer (msg.pool, plugin->streamer);
+      pckt_soundpool_transfer (msg.pool, old_pool);
+      plugin->pool = msg.pool;
+      msg.atom.type = plugin->uris.pckt_freeSoundPool;
+      msg.pool = old_pool;
+      plugin->schedule->schedule_work (plugin->schedule->handle,
+                                       sizeof (IPcktSoundPoolMsg), &msg);
+      return LV2_WORKER_SUCCESS;
+    }
   else if (atom->type != plugin->uris.pckt_Kit)
     return LV2_WORKER_ERR_UNKNOWN;
 
@@ -658,12 +1274,16 @@ work_response (LV2_Handle instance, uint32_t size, const void *data)
 
       /* Notify UI that the new kit has finished loading.  */
       write_kit_message (plugin, false, false);
+
+      /* Apply the sample budget and report memory usage.  */
+      schedule_warm_samples (plugin, NULL);
     }
   else
     {
       if (plugin->kit)
         {
-          /* Tell worker to free the old kit.  */
+          /* Stop sounds of the old kit and tell worker to free it.  */
+          pckt_soundpool_clear (plugin->pool);
           IPcktKitMsg kitmsg_free = {
             {sizeof (PcktKit *) + sizeof (char *), plugin->uris.pckt_freeKit},
             plugin->kit,
@@ -683,6 +1303,75 @@ work_response (LV2_Handle instance, uint32_t size, const void *data)
   return LV2_WORKER_SUCCESS;
 }
 
+/* Get the names of the drum metas of KIT with the most played first, one
+   per line, or a copy of the restored list if no drum has been played.
+   The result should be freed by the caller.  */
+static char *
+get_meta_priority (const IndiePocket *plugin)
+{
+  IPrioritizedMeta metas[INT8_MAX + 1];
+  size_t nmetas = 0;
+  size_t size = 1;
+  bool played = false;
+
+  PCKT_KIT_EACH_DRUM_META (plugin->kit, meta)
+    {
+      if (nmetas > INT8_MAX)
+        break;
+
+      const char *name = pckt_drum_meta_get_name (meta);
+      IPrioritizedMeta *item = &metas[nmetas];
+      item->meta = meta;
+      item->hits = 0;
+      item->rank = get_meta_rank (plugin->saved_priority, name);
+      item->role = 0;
+      item->index = nmetas++;
+
+      for (uint8_t id = 0; id <= INT8_MAX; ++id)
+        {
+          PcktDrum *drum = pckt_kit_get_drum (plugin->kit, id);
+          if (drum && (pckt_drum_get_meta (drum) == meta))
+            item->hits += __atomic_load_n (&plugin->note_hits[id],
+                                           __ATOMIC_RELAXED);
+        }
+
+      played = played || (item->hits > 0);
+      size += (name ? strlen (name) : 0) + 1;
+    }
+
+  char *priority;
+  if (!played)
+    {
+      if (!plugin->saved_priority)
+        return NULL;
+      priority = malloc (strlen (plugin->saved_priority) + 1);
+      return priority ? strcpy (priority, plugin->saved_priority) : NULL;
+    }
+
+  priority = malloc (size);
+  if (!priority)
+    return NULL;
+
+  qsort (metas, nmetas, sizeof (IPrioritizedMeta), prioritized_meta_cmp);
+
+  /* Leave drums neither played nor listed to be ordered by name on load.  */
+  priority[0] = '\0';
+  for (size_t i = 0; i < nmetas; ++i)
+    {
+      if (metas[i].hits == 0 && metas[i].rank == SIZE_MAX)
+        break;
+
+      const char *name = pckt_drum_meta_get_name (metas[i].meta);
+      if (!name || strchr (name, '\n'))
+        continue;
+      if (priority[0])
+        strcat (priority, "\n");
+      strcat (priority, name);
+    }
+
+  return priority;
+}
+
 /* Save current state.  */
 static LV2_State_Status
 state_save (LV2_Handle instance, LV2_State_Store_Function store,
@@ -746,6 +1435,21 @@ state_save (LV2_Handle instance, LV2_State_Store_Function store,
 
   free (buffer);
 
+  /* Store sample memory budget.  */
+  int64_t budget = __atomic_load_n (&plugin->sample_budget, __ATOMIC_ACQUIRE);
+  store (handle, plugin->uris.pckt_sampleBudget, &budget, sizeof (int64_t),
+         plugin->forge.Long, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+
+  /* Store names of the drums to load first next time.  */
+  char *priority = get_meta_priority (plugin);
+  if (priority)
+    {
+      store (handle, plugin->uris.pckt_priority, priority,
+             strlen (priority) + 1, plugin->forge.String,
+             LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+      free (priority);
+    }
+
   return LV2_STATE_SUCCESS;
 }
 
@@ -791,6 +1495,41 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
   kit_path = map_path->absolute_path (map_path->handle,
                                       (const char *) kit_value);
 
+  /* Retrieve sample memory budget, kits loaded from now on obey it.  */
+  const void *budget = retrieve (handle, plugin->uris.pckt_sampleBudget,
+                                 &value_size, &value_type, &value_flags);
+  if (budget && (value_type == plugin->forge.Long)
+      && (*(const int64_t *) budget >= 0))
+    __atomic_store_n (&plugin->sample_budget,
+                      (size_t) *(const int64_t *) budget, __ATOMIC_RELEASE);
+  else if (budget)
+    lv2_log_warning (&plugin->logger, "Ignoring invalid sample budget\n");
+
+  /* Retrieve names of the drums to load first.  */
+  const void *priority = retrieve (handle, plugin->uris.pckt_priority,
+                                   &value_size, &value_type, &value_flags);
+  char *names = NULL;
+  free (plugin->saved_priority);
+  plugin->saved_priority = NULL;
+  if (priority && (value_type == plugin->forge.String))
+    {
+      plugin->saved_priority = malloc (value_size + 1);
+      names = malloc (value_size + 1);
+      if (plugin->saved_priority && names)
+        {
+          memcpy (plugin->saved_priority, priority, value_size);
+          plugin->saved_priority[value_size] = '\0';
+          strcpy (names, plugin->saved_priority);
+        }
+      else
+        {
+          free (plugin->saved_priority);
+          free (names);
+          plugin->saved_priority = NULL;
+          names = NULL;
+        }
+    }
+
   /* Retrieve drum meta property values.  */
   drum_props = (const LV2_Atom_Tuple *) retrieve (handle,
                                                   plugin->uris.pckt_DrumMeta,
@@ -803,6 +1542,9 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
     {
       lv2_log_trace (&plugin->logger, "Loading %s\n", kit_path);
 
+      free (plugin->priority);
+      plugin->priority = names;
+
       PcktKit *kit = NULL;
       PcktKit *old_kit = plugin->kit;
       char *old_kit_filename = plugin->kit_filename;
@@ -816,6 +1558,11 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
           return LV2_STATE_ERR_UNKNOWN;
         }
 
+      pckt_kit_factory_set_rate (factory, plugin->samplerate);
+      pckt_kit_factory_set_interpolation (factory,
+                                          plugin->sample_interpolation);
+      pckt_kit_factory_set_allocator (factory,
+                                      get_sample_allocator (plugin));
       kit = pckt_kit_factory_load (factory);
       kit_path = pckt_kit_factory_get_filename (factory);
 
@@ -824,6 +1571,13 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
           lv2_log_error (&plugin->logger, "Failed to load %s\n", kit_path);
           return LV2_STATE_ERR_UNKNOWN;
         }
+      if (plugin->sample_interpolation != PCKT_INTRPL_NONE)
+        pckt_kit_set_interpolation (kit, plugin->sample_interpolation);
+      if (!pckt_kit_compact (kit, plugin->sample_format))
+        lv2_log_warning (&plugin->logger, "Failed to compact %s\n", kit_path);
+      pckt_kit_set_budget (kit, plugin->sample_budget);
+      pckt_kit_spill (kit, pckt_spill_dir ());
+      plugin->sample_memory = pckt_kit_cool (kit);
 
       plugin->kit = kit;
       plugin->kit_changed = true;
@@ -832,7 +1586,11 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
       strcpy (plugin->kit_filename, kit_path);
 
       if (old_kit)
-        pckt_kit_free (old_kit);
+        {
+          pckt_soundpool_clear (plugin->pool);
+          pckt_streamer_sync (plugin->streamer);
+          pckt_kit_free (old_kit);
+        }
       if (old_kit_filename)
         free (old_kit_filename);
 
@@ -864,6 +1622,16 @@ state_restore (LV2_Handle instance, LV2_State_Retrieve_Function retrieve,
 
       LV2_Atom_Forge forge;
       LV2_Atom *buffer;
+      IPcktPriorityMsg priority_msg = {
+        {sizeof (char *), plugin->uris.pckt_priority},
+        names
+      };
+
+      /* Let worker order drums before it loads the kit.  */
+      if (schedule->schedule_work (plugin->schedule->handle,
+                                   sizeof (IPcktPriorityMsg), &priority_msg)
+          != LV2_WORKER_SUCCESS)
+        free (names);
 
       if (drum_props && (value_type == plugin->forge.Tuple))
         {
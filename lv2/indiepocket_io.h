@@ -50,6 +50,9 @@ typedef enum {
   IPIO_AUDIO_OUT_ROOM_2,
   IPIO_CONTROL,
   IPIO_NOTIFY,
+  IPIO_POLYPHONY,
+  IPIO_PRETUNE,
+  IPIO_UNDERRUNS,
   IPIO_NUM_PORTS
 } IPIOPort;
 
@@ -67,13 +70,23 @@ typedef struct {
   LV2_URID patch_value;
   LV2_URID pckt_Drum;
   LV2_URID pckt_DrumMeta;
+  LV2_URID pckt_DrumTuning;
   LV2_URID pckt_Kit;
+  LV2_URID pckt_SoundPool;
   LV2_URID pckt_expression;
   LV2_URID pckt_dampening;
+  LV2_URID pckt_freeDrum;
+  LV2_URID pckt_freeDrumTuning;
   LV2_URID pckt_freeKit;
+  LV2_URID pckt_freeSoundPool;
   LV2_URID pckt_index;
   LV2_URID pckt_overlap;
+  LV2_URID pckt_priority;
+  LV2_URID pckt_sampleBudget;
+  LV2_URID pckt_sampleMemory;
   LV2_URID pckt_tuning;
+  LV2_URID pckt_voiceLimit;
+  LV2_URID pckt_warmSamples;
 } IPIOURIs;
 
 #define IPIO_IS_AUDIO_OUT_PORT(port) \
@@ -97,13 +110,30 @@ ipio_map_uris (IPIOURIs *uris, LV2_URID_Map *map)
   uris->patch_value = map->map (map->handle, LV2_PATCH__value);
   uris->pckt_Drum = map->map (map->handle, IPCKT_URI_PREFIX "Drum");
   uris->pckt_DrumMeta = map->map (map->handle, IPCKT_URI_PREFIX "DrumMeta");
+  uris->pckt_DrumTuning = map->map (map->handle,
+                                    IPCKT_URI_PREFIX "DrumTuning");
   uris->pckt_Kit = map->map (map->handle, IPCKT_URI_PREFIX "Kit");
+  uris->pckt_SoundPool = map->map (map->handle, IPCKT_URI_PREFIX "SoundPool");
   uris->pckt_expression = map->map (map->handle, IPCKT_URI_PREFIX "expression");
   uris->pckt_dampening = map->map (map->handle, IPCKT_URI_PREFIX "dampening");
+  uris->pckt_freeDrum = map->map (map->handle, IPCKT_URI_PREFIX "freeDrum");
+  uris->pckt_freeDrumTuning = map->map (map->handle,
+                                        IPCKT_URI_PREFIX "freeDrumTuning");
   uris->pckt_freeKit = map->map (map->handle, IPCKT_URI_PREFIX "freeKit");
+  uris->pckt_freeSoundPool = map->map (map->handle,
+                                       IPCKT_URI_PREFIX "freeSoundPool");
   uris->pckt_index = map->map (map->handle, IPCKT_URI_PREFIX "index");
   uris->pckt_overlap = map->map (map->handle, IPCKT_URI_PREFIX "overlap");
+  uris->pckt_priority = map->map (map->handle, IPCKT_URI_PREFIX "priority");
+  uris->pckt_sampleBudget = map->map (map->handle,
+                                      IPCKT_URI_PREFIX "sampleBudget");
+  uris->pckt_sampleMemory = map->map (map->handle,
+                                      IPCKT_URI_PREFIX "sampleMemory");
   uris->pckt_tuning = map->map (map->handle, IPCKT_URI_PREFIX "tuning");
+  uris->pckt_voiceLimit = map->map (map->handle,
+                                    IPCKT_URI_PREFIX "voiceLimit");
+  uris->pckt_warmSamples = map->map (map->handle,
+                                     IPCKT_URI_PREFIX "warmSamples");
 }
 
 static inline bool
@@ -218,6 +248,24 @@ ipio_write_drum_property (LV2_Atom_Forge *forge, const IPIOURIs *uris,
   return msg;
 }
 
+static inline LV2_Atom *
+ipio_write_plugin_property (LV2_Atom_Forge *forge, const IPIOURIs *uris,
+                            LV2_URID property, int64_t value)
+{
+  LV2_Atom_Forge_Frame frame;
+  LV2_Atom *msg = (LV2_Atom *) ipio_forge_object (forge, &frame,
+                                                  uris->patch_Set);
+
+  ipio_forge_key (forge, uris->patch_property);
+  lv2_atom_forge_urid (forge, property);
+  ipio_forge_key (forge, uris->patch_value);
+  lv2_atom_forge_long (forge, value);
+
+  lv2_atom_forge_pop (forge, &frame);
+
+  return msg;
+}
+
 static inline size_t
 ipio_estimate_drum_property_message_size ()
 {
@@ -141,6 +141,15 @@ show_drum_prop_status (const DrumProperty *prop, IndiePocketUI *ui)
       message = g_strdup_printf ("%s sample overlap: %d%%", name,
                                  (int) (value * 100.f));
     }
+  else if (!strcmp (prop->widget_id, "voic-dial"))
+    {
+      int limit = (int) roundf (value);
+      if (limit == 0)
+        message = g_strdup_printf ("%s voice limit: none", name);
+      else
+        message = g_strdup_printf ("%s voice limit: %d voice%s", name, limit,
+                                   (limit == 1) ? "" : "s");
+    }
   else
     fprintf (stderr, "Unknown widget ID: %s\n", prop->widget_id);
 
@@ -445,10 +454,11 @@ on_drum_loaded (IndiePocketUI *ui, const LV2_Atom_Object *obj)
     {"tune-dial", ui->uris.pckt_tuning, index, name_label, NULL, NULL},
     {"damp-dial", ui->uris.pckt_dampening, index, name_label, NULL, NULL},
     {"expr-dial", ui->uris.pckt_expression, index, name_label, NULL, NULL},
-    {"olap-dial", ui->uris.pckt_overlap, index, name_label, NULL, NULL}
+    {"olap-dial", ui->uris.pckt_overlap, index, name_label, NULL, NULL},
+    {"voic-dial", ui->uris.pckt_voiceLimit, index, name_label, NULL, NULL}
   };
 
-  for (uint8_t i = 0; i < 4; ++i)
+  for (uint8_t i = 0; i < sizeof (props) / sizeof (DrumProperty); ++i)
     {
       GObject *dial = gtk_builder_get_object (builder, props[i].widget_id);
       if (!PCKT_GTK_IS_DIAL (dial))
@@ -530,9 +540,11 @@ port_event (LV2UI_Handle handle, uint32_t port_index, uint32_t buffer_size,
             uint32_t format, const void *buffer)
 {
   IndiePocketUI *ui = (IndiePocketUI *) handle;
-  (void) port_index;
   (void) buffer_size;
 
+  if (port_index != IPIO_NOTIFY)
+    return;
+
   if (format != ui->uris.atom_eventTransfer)
     {
       fprintf (stderr, "Unknown format\n");
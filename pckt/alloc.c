@@ -0,0 +1,197 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "alloc.h"
+
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#define MIN_MAP_SIZE ((size_t) 64 << 10) /* Smaller ones come from the heap,
+                                            to keep mappings few.  */
+
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED 1 /* From <linux/mempolicy.h>.  */
+#endif
+
+/* Page allocators are never freed, so that samples can outlive whoever
+   picked their allocator.  There is one for every page size and node, the
+   last node standing for no node.  */
+typedef struct {
+  PcktAllocator iface;
+  PcktPageSize size;
+  int node;
+} PageAllocator;
+
+static PageAllocator page_allocators[PCKT_PAGES_HUGE + 1]
+                                    [PCKT_ALLOC_MAX_NODES + 1];
+static pthread_once_t page_allocators_once = PTHREAD_ONCE_INIT;
+
+static void *
+heap_alloc (size_t size, void *data)
+{
+  (void) data;
+  return malloc (size);
+}
+
+static void
+heap_free (void *ptr, size_t size, void *data)
+{
+  (void) size;
+  (void) data;
+  free (ptr);
+}
+
+static const PcktAllocator heap_allocator = {heap_alloc, heap_free, NULL};
+
+/* Get the allocator of the C library.  */
+const PcktAllocator *
+pckt_allocator_heap ()
+{
+  return &heap_allocator;
+}
+
+/* Get the length of the mapping for SIZE bytes from ALLOCATOR.  */
+static size_t
+get_map_length (const PageAllocator *allocator, size_t size)
+{
+  size_t align = (size_t) sysconf (_SC_PAGESIZE);
+  if (allocator->size != PCKT_PAGES_SMALL && size >= HUGE_PAGE_SIZE)
+    align = HUGE_PAGE_SIZE;
+  return ((size + align - 1) / align) * align;
+}
+
+/* Map LENGTH bytes aligned to huge pages, so that they can be backed by
+   transparent huge pages.  */
+static void *
+map_aligned (size_t length)
+{
+  size_t extra = length + HUGE_PAGE_SIZE;
+  char *mem = mmap (NULL, extra, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return mem;
+
+  size_t head = (HUGE_PAGE_SIZE - ((uintptr_t) mem % HUGE_PAGE_SIZE))
+    % HUGE_PAGE_SIZE;
+  if (head > 0)
+    munmap (mem, head);
+  munmap (mem + head + length, extra - head - length);
+  return mem + head;
+}
+
+static void *
+pages_alloc (size_t size, void *data)
+{
+  const PageAllocator *allocator = (const PageAllocator *) data;
+  if (size < MIN_MAP_SIZE)
+    return malloc (size);
+
+  size_t length = get_map_length (allocator, size);
+  bool huge = (length % HUGE_PAGE_SIZE == 0) && (size >= HUGE_PAGE_SIZE)
+    && (allocator->size != PCKT_PAGES_SMALL);
+  void *mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (huge && allocator->size == PCKT_PAGES_HUGE)
+    mem = mmap (NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (mem == MAP_FAILED && huge)
+    {
+      /* No reserved huge pages left, ask for transparent ones.  */
+      mem = map_aligned (length);
+#ifdef MADV_HUGEPAGE
+      if (mem != MAP_FAILED)
+        madvise (mem, length, MADV_HUGEPAGE);
+#endif
+    }
+  else if (mem == MAP_FAILED)
+    mem = mmap (NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+
+#ifdef SYS_mbind
+  /* Pages are placed on NODE when first touched, if there is room.  */
+  if (allocator->node >= 0)
+    {
+      unsigned long mask = 1UL << allocator->node;
+      syscall (SYS_mbind, mem, length, MPOL_PREFERRED, &mask,
+               8 * sizeof mask + 1, 0);
+    }
+#endif
+
+  return mem;
+}
+
+static void
+pages_free (void *ptr, size_t size, void *data)
+{
+  if (!ptr)
+    return;
+  else if (size < MIN_MAP_SIZE)
+    free (ptr);
+  else
+    munmap (ptr, get_map_length ((const PageAllocator *) data, size));
+}
+
+static void
+init_page_allocators ()
+{
+  for (PcktPageSize size = PCKT_PAGES_SMALL; size <= PCKT_PAGES_HUGE; ++size)
+    {
+      for (int node = 0; node <= PCKT_ALLOC_MAX_NODES; ++node)
+        {
+          PageAllocator *allocator = &page_allocators[size][node];
+          allocator->iface.alloc = pages_alloc;
+          allocator->iface.free = pages_free;
+          allocator->iface.data = allocator;
+          allocator->size = size;
+          allocator->node = (node < PCKT_ALLOC_MAX_NODES) ? node : -1;
+        }
+    }
+}
+
+/* Get an allocator mapping pages of SIZE directly, preferably on NUMA
+   NODE, for all but small allocations.  NODE is ignored if negative.  */
+const PcktAllocator *
+pckt_allocator_pages (PcktPageSize size, int node)
+{
+  if (size < PCKT_PAGES_SMALL || size > PCKT_PAGES_HUGE)
+    return NULL;
+  if (node < 0 || node >= PCKT_ALLOC_MAX_NODES)
+    node = PCKT_ALLOC_MAX_NODES;
+
+  pthread_once (&page_allocators_once, init_page_allocators);
+  return &page_allocators[size][node].iface;
+}
+
+/* Get the NUMA node of the processor running the calling thread, or -1 if
+   unknown.  This is a system call.  */
+int
+pckt_numa_node ()
+{
+#ifdef SYS_getcpu
+  unsigned cpu, node;
+  if (syscall (SYS_getcpu, &cpu, &node, NULL) == 0)
+    return (int) node;
+#endif
+  return -1;
+}
@@ -0,0 +1,50 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCKT_ALLOC_H
+#define PCKT_ALLOC_H 1
+
+#include <stddef.h>
+#include "pckt.h"
+
+#define PCKT_ALLOC_MAX_NODES 64
+
+__BEGIN_DECLS
+
+/* Allocator of sample frames.  FREE is given the size passed to ALLOC and
+   DATA is passed to both.  */
+typedef struct {
+  void *(*alloc) (size_t, void *);
+  void (*free) (void *, size_t, void *);
+  void *data;
+} PcktAllocator;
+
+/* Pages backing allocations of `pckt_allocator_pages'.  Huge pages are
+   only used for allocations of at least one huge page.  */
+typedef enum {
+  PCKT_PAGES_SMALL = 0,
+  PCKT_PAGES_TRANSPARENT,  /* Transparent huge pages, if enabled.  */
+  PCKT_PAGES_HUGE          /* Reserved huge pages, else transparent.  */
+} PcktPageSize;
+
+extern const PcktAllocator *pckt_allocator_heap ();
+extern const PcktAllocator *pckt_allocator_pages (PcktPageSize, int);
+extern int pckt_numa_node ();
+
+__END_DECLS
+
+#endif /* ! PCKT_ALLOC_H */
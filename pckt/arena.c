@@ -0,0 +1,126 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/* Blocks are prepended, so only the first one is allocated from.  */
+typedef struct ArenaBlockImpl ArenaBlock;
+struct ArenaBlockImpl
+{
+  ArenaBlock *next;
+  size_t size;  /* Bytes following the header.  */
+  size_t used;
+};
+
+#define BLOCK_HEADER ALIGN_UP (sizeof (ArenaBlock))
+
+/* Bump allocator of objects that are freed together.  It isn't locked, an
+   arena must only be used by one thread at a time.  */
+struct PcktArenaImpl
+{
+  ArenaBlock *blocks;
+  size_t block_size;
+};
+
+/* Create an arena taking memory in blocks of BLOCK_SIZE bytes, or larger
+   ones for allocations that don't fit.  No block is taken until the first
+   allocation.  */
+PcktArena *
+pckt_arena_new (size_t block_size)
+{
+  PcktArena *arena = malloc (sizeof (PcktArena));
+  if (arena)
+    {
+      arena->blocks = NULL;
+      arena->block_size = block_size;
+    }
+  return arena;
+}
+
+/* Free ARENA together with everything allocated from it.  */
+void
+pckt_arena_free (PcktArena *arena)
+{
+  if (!arena)
+    return;
+
+  while (arena->blocks)
+    {
+      ArenaBlock *block = arena->blocks;
+      arena->blocks = block->next;
+      free (block);
+    }
+  free (arena);
+}
+
+/* Allocate SIZE bytes from ARENA.  The memory is freed with the arena.  */
+void *
+pckt_arena_alloc (PcktArena *arena, size_t size)
+{
+  if (!arena || !size)
+    return NULL;
+
+  size = ALIGN_UP (size);
+  ArenaBlock *block = arena->blocks;
+  if (!block || block->size - block->used < size)
+    {
+      size_t block_size = (size > arena->block_size
+                           ? size : arena->block_size);
+      block = malloc (BLOCK_HEADER + block_size);
+      if (!block)
+        return NULL;
+
+      block->size = block_size;
+      block->used = 0;
+
+      /* Keep allocating from the old block if it has more room left.  */
+      ArenaBlock *first = arena->blocks;
+      if (first && first->size - first->used > block_size - size)
+        {
+          block->next = first->next;
+          first->next = block;
+        }
+      else
+        {
+          block->next = first;
+          arena->blocks = block;
+        }
+    }
+
+  void *ptr = (char *) block + BLOCK_HEADER + block->used;
+  block->used += size;
+  return ptr;
+}
+
+/* Copy the string STR into ARENA.  */
+char *
+pckt_arena_strdup (PcktArena *arena, const char *str)
+{
+  if (!str)
+    return NULL;
+
+  size_t len = strlen (str);
+  char *copy = pckt_arena_alloc (arena, len + 1);
+  if (copy)
+    memcpy (copy, str, len + 1);
+  return copy;
+}
@@ -0,0 +1,35 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCKT_ARENA_H
+#define PCKT_ARENA_H 1
+
+#include <stddef.h>
+#include "pckt.h"
+
+__BEGIN_DECLS
+
+typedef struct PcktArenaImpl PcktArena;
+
+extern PcktArena *pckt_arena_new (size_t);
+extern void pckt_arena_free (PcktArena *);
+extern void *pckt_arena_alloc (PcktArena *, size_t);
+extern char *pckt_arena_strdup (PcktArena *, const char *);
+
+__END_DECLS
+
+#endif /* ! PCKT_ARENA_H */
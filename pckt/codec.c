@@ -0,0 +1,311 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include <string.h>
+#include <math.h>
+#include "codec.h"
+
+/* Blocks are coded like FLAC subframes with a fixed polynomial predictor
+   of order 0 to MAX_ORDER and Rice coded residuals.  Frames that are all
+   integers scaled by a power of two, as decoded from PCM files, are coded
+   as those integers.  Other frames are coded by their bit patterns, mapped
+   so that the integer order follows the float order.  */
+
+#define MODE_INT 0
+#define MODE_BITS 1
+#define MAX_ORDER 3
+#define MAX_SHIFT 24
+#define ESCAPE 24 /* Quotients this long are followed by the raw residual.  */
+
+typedef struct {
+  uint8_t *pos;
+  uint64_t acc;
+  uint32_t nbits;
+} BitWriter;
+
+typedef struct {
+  const uint8_t *pos;
+  const uint8_t *end;
+  uint64_t acc;
+  uint32_t nbits;
+} BitReader;
+
+/* Write the N lowest bits of V, where N is at most 32.  */
+static inline void
+put_bits (BitWriter *w, uint64_t v, uint32_t n)
+{
+  w->acc = (w->acc << n) | (v & ((((uint64_t) 1) << n) - 1));
+  w->nbits += n;
+  while (w->nbits >= 8)
+    {
+      w->nbits -= 8;
+      *w->pos++ = (uint8_t) (w->acc >> w->nbits);
+    }
+}
+
+static inline void
+put_wide (BitWriter *w, uint64_t v, uint32_t n)
+{
+  if (n > 32)
+    {
+      put_bits (w, v >> 32, n - 32);
+      n = 32;
+    }
+  put_bits (w, v, n);
+}
+
+/* Read N bits, where N is at most 32, into V.  */
+static inline bool
+get_bits (BitReader *r, uint32_t n, uint64_t *v)
+{
+  while (r->nbits < n)
+    {
+      if (r->pos == r->end)
+        return false;
+      r->acc = (r->acc << 8) | *r->pos++;
+      r->nbits += 8;
+    }
+  r->nbits -= n;
+  *v = (r->acc >> r->nbits) & ((((uint64_t) 1) << n) - 1);
+  return true;
+}
+
+static inline bool
+get_wide (BitReader *r, uint32_t n, uint64_t *v)
+{
+  uint64_t hi = 0, lo;
+  if (n > 32)
+    {
+      if (!get_bits (r, n - 32, &hi))
+        return false;
+      n = 32;
+    }
+  if (!get_bits (r, n, &lo))
+    return false;
+  *v = (hi << n) | lo;
+  return true;
+}
+
+/* Read a unary coded quotient of at most ESCAPE into Q.  */
+static inline bool
+get_unary (BitReader *r, uint64_t *q)
+{
+  while (r->nbits <= 56 && r->pos < r->end)
+    {
+      r->acc = (r->acc << 8) | *r->pos++;
+      r->nbits += 8;
+    }
+  if (r->nbits == 0)
+    return false;
+
+  /* Count the ones at the top of the buffered bits.  */
+  uint64_t top = ~(r->acc << (64 - r->nbits));
+  uint32_t ones = top ? (uint32_t) __builtin_clzll (top) : 64;
+  if (ones >= ESCAPE)
+    {
+      r->nbits -= ESCAPE;
+      *q = ESCAPE;
+      return true;
+    }
+  else if (ones >= r->nbits)
+    return false;
+
+  r->nbits -= ones + 1;
+  *q = ones;
+  return true;
+}
+
+/* Map the bits of F to an integer that orders like F, and back.  */
+static inline int32_t
+bits_from_float (float f)
+{
+  uint32_t b;
+  memcpy (&b, &f, sizeof b);
+  return (int32_t) (b ^ ((uint32_t) ((int32_t) b >> 31) >> 1));
+}
+
+static inline float
+float_from_bits (int32_t i)
+{
+  uint32_t b = (uint32_t) i ^ ((uint32_t) (i >> 31) >> 1);
+  float f;
+  memcpy (&f, &b, sizeof f);
+  return f;
+}
+
+/* Find the smallest shift turning all N FRAMES into exact integers, or
+   return -1 if there is none.  */
+static int32_t
+find_shift (const float *frames, size_t n)
+{
+  for (int32_t shift = 0; shift <= MAX_SHIFT; ++shift)
+    {
+      size_t i;
+      for (i = 0; i < n; ++i)
+        {
+          float x = ldexpf (frames[i], shift);
+          if (x != truncf (x) || fabsf (x) > (float) (1 << MAX_SHIFT)
+              || (x == 0 && signbit (x)))
+            break;
+        }
+      if (i == n)
+        return shift;
+    }
+  return -1;
+}
+
+static inline int64_t
+predict (const int32_t *v, size_t i, uint32_t order)
+{
+  switch (order)
+    {
+    case 1:
+      return v[i - 1];
+    case 2:
+      return (2 * (int64_t) v[i - 1]) - v[i - 2];
+    case 3:
+      return (3 * ((int64_t) v[i - 1] - v[i - 2])) + v[i - 3];
+    default:
+      return 0;
+    }
+}
+
+/* Encode N frames, at most PCKT_CODEC_BLOCK_FRAMES, into OUT which must
+   have room for PCKT_CODEC_BOUND (N) bytes.  Returns the encoded size.  */
+size_t
+pckt_codec_encode (const float *frames, size_t n, uint8_t *out)
+{
+  int32_t values[PCKT_CODEC_BLOCK_FRAMES];
+  if (!frames || !out || n == 0 || n > PCKT_CODEC_BLOCK_FRAMES)
+    return 0;
+
+  int32_t shift = find_shift (frames, n);
+  for (size_t i = 0; i < n; ++i)
+    values[i] = (shift < 0)
+      ? bits_from_float (frames[i])
+      : (int32_t) ldexpf (frames[i], shift);
+
+  /* Pick the predictor leaving the smallest residuals.  */
+  uint32_t order = 0;
+  uint64_t best = UINT64_MAX;
+  for (uint32_t o = 0; o <= MAX_ORDER && o < n; ++o)
+    {
+      uint64_t sum = 0;
+      for (size_t i = o; i < n; ++i)
+        {
+          int64_t r = values[i] - predict (values, i, o);
+          sum += (uint64_t) ((r < 0) ? -r : r);
+        }
+      if (sum < best)
+        {
+          best = sum;
+          order = o;
+        }
+    }
+
+  /* Rice parameter from the mean residual.  */
+  uint64_t mean = best / ((n > order) ? n - order : 1);
+  uint32_t k = 0;
+  while (k < 40 && (((uint64_t) 1) << (k + 1)) <= mean)
+    ++k;
+
+  out[0] = (shift < 0) ? MODE_BITS : MODE_INT;
+  out[1] = (shift < 0) ? 0 : (uint8_t) shift;
+  out[2] = (uint8_t) order;
+  out[3] = (uint8_t) k;
+
+  BitWriter w = {out + 4, 0, 0};
+  for (uint32_t i = 0; i < order; ++i)
+    put_bits (&w, (uint32_t) values[i], 32);
+  for (size_t i = order; i < n; ++i)
+    {
+      int64_t r = values[i] - predict (values, i, order);
+      uint64_t u = ((uint64_t) r << 1) ^ (uint64_t) (r >> 63);
+      uint64_t q = u >> k;
+      if (q < ESCAPE)
+        {
+          put_bits (&w, ((((uint64_t) 1) << q) - 1) << 1, (uint32_t) q + 1);
+          put_wide (&w, u, k);
+        }
+      else
+        {
+          put_bits (&w, (((uint64_t) 1) << ESCAPE) - 1, ESCAPE);
+          put_wide (&w, u, 64);
+        }
+    }
+  if (w.nbits > 0)
+    put_bits (&w, 0, 8 - w.nbits);
+
+  return (size_t) (w.pos - out);
+}
+
+/* Decode N frames from the SIZE bytes at IN into FRAMES.  */
+bool
+pckt_codec_decode (const uint8_t *in, size_t size, float *frames, size_t n)
+{
+  int32_t values[PCKT_CODEC_BLOCK_FRAMES];
+  if (!in || !frames || size < 4 || n == 0 || n > PCKT_CODEC_BLOCK_FRAMES)
+    return false;
+
+  uint32_t mode = in[0], shift = in[1], order = in[2], k = in[3];
+  if (mode > MODE_BITS || shift > MAX_SHIFT || order > MAX_ORDER
+      || order > n || k > 40)
+    return false;
+
+  BitReader r = {in + 4, in + size, 0, 0};
+  uint64_t v;
+  for (uint32_t i = 0; i < order; ++i)
+    {
+      if (!get_bits (&r, 32, &v))
+        return false;
+      values[i] = (int32_t) (uint32_t) v;
+    }
+  for (size_t i = order; i < n; ++i)
+    {
+      uint64_t q, u;
+      if (!get_unary (&r, &q))
+        return false;
+      else if (q == ESCAPE)
+        {
+          if (!get_wide (&r, 64, &u))
+            return false;
+        }
+      else
+        {
+          if (!get_wide (&r, k, &u))
+            return false;
+          u |= q << k;
+        }
+      int64_t res = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+      values[i] = (int32_t) (res + predict (values, i, order));
+    }
+
+  if (mode == MODE_BITS)
+    {
+      for (size_t i = 0; i < n; ++i)
+        frames[i] = float_from_bits (values[i]);
+    }
+  else
+    {
+      float scale = ldexpf (1.f, -(int32_t) shift); /* Exact.  */
+      for (size_t i = 0; i < n; ++i)
+        frames[i] = (float) values[i] * scale;
+    }
+
+  return true;
+}
@@ -0,0 +1,38 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef PCKT_CODEC_H
+#define PCKT_CODEC_H 1
+
+#include <stddef.h>
+#include "pckt.h"
+
+/* Most frames in one independently decodable block.  */
+#define PCKT_CODEC_BLOCK_FRAMES 4096
+
+/* Upper bound of the encoded size in bytes of a block of N frames.  */
+#define PCKT_CODEC_BOUND(n) (32 + (12 * (size_t) (n)))
+
+__BEGIN_DECLS
+
+extern size_t pckt_codec_encode (const float *, size_t, uint8_t *);
+extern bool pckt_codec_decode (const uint8_t *, size_t, float *, size_t);
+
+__END_DECLS
+
+#endif /* ! PCKT_CODEC_H */
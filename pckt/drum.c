@@ -24,9 +24,19 @@
 #define MAX_NUM_SAMPLES 64
 #define TWELFTH_ROOT_OF_TWO 1.05946309435929526
 
+/* Residency of the head of a sample, which only changes for mapped
+   samples.  */
+typedef enum {
+  LAYER_WARM = 0, /* Locked in memory, or on the heap.  */
+  LAYER_COLD,     /* May be paged out, so it's not picked for hits.  */
+  LAYER_WANTED    /* Cold but hit, waiting for `pckt_drum_warm'.  */
+} LayerState;
+
 typedef struct {
   PcktSample *sample;
   char *name;
+  uint32_t state;
+  uint64_t used;  /* Value of HIT_CLOCK when last hit.  */
 } PcktDrumSample;
 
 struct PcktDrumImpl
@@ -35,23 +45,54 @@ struct PcktDrumImpl
   PcktDrumSample samples[PCKT_NCHANNELS][MAX_NUM_SAMPLES];
   size_t nsamples[PCKT_NCHANNELS];
   float bleed[PCKT_NCHANNELS];
+  PcktInterpolation interpolation;
+  PcktDrumTuning *tuning;
+  uint32_t wanted; /* Set when a hit wants a cold sample.  */
+  PcktArena *arena; /* Holds the drum and its sample names, if set.  */
 };
 
+/* Copies of the samples of a drum rendered at a fixed tuning.  */
+struct PcktDrumTuningImpl
+{
+  float tuning;
+  PcktSample *samples[PCKT_NCHANNELS][MAX_NUM_SAMPLES];
+  size_t nsamples[PCKT_NCHANNELS];
+};
+
+/* Counts hits of all drums to order samples by when they were last used.  */
+static uint64_t hit_clock;
+
 struct PcktDrumMetaImpl
 {
   char *name;
+  bool in_arena;  /* Set if the meta and its name are freed with an arena.  */
   float tuning;
   float dampening;
   float expression;
   float overlap;
+  float voice_limit;
 };
 
 PcktDrum *
 pckt_drum_new ()
 {
-  PcktDrum *drum = malloc (sizeof (PcktDrum));
+  return pckt_drum_new_in (NULL);
+}
+
+/* Create a drum which, with the names of its samples, is allocated from
+   ARENA unless it's NULL.  Freeing it then leaves that memory to the
+   arena.  */
+PcktDrum *
+pckt_drum_new_in (PcktArena *arena)
+{
+  PcktDrum *drum = (arena
+                    ? pckt_arena_alloc (arena, sizeof (PcktDrum))
+                    : malloc (sizeof (PcktDrum)));
   if (drum)
-    memset (drum, 0, sizeof (PcktDrum));
+    {
+      memset (drum, 0, sizeof (PcktDrum));
+      drum->arena = arena;
+    }
   return drum;
 }
 
@@ -68,12 +109,14 @@ pckt_drum_free (PcktDrum *drum)
           if (drum->samples[ch][i].sample)
             pckt_sample_free (drum->samples[ch][i].sample);
 
-          if (drum->samples[ch][i].name)
+          if (drum->samples[ch][i].name && !drum->arena)
             free (drum->samples[ch][i].name);
         }
     }
 
-  free (drum);
+  pckt_drum_tuning_free (drum->tuning);
+  if (!drum->arena)
+    free (drum);
 }
 
 bool
@@ -85,6 +128,111 @@ pckt_drum_set_bleed (PcktDrum *drum, PcktChannel ch, float bleed)
   return true;
 }
 
+float
+pckt_drum_get_bleed (const PcktDrum *drum, PcktChannel ch)
+{
+  if (!drum || ch < PCKT_CH0 || ch >= PCKT_NCHANNELS)
+    return 0;
+  return drum->bleed[ch];
+}
+
+size_t
+pckt_drum_get_nsamples (const PcktDrum *drum, PcktChannel ch)
+{
+  if (!drum || ch < PCKT_CH0 || ch >= PCKT_NCHANNELS)
+    return 0;
+  return drum->nsamples[ch];
+}
+
+/* Get sample INDEX of channel CH of DRUM, and its name in *NAME unless NAME
+   is NULL.  */
+PcktSample *
+pckt_drum_get_sample (const PcktDrum *drum, PcktChannel ch, size_t index,
+                      const char **name)
+{
+  if (index >= pckt_drum_get_nsamples (drum, ch))
+    return NULL;
+  if (name)
+    *name = drum->samples[ch][index].name;
+  return drum->samples[ch][index].sample;
+}
+
+/* Set interpolation used by sounds of DRUM when played back at another rate
+   than that of its samples, or PCKT_INTRPL_NONE to use the interpolation of
+   each sample.  */
+bool
+pckt_drum_set_interpolation (PcktDrum *drum, PcktInterpolation intrpl)
+{
+  if (!drum || intrpl < PCKT_INTRPL_NONE || intrpl > PCKT_INTRPL_SINC)
+    return false;
+  drum->interpolation = intrpl;
+  return true;
+}
+
+PcktInterpolation
+pckt_drum_get_interpolation (const PcktDrum *drum)
+{
+  return drum ? drum->interpolation : PCKT_INTRPL_NONE;
+}
+
+/* Get the interpolation to render samples of DRUM with for INTRPL, which
+   is that of DRUM if INTRPL is PCKT_INTRPL_NONE, or sinc if DRUM has none
+   either since rendering is done once.  */
+static PcktInterpolation
+get_render_interpolation (const PcktDrum *drum, PcktInterpolation intrpl)
+{
+  if (intrpl == PCKT_INTRPL_NONE)
+    intrpl = drum->interpolation;
+  return intrpl == PCKT_INTRPL_NONE ? PCKT_INTRPL_SINC : intrpl;
+}
+
+/* Resample every sample of DRUM to RATE using interpolation INTRPL, see
+   `get_render_interpolation'.  */
+bool
+pckt_drum_resample (PcktDrum *drum, uint32_t rate, PcktInterpolation intrpl)
+{
+  if (!drum || !rate)
+    return false;
+
+  intrpl = get_render_interpolation (drum, intrpl);
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (uint8_t i = 0; i < drum->nsamples[ch]; ++i)
+        {
+          PcktSample *sample = drum->samples[ch][i].sample;
+          PcktInterpolation prev = pckt_sample_get_interpolation (sample);
+          bool ok = pckt_sample_set_interpolation (sample, intrpl)
+            && pckt_resample (sample, rate);
+          pckt_sample_set_interpolation (sample, prev);
+          if (!ok)
+            return false;
+        }
+    }
+
+  return true;
+}
+
+/* Store the frames of all samples of DRUM as FORMAT, see
+   `pckt_sample_compact'.  */
+bool
+pckt_drum_compact (PcktDrum *drum, PcktSampleFormat format)
+{
+  if (!drum)
+    return false;
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (uint8_t i = 0; i < drum->nsamples[ch]; ++i)
+        {
+          if (!pckt_sample_compact (drum->samples[ch][i].sample, format))
+            return false;
+        }
+    }
+
+  return true;
+}
+
 bool
 pckt_drum_set_meta (PcktDrum *drum, const PcktDrumMeta *meta)
 {
@@ -94,6 +242,79 @@ pckt_drum_set_meta (PcktDrum *drum, const PcktDrumMeta *meta)
   return true;
 }
 
+const PcktDrumMeta *
+pckt_drum_get_meta (const PcktDrum *drum)
+{
+  return drum ? drum->meta : NULL;
+}
+
+/* Render copies of every sample of DRUM transposed by TUNING semitones using
+   interpolation INTRPL, see `get_render_interpolation'.  */
+PcktDrumTuning *
+pckt_drum_tuning_new (const PcktDrum *drum, float tuning,
+                      PcktInterpolation intrpl)
+{
+  if (!drum)
+    return NULL;
+
+  intrpl = get_render_interpolation (drum, intrpl);
+
+  PcktDrumTuning *dt = malloc (sizeof (PcktDrumTuning));
+  if (!dt)
+    return NULL;
+
+  memset (dt, 0, sizeof (PcktDrumTuning));
+  dt->tuning = tuning;
+
+  float pitch = powf (TWELFTH_ROOT_OF_TWO, tuning);
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (uint8_t i = 0; i < drum->nsamples[ch]; ++i)
+        {
+          PcktSample *copy;
+          copy = pckt_sample_transpose (drum->samples[ch][i].sample, pitch,
+                                        intrpl);
+          if (!copy)
+            {
+              pckt_drum_tuning_free (dt);
+              return NULL;
+            }
+          dt->samples[ch][dt->nsamples[ch]++] = copy;
+        }
+    }
+
+  return dt;
+}
+
+void
+pckt_drum_tuning_free (PcktDrumTuning *dt)
+{
+  if (!dt)
+    return;
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (uint8_t i = 0; i < dt->nsamples[ch]; ++i)
+        pckt_sample_free (dt->samples[ch][i]);
+    }
+
+  free (dt);
+}
+
+/* Let DRUM play the samples of DT while its tuning matches that of DT
+   instead of pitching the original samples.  Returns the previous tuning,
+   which is owned by the caller.  */
+PcktDrumTuning *
+pckt_drum_swap_tuning (PcktDrum *drum, PcktDrumTuning *dt)
+{
+  if (!drum)
+    return dt;
+
+  PcktDrumTuning *prev = drum->tuning;
+  drum->tuning = dt;
+  return prev;
+}
+
 static int
 drum_sample_cmp (const void *lhs, const void *rhs)
 {
@@ -119,6 +340,8 @@ pckt_drum_add_sample (PcktDrum *drum, PcktSample *sample, PcktChannel ch,
   ds->sample = sample;
   if (!name)
     ds->name = NULL;
+  else if (drum->arena)
+    ds->name = pckt_arena_strdup (drum->arena, name);
   else
     {
       ds->name = malloc (strlen (name) + 1);
@@ -169,15 +392,13 @@ pckt_drum_normalize (PcktDrum *drum)
   return true;
 }
 
-static inline PcktSample *
-get_sample_for_hit (const PcktDrum *drum, PcktChannel ch, float force,
-                    float random)
+static inline uint8_t
+get_sample_index_for_hit (const PcktDrum *drum, PcktChannel ch, float force,
+                          float random)
 {
   size_t nsamples = drum->nsamples[ch];
-  if (nsamples == 0)
-    return NULL;
-  else if (nsamples == 1)
-    return drum->samples[ch][0].sample;
+  if (nsamples <= 1)
+    return 0;
 
   uint8_t index;
   float probability = 0;
@@ -219,16 +440,72 @@ get_sample_for_hit (const PcktDrum *drum, PcktChannel ch, float force,
   if (index >= nsamples)
     index = nsamples - 1;
 
-  return drum->samples[ch][index].sample;
+  return index;
+}
+
+/* Get the sample at INDEX of channel CH of DRUM, or if it's cold the
+   nearest warm one while asking for the cold one to be warmed.  Both are
+   marked as used at CLOCK, so that the one played isn't cooled first.  */
+static inline PcktDrumSample *
+get_warm_sample (PcktDrum *drum, PcktChannel ch, uint8_t index,
+                 uint64_t clock)
+{
+  PcktDrumSample *samples = drum->samples[ch];
+  uint32_t state = __atomic_load_n (&samples[index].state, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n (&samples[index].used, clock, __ATOMIC_RELAXED);
+  if (state == LAYER_WARM)
+    return samples + index;
+
+  if (state == LAYER_COLD
+      && __atomic_compare_exchange_n (&samples[index].state, &state,
+                                      LAYER_WANTED, false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+    __atomic_store_n (&drum->wanted, true, __ATOMIC_RELEASE);
+
+  /* Prefer the louder of two samples at the same distance.  */
+  PcktDrumSample *warm = NULL;
+  size_t nsamples = drum->nsamples[ch];
+  for (size_t d = 1; !warm && d < nsamples; ++d)
+    {
+      if (index + d < nsamples
+          && (__atomic_load_n (&samples[index + d].state, __ATOMIC_ACQUIRE)
+              == LAYER_WARM))
+        warm = samples + index + d;
+      else if (index >= d
+               && (__atomic_load_n (&samples[index - d].state,
+                                    __ATOMIC_ACQUIRE) == LAYER_WARM))
+        warm = samples + index - d;
+    }
+
+  if (!warm)
+    return samples + index; /* Streamed from the start.  */
+
+  __atomic_store_n (&warm->used, clock, __ATOMIC_RELAXED);
+  return warm;
+}
+
+static inline PcktSample *
+get_sample_for_hit (PcktDrum *drum, const PcktDrumTuning *dt,
+                    PcktChannel ch, float force, float random, uint64_t clock)
+{
+  if (drum->nsamples[ch] == 0)
+    return NULL;
+
+  uint8_t index = get_sample_index_for_hit (drum, ch, force, random);
+  if (dt && index < dt->nsamples[ch])
+    return dt->samples[ch][index];
+  return get_warm_sample (drum, ch, index, clock)->sample;
 }
 
 bool
-pckt_drum_hit (const PcktDrum *drum, PcktSound *sound, float force)
+pckt_drum_hit (PcktDrum *drum, PcktSound *sound, float force)
 {
   if (!drum || !sound || !pckt_sound_clear (sound))
     return false;
 
   sound->source = drum;
+  sound->interpolation = drum->interpolation;
   if (force <= 0)
     return true;
 
@@ -246,21 +523,31 @@ pckt_drum_hit (const PcktDrum *drum, PcktSound *sound, float force)
       force = powf (force, exp);
     }
 
+  /* Play pre-rendered copies if they match the current tuning.  */
+  const PcktDrumTuning *dt = NULL;
+  if (drum->tuning && drum->meta
+      && drum->tuning->tuning == drum->meta->tuning)
+    dt = drum->tuning;
+
   PcktChannel ch;
   float bleed;
   float random = (float) rand () / RAND_MAX;
+  uint64_t clock = __atomic_add_fetch (&hit_clock, 1, __ATOMIC_RELAXED);
   for (ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
     {
       bleed = drum->bleed[ch] * force;
       if (bleed <= 0) /* Channel is muted.  */
         continue;
       sound->bleed[ch] = bleed;
-      sound->samples[ch] = get_sample_for_hit (drum, ch, force, random);
+      sound->samples[ch] = get_sample_for_hit (drum, dt, ch, force, random,
+                                               clock);
+      if (sound->samples[ch])
+        sound->active |= PCKT_CHANNEL_BIT (ch);
     }
 
   sound->impact = force;
 
-  if (drum->meta && drum->meta->tuning != 0)
+  if (!dt && drum->meta && drum->meta->tuning != 0)
     sound->pitch = powf (TWELFTH_ROOT_OF_TWO, drum->meta->tuning);
 
   if (drum->meta && drum->meta->dampening > 0 && drum->meta->dampening <= 1)
@@ -273,6 +560,133 @@ pckt_drum_hit (const PcktDrum *drum, PcktSound *sound, float force)
   return true;
 }
 
+/* Check and clear whether hits of DRUM have wanted cold samples since the
+   last call, which `pckt_drum_warm' should then be called for outside the
+   audio thread.  */
+bool
+pckt_drum_take_wanted (PcktDrum *drum)
+{
+  if (!drum)
+    return false;
+  return __atomic_exchange_n (&drum->wanted, false, __ATOMIC_ACQ_REL);
+}
+
+/* Lock the heads of the wanted samples of DRUM in memory so that hits can
+   play them.  Returns the number of samples warmed.  */
+size_t
+pckt_drum_warm (PcktDrum *drum)
+{
+  size_t nwarmed = 0;
+  if (!drum)
+    return nwarmed;
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (uint8_t i = 0; i < drum->nsamples[ch]; ++i)
+        {
+          PcktDrumSample *ds = &drum->samples[ch][i];
+          if (__atomic_load_n (&ds->state, __ATOMIC_ACQUIRE) != LAYER_WANTED)
+            continue;
+
+          /* Frames that couldn't be locked are still faulted in.  */
+          pckt_sample_lock (ds->sample, PCKT_SAMPLE_ATTACK_FRAMES);
+          __atomic_store_n (&ds->state, LAYER_WARM, __ATOMIC_RELEASE);
+          ++nwarmed;
+        }
+    }
+
+  return nwarmed;
+}
+
+/* Get the bytes of memory taken by sample INDEX of channel CH of DRUM,
+   which is zero if it's cold and all of its frames if they are on the
+   heap.  USED is set to tell when the sample was last hit relative to
+   other samples.  */
+size_t
+pckt_drum_get_resident (const PcktDrum *drum, PcktChannel ch, size_t index,
+                        uint64_t *used)
+{
+  if (!drum || ch < PCKT_CH0 || ch >= PCKT_NCHANNELS
+      || index >= drum->nsamples[ch])
+    return 0;
+
+  const PcktDrumSample *ds = &drum->samples[ch][index];
+  if (used)
+    *used = __atomic_load_n (&ds->used, __ATOMIC_RELAXED);
+  if (__atomic_load_n (&ds->state, __ATOMIC_ACQUIRE) != LAYER_WARM)
+    return 0;
+
+  return pckt_sample_get_memory (ds->sample);
+}
+
+/* Move the frames of float samples of DRUM that are on the heap to files
+   in DIR, softest first, until at least BYTES have been moved, so that
+   they can be cooled, see `pckt_sample_spill'.  Must be called before DRUM
+   is played.  Returns the bytes moved.  */
+size_t
+pckt_drum_spill (PcktDrum *drum, const char *dir, size_t bytes)
+{
+  size_t nspilled = 0;
+  if (!drum || !dir)
+    return nspilled;
+
+  for (uint8_t i = 0; i < MAX_NUM_SAMPLES && nspilled < bytes; ++i)
+    {
+      for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+        {
+          if (i >= drum->nsamples[ch] || nspilled >= bytes)
+            continue;
+
+          PcktSample *sample = drum->samples[ch][i].sample;
+          size_t size = pckt_sample_get_memory (sample);
+          if (!pckt_sample_spill (sample, dir))
+            continue;
+          pckt_sample_lock (sample, PCKT_SAMPLE_ATTACK_FRAMES);
+          nspilled += size;
+        }
+    }
+
+  return nspilled;
+}
+
+/* Let the head of mapped sample INDEX of channel CH of DRUM be paged out.
+   Hits pick the nearest warm sample instead until it's warmed again.
+   Samples played by sounds of a pool are left warm, so that the audio
+   thread doesn't fault on them, though a hit may still pick a sample just
+   before it's cooled.  */
+bool
+pckt_drum_cool (PcktDrum *drum, PcktChannel ch, size_t index)
+{
+  if (!drum || ch < PCKT_CH0 || ch >= PCKT_NCHANNELS
+      || index >= drum->nsamples[ch])
+    return false;
+
+  PcktDrumSample *ds = &drum->samples[ch][index];
+  uint32_t state = LAYER_WARM;
+  if (!pckt_sample_is_mapped (ds->sample)
+      || pckt_sample_is_playing (ds->sample)
+      || !__atomic_compare_exchange_n (&ds->state, &state, LAYER_COLD, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return false;
+
+  /* A sound may have started in the meantime.  */
+  if (pckt_sample_is_playing (ds->sample))
+    {
+      __atomic_store_n (&ds->state, LAYER_WARM, __ATOMIC_RELEASE);
+      return false;
+    }
+
+  return pckt_sample_unlock (ds->sample);
+}
+
+size_t
+pckt_drum_get_voice_limit (const PcktDrum *drum)
+{
+  if (!drum || !drum->meta)
+    return 0;
+  return (size_t) drum->meta->voice_limit;
+}
+
 PcktDrumMeta *
 pckt_drum_meta_new (const char *name)
 {
@@ -299,10 +713,29 @@ pckt_drum_meta_new (const char *name)
   return meta;
 }
 
+/* Create a meta like `pckt_drum_meta_new' but allocated from ARENA, unless
+   it's NULL.  */
+PcktDrumMeta *
+pckt_drum_meta_new_in (PcktArena *arena, const char *name)
+{
+  if (!arena)
+    return pckt_drum_meta_new (name);
+
+  PcktDrumMeta *meta = pckt_arena_alloc (arena, sizeof (PcktDrumMeta));
+  if (meta)
+    {
+      memset (meta, 0, sizeof (PcktDrumMeta));
+      meta->in_arena = true;
+      if (name && !(meta->name = pckt_arena_strdup (arena, name)))
+        meta = NULL;
+    }
+  return meta;
+}
+
 void
 pckt_drum_meta_free (PcktDrumMeta *meta)
 {
-  if (meta)
+  if (meta && !meta->in_arena)
     {
       if (meta->name)
         free (meta->name);
@@ -375,3 +808,18 @@ pckt_drum_meta_set_sample_overlap (PcktDrumMeta *meta, float overlap)
   meta->overlap = overlap;
   return true;
 }
+
+float
+pckt_drum_meta_get_voice_limit (const PcktDrumMeta *meta)
+{
+  return meta ? meta->voice_limit : 0;
+}
+
+bool
+pckt_drum_meta_set_voice_limit (PcktDrumMeta *meta, float limit)
+{
+  if (!meta || limit < 0)
+    return false;
+  meta->voice_limit = roundf (limit);
+  return true;
+}
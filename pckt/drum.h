@@ -21,21 +21,45 @@
 #include "pckt.h"
 #include "sound.h"
 #include "sample.h"
+#include "arena.h"
 
 __BEGIN_DECLS
 
 typedef struct PcktDrumImpl PcktDrum;
 typedef struct PcktDrumMetaImpl PcktDrumMeta;
+typedef struct PcktDrumTuningImpl PcktDrumTuning;
 
 extern PcktDrum *pckt_drum_new ();
+extern PcktDrum *pckt_drum_new_in (PcktArena *);
 extern void pckt_drum_free (PcktDrum *);
 extern bool pckt_drum_set_bleed (PcktDrum *, PcktChannel, float);
+extern float pckt_drum_get_bleed (const PcktDrum *, PcktChannel);
+extern size_t pckt_drum_get_nsamples (const PcktDrum *, PcktChannel);
+extern PcktSample *pckt_drum_get_sample (const PcktDrum *, PcktChannel, size_t,
+                                         const char **);
+extern bool pckt_drum_set_interpolation (PcktDrum *, PcktInterpolation);
+extern PcktInterpolation pckt_drum_get_interpolation (const PcktDrum *);
+extern bool pckt_drum_resample (PcktDrum *, uint32_t, PcktInterpolation);
+extern bool pckt_drum_compact (PcktDrum *, PcktSampleFormat);
 extern bool pckt_drum_set_meta (PcktDrum *, const PcktDrumMeta *);
+extern const PcktDrumMeta *pckt_drum_get_meta (const PcktDrum *);
+extern PcktDrumTuning *pckt_drum_tuning_new (const PcktDrum *, float,
+                                             PcktInterpolation);
+extern void pckt_drum_tuning_free (PcktDrumTuning *);
+extern PcktDrumTuning *pckt_drum_swap_tuning (PcktDrum *, PcktDrumTuning *);
 extern bool pckt_drum_add_sample (PcktDrum *, PcktSample *, PcktChannel,
                                   const char *);
 extern bool pckt_drum_normalize (PcktDrum *);
-extern bool pckt_drum_hit (const PcktDrum *, PcktSound *, float);
+extern bool pckt_drum_hit (PcktDrum *, PcktSound *, float);
+extern bool pckt_drum_take_wanted (PcktDrum *);
+extern size_t pckt_drum_warm (PcktDrum *);
+extern size_t pckt_drum_get_resident (const PcktDrum *, PcktChannel, size_t,
+                                      uint64_t *);
+extern bool pckt_drum_cool (PcktDrum *, PcktChannel, size_t);
+extern size_t pckt_drum_spill (PcktDrum *, const char *, size_t);
+extern size_t pckt_drum_get_voice_limit (const PcktDrum *);
 extern PcktDrumMeta *pckt_drum_meta_new (const char *);
+extern PcktDrumMeta *pckt_drum_meta_new_in (PcktArena *, const char *);
 extern void pckt_drum_meta_free (PcktDrumMeta *);
 extern const char *pckt_drum_meta_get_name (const PcktDrumMeta *);
 extern float pckt_drum_meta_get_tuning (const PcktDrumMeta *);
@@ -46,6 +70,8 @@ extern float pckt_drum_meta_get_expression (const PcktDrumMeta *);
 extern bool pckt_drum_meta_set_expression (PcktDrumMeta *, float);
 extern float pckt_drum_meta_get_sample_overlap (const PcktDrumMeta *);
 extern bool pckt_drum_meta_set_sample_overlap (PcktDrumMeta *, float);
+extern float pckt_drum_meta_get_voice_limit (const PcktDrumMeta *);
+extern bool pckt_drum_meta_set_voice_limit (PcktDrumMeta *, float);
 
 __END_DECLS
 
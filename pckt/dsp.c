@@ -0,0 +1,375 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "dsp.h"
+
+#if PCKT_DSP_WIDTH == 8
+# include <immintrin.h>
+typedef __m256 PcktVec;
+/* Sign extend and convert 8 int16 at P without AVX2 integer support.  */
+# define VEC_FROM_I16(p) \
+  _mm256_insertf128_ps (_mm256_castps128_ps256 (vec_from_i16x4 (p)), \
+                        vec_from_i16x4 ((p) + 4), 1)
+# define VEC_LOAD(p) _mm256_loadu_ps (p)
+# define VEC_STORE(p, v) _mm256_storeu_ps ((p), (v))
+# define VEC_SET1(f) _mm256_set1_ps (f)
+# define VEC_ZERO() _mm256_setzero_ps ()
+# define VEC_ADD(a, b) _mm256_add_ps ((a), (b))
+# define VEC_SUB(a, b) _mm256_sub_ps ((a), (b))
+# define VEC_MUL(a, b) _mm256_mul_ps ((a), (b))
+# define VEC_MAX(a, b) _mm256_max_ps ((a), (b))
+#elif PCKT_DSP_WIDTH == 4
+# include <xmmintrin.h>
+typedef __m128 PcktVec;
+# define VEC_FROM_I16(p) vec_from_i16x4 (p)
+# define VEC_LOAD(p) _mm_loadu_ps (p)
+# define VEC_STORE(p, v) _mm_storeu_ps ((p), (v))
+# define VEC_SET1(f) _mm_set1_ps (f)
+# define VEC_ZERO() _mm_setzero_ps ()
+# define VEC_ADD(a, b) _mm_add_ps ((a), (b))
+# define VEC_SUB(a, b) _mm_sub_ps ((a), (b))
+# define VEC_MUL(a, b) _mm_mul_ps ((a), (b))
+# define VEC_MAX(a, b) _mm_max_ps ((a), (b))
+#endif
+
+#define W PCKT_DSP_WIDTH
+
+#if W > 1 && defined (__SSE2__)
+# include <emmintrin.h>
+# define HAVE_VEC_FROM_I16 1
+
+/* Convert 4 int16 at P to floats.  */
+static inline __m128
+vec_from_i16x4 (const int16_t *p)
+{
+  __m128i x = _mm_loadl_epi64 ((const __m128i *) p);
+  return _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (x, x), 16));
+}
+#endif
+
+#if W > 1
+/* Sum all lanes of V.  */
+static inline float
+vec_hsum (PcktVec v)
+{
+  float lanes[W], sum = 0;
+  VEC_STORE (lanes, v);
+  for (uint32_t j = 0; j < W; ++j)
+    sum += lanes[j];
+  return sum;
+}
+#endif
+
+/* Multiply N frames in BUF by constant GAIN.  */
+void
+pckt_dsp_scale (float *buf, size_t n, float gain)
+{
+  size_t i = 0;
+#if W > 1
+  PcktVec g = VEC_SET1 (gain);
+  for (; i + W <= n; i += W)
+    VEC_STORE (buf + i, VEC_MUL (VEC_LOAD (buf + i), g));
+#endif
+  for (; i < n; ++i)
+    buf[i] *= gain;
+}
+
+/* Set up ENV as a constant GAIN.  */
+void
+pckt_dsp_envelope_constant (PcktDspEnvelope *env, float gain)
+{
+  env->gain = gain;
+  env->step = 0;
+  env->factor = 1.f;
+  env->length = SIZE_MAX;
+}
+
+/* Set up ENV as GAIN decreasing linearly by DECAY per frame until it reaches
+   zero.  */
+void
+pckt_dsp_envelope_linear (PcktDspEnvelope *env, float gain, float decay)
+{
+  env->gain = gain;
+  env->step = -decay;
+  env->factor = 1.f;
+  env->length = SIZE_MAX;
+
+  if (decay <= 0)
+    return;
+
+  /* Find the clamp point, i.e. the number of frames K for which
+     GAIN - K * DECAY is still positive.  The estimate is adjusted to agree
+     with the float arithmetic used in `pckt_dsp_envelope_apply'.  */
+  float estimate = ceilf (gain / decay);
+  if (estimate >= (float) (1 << 24))
+    return; /* Beyond float precision, never reached in practice.  */
+
+  size_t length = (estimate > 1) ? (size_t) estimate - 1 : 0;
+  while (length > 0 && gain - length * decay <= 0)
+    --length;
+  while (gain - (length + 1) * decay > 0)
+    ++length;
+  env->length = length;
+}
+
+/* Set up ENV as GAIN multiplied by FACTOR per frame.  */
+void
+pckt_dsp_envelope_exp (PcktDspEnvelope *env, float gain, float factor)
+{
+  env->gain = gain;
+  env->step = 0;
+  env->factor = factor;
+  env->length = SIZE_MAX;
+}
+
+/* Multiply N frames in BUF by the gain of ENV, where the gain of frame I is
+   (GAIN * FACTOR^(I + 1)) + ((I + 1) * STEP) for all frames before the clamp
+   point and zero after it.  Returns the gain of the last frame.  */
+float
+pckt_dsp_envelope_apply (const PcktDspEnvelope *env, float *buf, size_t n)
+{
+  size_t i = 0;
+  size_t live = (n < env->length) ? n : env->length;
+  float power = 1.f; /* FACTOR^I.  */
+
+#if W > 1
+  if (live >= W)
+    {
+      float powers[W], counts[W], vpower = 1.f;
+      for (uint32_t j = 0; j < W; ++j)
+        {
+          vpower *= env->factor;
+          powers[j] = vpower;
+          counts[j] = j + 1;
+        }
+
+      PcktVec p = VEC_LOAD (powers);
+      PcktVec k = VEC_LOAD (counts);
+      PcktVec dp = VEC_SET1 (vpower);
+      PcktVec dk = VEC_SET1 (W);
+      PcktVec g0 = VEC_SET1 (env->gain);
+      PcktVec step = VEC_SET1 (env->step);
+      for (; i + W <= live; i += W)
+        {
+          PcktVec g = VEC_ADD (VEC_MUL (g0, p), VEC_MUL (step, k));
+          VEC_STORE (buf + i, VEC_MUL (VEC_LOAD (buf + i), g));
+          p = VEC_MUL (p, dp);
+          k = VEC_ADD (k, dk);
+          power *= vpower;
+        }
+    }
+#endif
+  for (; i < live; ++i)
+    {
+      power *= env->factor;
+      buf[i] *= (env->gain * power) + ((i + 1) * env->step);
+    }
+
+  if (live < n)
+    {
+      memset (buf + live, 0, (n - live) * sizeof (float));
+      return 0;
+    }
+
+  return (env->gain * power) + (n * env->step);
+}
+
+/* Prepare SMOOTHER for a one-pole lowpass where each output frame is
+   COEFF parts previous output and (1 - COEFF) parts input.  */
+void
+pckt_dsp_smoother_init (PcktDspSmoother *smoother, float coeff)
+{
+  smoother->coeff = coeff;
+  smoother->gain = 1.f - coeff;
+#if W > 1
+  /* Output frame J of a vector depends on input frames 0..J of the same
+     vector and the last output of the previous vector.  */
+  float power = 1.f;
+  for (uint32_t j = 0; j < W; ++j)
+    {
+      power *= coeff;
+      smoother->feedback[j] = power;
+    }
+  for (uint32_t m = 0; m < W; ++m)
+    {
+      float tap = smoother->gain;
+      for (uint32_t j = 0; j < W; ++j)
+        {
+          if (j < m)
+            smoother->taps[m][j] = 0;
+          else
+            {
+              smoother->taps[m][j] = tap;
+              tap *= coeff;
+            }
+        }
+    }
+#endif
+}
+
+/* Run N frames in BUF through SMOOTHER in place, where TAIL is the last
+   output frame of the previous call.  Returns the new tail.  */
+float
+pckt_dsp_smooth (const PcktDspSmoother *smoother, float *buf, size_t n,
+                 float tail)
+{
+  size_t i = 0;
+#if W > 1
+  PcktVec feedback = VEC_LOAD (smoother->feedback);
+  PcktVec taps[W];
+  for (uint32_t m = 0; m < W; ++m)
+    taps[m] = VEC_LOAD (smoother->taps[m]);
+
+  for (; i + W <= n; i += W)
+    {
+      PcktVec y = VEC_MUL (feedback, VEC_SET1 (tail));
+      for (uint32_t m = 0; m < W; ++m)
+        y = VEC_ADD (y, VEC_MUL (taps[m], VEC_SET1 (buf[i + m])));
+      VEC_STORE (buf + i, y);
+      tail = buf[i + W - 1];
+    }
+#endif
+  for (; i < n; ++i)
+    {
+      buf[i] *= smoother->gain;
+      buf[i] += tail * smoother->coeff;
+      tail = buf[i];
+    }
+  return tail;
+}
+
+/* Add N frames from SRC to DEST.  */
+void
+pckt_dsp_mix (float *dest, const float *src, size_t n)
+{
+  size_t i = 0;
+#if W > 1
+  for (; i + W <= n; i += W)
+    VEC_STORE (dest + i, VEC_ADD (VEC_LOAD (dest + i), VEC_LOAD (src + i)));
+#endif
+  for (; i < n; ++i)
+    dest[i] += src[i];
+}
+
+/* Convert N frames of int16 at SRC to floats scaled by GAIN in DEST.  */
+void
+pckt_dsp_from_int16 (float *dest, const int16_t *src, size_t n, float gain)
+{
+  size_t i = 0;
+#ifdef HAVE_VEC_FROM_I16
+  PcktVec g = VEC_SET1 (gain);
+  for (; i + W <= n; i += W)
+    VEC_STORE (dest + i, VEC_MUL (VEC_FROM_I16 (src + i), g));
+#endif
+  for (; i < n; ++i)
+    dest[i] = src[i] * gain;
+}
+
+/* Convert N frames of packed little endian 24 bit integers at SRC to
+   floats scaled by GAIN in DEST.  */
+void
+pckt_dsp_from_int24 (float *dest, const uint8_t *src, size_t n, float gain)
+{
+  for (size_t i = 0; i < n; ++i, src += 3)
+    {
+      /* Place the value in the upper bytes to get the sign right.  */
+      uint32_t x = ((uint32_t) src[0] << 8) | ((uint32_t) src[1] << 16)
+        | ((uint32_t) src[2] << 24);
+      dest[i] = (float) ((int32_t) x >> 8) * gain;
+    }
+}
+
+/* Get the dot product of N frames in A and B.  */
+float
+pckt_dsp_dot (const float *a, const float *b, size_t n)
+{
+  size_t i = 0;
+  float dot = 0;
+#if W > 1
+  if (n >= W)
+    {
+      PcktVec acc = VEC_ZERO ();
+      for (; i + W <= n; i += W)
+        acc = VEC_ADD (acc, VEC_MUL (VEC_LOAD (a + i), VEC_LOAD (b + i)));
+      dot = vec_hsum (acc);
+    }
+#endif
+  for (; i < n; ++i)
+    dot += a[i] * b[i];
+  return dot;
+}
+
+/* Get the largest absolute value of N frames in BUF.  */
+float
+pckt_dsp_peak (const float *buf, size_t n)
+{
+  size_t i = 0;
+  float peak = 0;
+#if W > 1
+  if (n >= W)
+    {
+      float lanes[W];
+      PcktVec zero = VEC_ZERO ();
+      PcktVec vpeak = zero;
+      for (; i + W <= n; i += W)
+        {
+          PcktVec x = VEC_LOAD (buf + i);
+          vpeak = VEC_MAX (vpeak, VEC_MAX (x, VEC_SUB (zero, x)));
+        }
+      VEC_STORE (lanes, vpeak);
+      for (uint32_t j = 0; j < W; ++j)
+        peak = fmaxf (peak, lanes[j]);
+    }
+#endif
+  for (; i < n; ++i)
+    peak = fmaxf (peak, fabsf (buf[i]));
+  return peak;
+}
+
+/* Accumulate the sum and sum of squares of N frames in BUF, relative to
+   REF, into SUM and SUM2.  */
+void
+pckt_dsp_moments (const float *buf, size_t n, float ref, float *sum,
+                  float *sum2)
+{
+  size_t i = 0;
+  float s = 0, s2 = 0;
+#if W > 1
+  PcktVec k = VEC_SET1 (ref);
+  PcktVec vs = VEC_ZERO ();
+  PcktVec vs2 = VEC_ZERO ();
+  for (; i + W <= n; i += W)
+    {
+      PcktVec d = VEC_SUB (VEC_LOAD (buf + i), k);
+      vs = VEC_ADD (vs, d);
+      vs2 = VEC_ADD (vs2, VEC_MUL (d, d));
+    }
+  s = vec_hsum (vs);
+  s2 = vec_hsum (vs2);
+#endif
+  for (; i < n; ++i)
+    {
+      float d = buf[i] - ref;
+      s += d;
+      s2 += d * d;
+    }
+  *sum += s;
+  *sum2 += s2;
+}
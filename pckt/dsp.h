@@ -0,0 +1,74 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCKT_DSP_H
+#define PCKT_DSP_H 1
+
+#include <stddef.h>
+#include "pckt.h"
+
+/* Number of floats processed per vector operation.  The instruction set is
+   picked at compile time, `-mavx' selects 8 lanes and plain SSE 4 lanes.  */
+#if defined (__AVX__)
+# define PCKT_DSP_WIDTH 8
+#elif defined (__SSE__)
+# define PCKT_DSP_WIDTH 4
+#else
+# define PCKT_DSP_WIDTH 1
+#endif
+
+__BEGIN_DECLS
+
+/* Gain envelope of one block in closed form, see `pckt_dsp_envelope_apply'.
+   LENGTH is the clamp point after which the gain is zero.  */
+typedef struct {
+  float gain;
+  float step;
+  float factor;
+  size_t length;
+} PcktDspEnvelope;
+
+/* Precomputed one-pole lowpass coefficients.  With vector support TAPS and
+   FEEDBACK hold the filter response unrolled over PCKT_DSP_WIDTH frames so
+   that a whole vector of output can be computed from the previous output.  */
+typedef struct {
+  float coeff;
+  float gain;
+#if PCKT_DSP_WIDTH > 1
+  float taps[PCKT_DSP_WIDTH][PCKT_DSP_WIDTH];
+  float feedback[PCKT_DSP_WIDTH];
+#endif
+} PcktDspSmoother;
+
+extern void pckt_dsp_scale (float *, size_t, float);
+extern void pckt_dsp_envelope_constant (PcktDspEnvelope *, float);
+extern void pckt_dsp_envelope_linear (PcktDspEnvelope *, float, float);
+extern void pckt_dsp_envelope_exp (PcktDspEnvelope *, float, float);
+extern float pckt_dsp_envelope_apply (const PcktDspEnvelope *, float *,
+                                      size_t);
+extern void pckt_dsp_smoother_init (PcktDspSmoother *, float);
+extern float pckt_dsp_smooth (const PcktDspSmoother *, float *, size_t, float);
+extern void pckt_dsp_mix (float *, const float *, size_t);
+extern void pckt_dsp_from_int16 (float *, const int16_t *, size_t, float);
+extern void pckt_dsp_from_int24 (float *, const uint8_t *, size_t, float);
+extern float pckt_dsp_dot (const float *, const float *, size_t);
+extern float pckt_dsp_peak (const float *, size_t);
+extern void pckt_dsp_moments (const float *, size_t, float, float *, float *);
+
+__END_DECLS
+
+#endif /* ! PCKT_DSP_H */
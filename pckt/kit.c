@@ -17,23 +17,67 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "kit.h"
 
 #define MAX_NUM_DRUMS (INT8_MAX + 1)
+#define ARENA_BLOCK_SIZE ((size_t) 256 << 10) /* Fits a few drums.  */
+
+/* Chokes are kept as one list per choker.  Nodes are only ever prepended
+   (and disabled rather than unlinked) so the audio thread can walk a list
+   while the worker adds drums to the kit.  They are freed with the arena
+   of the kit.  */
+typedef struct ChokeNodeImpl ChokeNode;
+struct ChokeNodeImpl
+{
+  int8_t chokee;
+  ChokeNode *next;
+};
+
+/* A warm sample of a drum that could be cooled, see `pckt_kit_cool'.  */
+typedef struct {
+  PcktKit *kit;
+  PcktDrum *drum;
+  PcktChannel ch;
+  size_t index;
+  uint64_t used;
+  size_t size;
+} ResidentSample;
 
 struct PcktKitImpl
 {
   PcktDrum *drums[MAX_NUM_DRUMS];
   PcktDrumMeta *drum_metas[MAX_NUM_DRUMS];
-  bool chokemap[MAX_NUM_DRUMS][MAX_NUM_DRUMS];
+  ChokeNode *chokees[MAX_NUM_DRUMS];
+  PcktArena *arena;
+  void *held;  /* Viewed by samples of the drums, see `pckt_kit_hold'.  */
+  PcktKitReleaseCb release;
+  size_t budget;  /* Bytes of sample memory, zero if unlimited.  */
+  size_t memory;  /* Bytes of sample memory taken at the last cooling.  */
+  PcktKit *next;  /* Next kit with a budget.  */
 };
 
+/* Kits with a budget in this process.  They share the sum of their budgets
+   and their samples are cooled together, so that idle kits give memory to
+   busy ones.  BUDGET_LOCK also keeps drums from being freed while they are
+   being cooled.  */
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static PcktKit *budget_kits;
+
 PcktKit *
 pckt_kit_new ()
 {
   PcktKit *kit = malloc (sizeof (PcktKit));
   if (kit)
-    memset (kit, 0, sizeof (PcktKit));
+    {
+      memset (kit, 0, sizeof (PcktKit));
+      kit->arena = pckt_arena_new (ARENA_BLOCK_SIZE);
+      if (!kit->arena)
+        {
+          free (kit);
+          kit = NULL;
+        }
+    }
   return kit;
 }
 
@@ -42,6 +86,7 @@ pckt_kit_free (PcktKit *kit)
 {
   if (!kit)
     return;
+  pckt_kit_set_budget (kit, 0);
   for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
     {
       if (kit->drums[i])
@@ -49,9 +94,35 @@ pckt_kit_free (PcktKit *kit)
       if (kit->drum_metas[i])
         pckt_drum_meta_free (kit->drum_metas[i]);
     }
+  pckt_arena_free (kit->arena);
+  if (kit->release)
+    kit->release (kit->held);
   free (kit);
 }
 
+/* Get the arena freed with KIT, for drums and metas built for it with
+   `pckt_drum_new_in' and `pckt_drum_meta_new_in'.  The arena is not locked
+   and is only to be used by the thread adding drums to the kit.  */
+PcktArena *
+pckt_kit_get_arena (PcktKit *kit)
+{
+  return kit ? kit->arena : NULL;
+}
+
+/* Let KIT pass DATA to RELEASE once its drums are freed, for drums with
+   samples viewing memory that isn't theirs.  A kit holds at most one such
+   reference.  */
+bool
+pckt_kit_hold (PcktKit *kit, void *data, PcktKitReleaseCb release)
+{
+  if (!kit || !release || kit->release)
+    return false;
+
+  kit->held = data;
+  kit->release = release;
+  return true;
+}
+
 int8_t
 pckt_kit_add_drum (PcktKit *kit, PcktDrum *drum, int8_t id)
 {
@@ -68,6 +139,266 @@ pckt_kit_add_drum (PcktKit *kit, PcktDrum *drum, int8_t id)
   return id;
 }
 
+/* Resample all drums of KIT to RATE using interpolation INTRPL, see
+   `pckt_drum_resample', so that they can be played back at RATE without
+   interpolating.  */
+bool
+pckt_kit_resample (PcktKit *kit, uint32_t rate, PcktInterpolation intrpl)
+{
+  if (!kit || !rate)
+    return false;
+
+  for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
+    {
+      if (kit->drums[i] && !pckt_drum_resample (kit->drums[i], rate, intrpl))
+        return false;
+    }
+  return true;
+}
+
+/* Store the samples of all drums of KIT as FORMAT.  */
+bool
+pckt_kit_compact (PcktKit *kit, PcktSampleFormat format)
+{
+  if (!kit)
+    return false;
+
+  for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
+    {
+      if (kit->drums[i] && !pckt_drum_compact (kit->drums[i], format))
+        return false;
+    }
+  return true;
+}
+
+/* Get the bytes of memory taken by the warm samples of DRUM.  */
+static size_t
+get_drum_memory (const PcktDrum *drum)
+{
+  size_t memory = 0;
+  for (PcktChannel ch = PCKT_CH0; drum && ch < PCKT_NCHANNELS; ++ch)
+    {
+      size_t nsamples = pckt_drum_get_nsamples (drum, ch);
+      for (size_t index = 0; index < nsamples; ++index)
+        memory += pckt_drum_get_resident (drum, ch, index, NULL);
+    }
+  return memory;
+}
+
+/* Get the bytes by which the samples of all kits with a budget, and those
+   of DRUM unless it's NULL, exceed the sum of the budgets.  Must be called
+   with BUDGET_LOCK held.  */
+static size_t
+get_excess (const PcktDrum *drum)
+{
+  size_t budget = 0, total = get_drum_memory (drum);
+  for (PcktKit *item = budget_kits; item; item = item->next)
+    {
+      budget += item->budget;
+      for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
+        total += get_drum_memory (item->drums[i]);
+    }
+  return (total > budget) ? total - budget : 0;
+}
+
+/* Move samples of drums of KIT into files in DIR while the kits with a
+   budget take more memory than their budgets allow, so that enough of
+   them can be cooled, see `pckt_drum_spill'.  Must be called before KIT
+   is played.  Returns the bytes moved.  */
+size_t
+pckt_kit_spill (PcktKit *kit, const char *dir)
+{
+  size_t nspilled = 0;
+  if (!kit || !kit->budget)
+    return nspilled;
+
+  pthread_mutex_lock (&budget_lock);
+  size_t excess = get_excess (NULL);
+  for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0 && nspilled < excess; --i)
+    nspilled += pckt_drum_spill (kit->drums[i], dir, excess - nspilled);
+  pthread_mutex_unlock (&budget_lock);
+
+  return nspilled;
+}
+
+/* Move samples of DRUM, which is about to be added to KIT, into files in
+   DIR if adding it would take KIT over budget, see `pckt_kit_spill'.  */
+size_t
+pckt_kit_spill_drum (PcktKit *kit, PcktDrum *drum, const char *dir)
+{
+  if (!kit || !drum || !kit->budget)
+    return 0;
+
+  pthread_mutex_lock (&budget_lock);
+  size_t excess = get_excess (drum);
+  size_t nspilled = excess ? pckt_drum_spill (drum, dir, excess) : 0;
+  pthread_mutex_unlock (&budget_lock);
+
+  return nspilled;
+}
+
+/* Limit the memory taken by the samples of KIT to BUDGET bytes, or lift
+   the limit if BUDGET is zero.  The limit is enforced by `pckt_kit_cool'
+   together with those of all other kits.  */
+bool
+pckt_kit_set_budget (PcktKit *kit, size_t budget)
+{
+  if (!kit)
+    return false;
+
+  pthread_mutex_lock (&budget_lock);
+  PcktKit **item = &budget_kits;
+  while (*item && *item != kit)
+    item = &(*item)->next;
+  if (budget && !*item)
+    {
+      kit->next = NULL;
+      *item = kit;
+    }
+  else if (!budget && *item)
+    *item = kit->next;
+  kit->budget = budget;
+  pthread_mutex_unlock (&budget_lock);
+
+  return true;
+}
+
+size_t
+pckt_kit_get_budget (const PcktKit *kit)
+{
+  return kit ? kit->budget : 0;
+}
+
+/* Gather the warm samples of KIT into RESIDENT, or only count them if
+   RESIDENT is NULL, and sum up the memory they take in the kit.  Returns
+   the number of samples.  */
+static size_t
+get_resident_samples (PcktKit *kit, ResidentSample *resident)
+{
+  size_t nresident = 0;
+  kit->memory = 0;
+
+  for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
+    {
+      PcktDrum *drum = kit->drums[i];
+      for (PcktChannel ch = PCKT_CH0; drum && ch < PCKT_NCHANNELS; ++ch)
+        {
+          size_t nsamples = pckt_drum_get_nsamples (drum, ch);
+          for (size_t index = 0; index < nsamples; ++index)
+            {
+              uint64_t used;
+              size_t size = pckt_drum_get_resident (drum, ch, index, &used);
+              if (size == 0)
+                continue;
+              kit->memory += size;
+              if (resident)
+                {
+                  ResidentSample *rs = &resident[nresident];
+                  rs->kit = kit;
+                  rs->drum = drum;
+                  rs->ch = ch;
+                  rs->index = index;
+                  rs->used = used;
+                  rs->size = size;
+                }
+              ++nresident;
+            }
+        }
+    }
+
+  return nresident;
+}
+
+static int
+resident_sample_cmp (const void *lhs, const void *rhs)
+{
+  const ResidentSample *a = (const ResidentSample *) lhs;
+  const ResidentSample *b = (const ResidentSample *) rhs;
+  if (a->used != b->used)
+    return (a->used < b->used) ? -1 : 1;
+  /* Cool soft samples before loud ones that have never been hit.  */
+  return (a->index < b->index) ? -1 : (a->index > b->index);
+}
+
+/* Cool the least recently hit samples of all kits with a budget until their
+   samples take no more memory than the sum of the budgets, see
+   `pckt_drum_cool'.  Only mapped samples can be cooled.  Returns the bytes
+   of memory still taken by the samples of KIT.  */
+size_t
+pckt_kit_cool (PcktKit *kit)
+{
+  if (!kit)
+    return 0;
+
+  pthread_mutex_lock (&budget_lock);
+
+  size_t nresident = 0, budget = 0, total = 0;
+  for (PcktKit *item = budget_kits; item; item = item->next)
+    {
+      nresident += get_resident_samples (item, NULL);
+      budget += item->budget;
+      total += item->memory;
+    }
+
+  ResidentSample *resident = NULL;
+  if (total > budget)
+    resident = malloc (nresident * sizeof (ResidentSample));
+
+  if (resident)
+    {
+      nresident = 0;
+      for (PcktKit *item = budget_kits; item; item = item->next)
+        nresident += get_resident_samples (item, resident + nresident);
+
+      qsort (resident, nresident, sizeof (ResidentSample),
+             resident_sample_cmp);
+      for (size_t i = 0; i < nresident && total > budget; ++i)
+        {
+          ResidentSample *rs = &resident[i];
+          if (pckt_drum_cool (rs->drum, rs->ch, rs->index))
+            {
+              total -= rs->size;
+              rs->kit->memory -= rs->size;
+            }
+        }
+      free (resident);
+    }
+
+  if (!kit->budget)
+    get_resident_samples (kit, NULL);
+  size_t memory = kit->memory;
+
+  pthread_mutex_unlock (&budget_lock);
+  return memory;
+}
+
+/* Free DRUM after it has been removed from a kit, once no kits are being
+   cooled.  */
+void
+pckt_kit_free_drum (PcktDrum *drum)
+{
+  pthread_mutex_lock (&budget_lock);
+  pckt_drum_free (drum);
+  pthread_mutex_unlock (&budget_lock);
+}
+
+/* Set interpolation used by sounds of all drums in KIT, see
+   `pckt_drum_set_interpolation'.  */
+bool
+pckt_kit_set_interpolation (PcktKit *kit, PcktInterpolation intrpl)
+{
+  if (!kit)
+    return false;
+
+  for (int8_t i = MAX_NUM_DRUMS - 1; i >= 0; --i)
+    {
+      if (kit->drums[i] && !pckt_drum_set_interpolation (kit->drums[i],
+                                                         intrpl))
+        return false;
+    }
+  return true;
+}
+
 PcktDrum *
 pckt_kit_get_drum (const PcktKit *kit, int8_t id)
 {
@@ -148,7 +479,36 @@ pckt_kit_set_choke (PcktKit *kit, int8_t choker, int8_t chokee, bool choke)
 {
   if (!kit || choker < 0 || chokee < 0)
     return false;
-  kit->chokemap[choker][chokee] = choke;
+
+  ChokeNode *node, *unused = NULL;
+  for (node = kit->chokees[choker]; node; node = node->next)
+    {
+      if (node->chokee == chokee)
+        {
+          if (!choke)
+            node->chokee = -1;
+          return true;
+        }
+      else if (node->chokee < 0)
+        unused = node;
+    }
+
+  if (!choke)
+    return true;
+  else if (unused)
+    {
+      unused->chokee = chokee;
+      return true;
+    }
+
+  node = pckt_arena_alloc (kit->arena, sizeof (ChokeNode));
+  if (!node)
+    return false;
+
+  node->chokee = chokee;
+  node->next = kit->chokees[choker];
+  __atomic_store_n (&kit->chokees[choker], node, __ATOMIC_RELEASE);
+
   return true;
 }
 
@@ -158,10 +518,12 @@ pckt_kit_choke_by_id (const PcktKit *kit, PcktSoundPool *pool, int8_t choker)
   if (!kit || !pool || choker < 0)
     return false;
 
-  for (int8_t chokee = MAX_NUM_DRUMS - 1; chokee >= 0; --chokee)
+  for (const ChokeNode *node = __atomic_load_n (&kit->chokees[choker],
+                                                __ATOMIC_ACQUIRE);
+       node; node = node->next)
     {
-      if (kit->drums[chokee] != NULL && kit->chokemap[choker][chokee] == true)
-        pckt_soundpool_choke (pool, kit->drums[chokee]);
+      if (node->chokee >= 0 && kit->drums[node->chokee] != NULL)
+        pckt_soundpool_choke (pool, kit->drums[node->chokee]);
     }
 
   return true;
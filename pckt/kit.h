@@ -31,11 +31,23 @@
 __BEGIN_DECLS
 
 typedef struct PcktKitImpl PcktKit;
+typedef void (*PcktKitReleaseCb) (void *);
 
 extern PcktKit *pckt_kit_new ();
 extern void pckt_kit_free (PcktKit *);
+extern PcktArena *pckt_kit_get_arena (PcktKit *);
+extern bool pckt_kit_hold (PcktKit *, void *, PcktKitReleaseCb);
 extern int8_t pckt_kit_add_drum (PcktKit *, PcktDrum *, int8_t);
 extern PcktDrum *pckt_kit_get_drum (const PcktKit *, int8_t);
+extern bool pckt_kit_resample (PcktKit *, uint32_t, PcktInterpolation);
+extern bool pckt_kit_compact (PcktKit *, PcktSampleFormat);
+extern size_t pckt_kit_spill (PcktKit *, const char *);
+extern size_t pckt_kit_spill_drum (PcktKit *, PcktDrum *, const char *);
+extern bool pckt_kit_set_budget (PcktKit *, size_t);
+extern size_t pckt_kit_get_budget (const PcktKit *);
+extern size_t pckt_kit_cool (PcktKit *);
+extern void pckt_kit_free_drum (PcktDrum *);
+extern bool pckt_kit_set_interpolation (PcktKit *, PcktInterpolation);
 extern int8_t pckt_kit_add_drum_meta (PcktKit *, PcktDrumMeta *);
 extern PcktDrumMeta *pckt_kit_get_drum_meta (const PcktKit *, int8_t);
 extern int8_t pckt_kit_get_drum_meta_id (const PcktKit *, const PcktDrumMeta *);
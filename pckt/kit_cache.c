@@ -0,0 +1,1031 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kit_cache.h"
+#include "util.h"
+
+/* A kit cache holds a fully built kit at one sample rate, so that loading
+   it again takes one mapping of the file.  */
+#define CACHE_MAGIC "PCKTKIT1"
+#define RECORD_ALIGN 8
+#define FRAMES_ALIGN 64
+
+/* If this environment variable is set kit caches are kept in a directory
+   of the user under SHM_DIR, which is backed by memory, rather than with
+   the sample caches.  Every process of the user loading a kit at the same
+   rate then maps the same pages.  */
+#define SHM_ENV "PCKT_KIT_CACHE_SHM"
+#define SHM_DIR "/dev/shm"
+
+/* Header of a kit cache file.  It is followed by the name of the kit file,
+   NMETAS meta records and NDRUMS drum records.  A drum record is followed
+   by its chokers and NSAMPLES sample records, and a sample record by its
+   name, its levels and its frames.  Names are NUL terminated, items start
+   at multiples of RECORD_ALIGN and frames at multiples of FRAMES_ALIGN.  */
+typedef struct {
+  char magic[8];
+  uint32_t rate;
+  uint32_t namelen;
+  uint32_t nmetas;
+  uint32_t ndrums;
+  int64_t mtime;
+  int64_t size;
+  uint64_t end;
+} CacheHeader;
+
+typedef struct {
+  float tuning;
+  float dampening;
+  float expression;
+  float overlap;
+  float voice_limit;
+  uint32_t namelen;
+} MetaRecord;
+
+typedef struct {
+  uint32_t meta;  /* Index of the meta record of the drum.  */
+  int32_t id;
+  int32_t interpolation;
+  uint32_t nchokers;
+  uint32_t nsamples;
+  float bleed[PCKT_NCHANNELS];
+} DrumRecord;
+
+typedef struct {
+  uint32_t channel;
+  uint32_t rate;
+  int32_t interpolation;
+  uint32_t namelen;
+  uint64_t nframes;
+  uint64_t nlevels;
+  int64_t mtime;  /* Of the source file named by the sample, if any.  */
+  int64_t size;
+} SampleRecord;
+
+/* The cache of one kit file at one rate as known to this process.  Kits
+   loading a kit that is being cached by another kit of the process wait
+   for it and map the result, rather than decoding the same files again.
+   Without a cache directory the cache is written to an unlinked file that
+   is kept open for as long as any kit refers to it.  */
+typedef struct _SharedCache SharedCache;
+struct _SharedCache {
+  char *key;     /* Kit file name and rate.  */
+  int fd;        /* Unlinked cache file, or -1 to open it by name.  */
+  int lock_fd;   /* Locked by WRITER against other processes, or -1.  */
+  size_t nrefs;  /* Parsers, kits and the writer referring to the cache.  */
+  const PcktKitFactory *writer;  /* Factory writing the cache, if any.  */
+  pthread_t thread;              /* Thread loading the kit of WRITER.  */
+  SharedCache *next;
+};
+
+/* What a kit holds on to while its drums view a mapped cache.  */
+typedef struct {
+  SharedCache *shared;
+  void *base;
+  size_t size;
+} CacheHold;
+
+struct PcktKitCacheImpl
+{
+  const PcktKitFactory *factory;
+  PcktKit *kit;
+  SharedCache *shared;
+  char *filename;  /* NULL if the cache is unlinked.  */
+  char *tmp;
+  FILE *file;
+  CacheHeader header;
+  bool ok;
+};
+
+typedef struct {
+  PcktKitParserIface iface;
+  const PcktKitFactory *factory;
+  SharedCache *shared;  /* Referred to until handed to a kit.  */
+  const char *base;
+  size_t size;
+  bool owned;  /* Whether the mapping is unmapped with the parser.  */
+  const MetaRecord **metas;
+  const DrumRecord **drums;
+} CacheParser;
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shared_written = PTHREAD_COND_INITIALIZER;
+static SharedCache *shared_caches;
+
+/* Bounds checked reader of the mapped records of a cache.  */
+typedef struct {
+  const char *base;
+  size_t size;
+  size_t offset;
+} Cursor;
+
+static inline size_t
+align_up (size_t offset, size_t align)
+{
+  return ((offset + align - 1) / align) * align;
+}
+
+static bool
+cache_in_shm ()
+{
+  const char *shm = getenv (SHM_ENV);
+  return shm && *shm && strcmp (shm, "0");
+}
+
+/* Get the part of cache names telling how the samples of the kit of
+   FACTORY are resampled, which is empty for the default of sinc.  */
+static const char *
+get_method (const PcktKitFactory *factory)
+{
+  if (!pckt_kit_factory_get_rate (factory))
+    return "";
+
+  switch (pckt_kit_factory_get_interpolation (factory))
+    {
+    case PCKT_INTRPL_CONSTANT:
+      return "-constant";
+    case PCKT_INTRPL_LINEAR:
+      return "-linear";
+    default:
+      return "";
+    }
+}
+
+/* Get the directory of kit caches of this user in SHM_DIR, creating it if
+   missing, or NULL if it isn't a directory only the user can write to.  */
+static char *
+get_shm_dir ()
+{
+  uid_t uid = getuid ();
+  char *dir = pckt_strdupf ("%s%cindiepocket-%lu", SHM_DIR, PCKT_DIR_SEP,
+                            (unsigned long) uid);
+  if (!dir)
+    return NULL;
+
+  mkdir (dir, 0700); /* Fails harmlessly if it exists.  */
+  struct stat st;
+  if (lstat (dir, &st) != 0 || !S_ISDIR (st.st_mode) || st.st_uid != uid
+      || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+      free (dir);
+      return NULL;
+    }
+  return dir;
+}
+
+static char *
+get_cache_filename (const PcktKitFactory *factory)
+{
+  char suffix[48];
+  snprintf (suffix, sizeof suffix, "-%u%s.kit",
+            pckt_kit_factory_get_rate (factory), get_method (factory));
+  const char *filename = pckt_kit_factory_get_filename (factory);
+  if (cache_in_shm ())
+    {
+      char *dir = get_shm_dir ();
+      char *path = pckt_cache_path_in (dir, filename, suffix);
+      free (dir);
+      return path;
+    }
+  return pckt_cache_path (filename, suffix);
+}
+
+/* Get a new reference to the shared cache of the kit of FACTORY, or NULL if
+   out of memory.  Called with SHARED_LOCK held.  */
+static SharedCache *
+shared_get (const PcktKitFactory *factory)
+{
+  char *key = pckt_strdupf ("%s-%u%s",
+                            pckt_kit_factory_get_filename (factory),
+                            pckt_kit_factory_get_rate (factory),
+                            get_method (factory));
+  if (!key)
+    return NULL;
+
+  SharedCache *shared = shared_caches;
+  while (shared && strcmp (shared->key, key))
+    shared = shared->next;
+
+  if (shared)
+    free (key);
+  else if ((shared = malloc (sizeof (SharedCache))))
+    {
+      memset (shared, 0, sizeof (SharedCache));
+      shared->key = key;
+      shared->fd = -1;
+      shared->lock_fd = -1;
+      shared->next = shared_caches;
+      shared_caches = shared;
+    }
+  else
+    {
+      free (key);
+      return NULL;
+    }
+
+  ++shared->nrefs;
+  return shared;
+}
+
+/* Drop a reference to SHARED.  Called with SHARED_LOCK held.  */
+static void
+shared_put (SharedCache *shared)
+{
+  if (!shared || --shared->nrefs > 0)
+    return;
+
+  SharedCache **item = &shared_caches;
+  while (*item != shared)
+    item = &(*item)->next;
+  *item = shared->next;
+
+  if (shared->fd >= 0)
+    close (shared->fd);
+  free (shared->key);
+  free (shared);
+}
+
+static void
+shared_drop (SharedCache *shared)
+{
+  pthread_mutex_lock (&shared_lock);
+  shared_put (shared);
+  pthread_mutex_unlock (&shared_lock);
+}
+
+/* Make FACTORY the writer of SHARED, handing it a reference.  Returns false
+   if another factory is writing it.  Called with SHARED_LOCK held.  */
+static bool
+shared_claim (SharedCache *shared, const PcktKitFactory *factory)
+{
+  if (shared->writer == factory)
+    {
+      shared_put (shared);  /* It already has a reference.  */
+      return true;
+    }
+  else if (shared->writer)
+    return false;
+
+  shared->writer = factory;
+  shared->thread = pthread_self ();
+  return true;
+}
+
+/* Let kits waiting for SHARED to be written go on.  */
+static void
+shared_release (SharedCache *shared)
+{
+  if (!shared)
+    return;
+
+  pthread_mutex_lock (&shared_lock);
+  if (shared->lock_fd >= 0)
+    close (shared->lock_fd);
+  shared->lock_fd = -1;
+  shared->writer = NULL;
+  pthread_cond_broadcast (&shared_written);
+  shared_put (shared);
+  pthread_mutex_unlock (&shared_lock);
+}
+
+static void
+release_hold (void *data)
+{
+  CacheHold *hold = (CacheHold *) data;
+  if (hold->base)
+    munmap (hold->base, hold->size);
+  shared_drop (hold->shared);
+  free (hold);
+}
+
+/* Let KIT keep a reference to SHARED, and to BASE of SIZE bytes if not
+   NULL.  */
+static bool
+hold_shared (PcktKit *kit, SharedCache *shared, void *base, size_t size)
+{
+  CacheHold *hold = malloc (sizeof (CacheHold));
+  if (!hold)
+    return false;
+
+  hold->shared = shared;
+  hold->base = base;
+  hold->size = size;
+  if (!pckt_kit_hold (kit, hold, release_hold))
+    {
+      free (hold);
+      return false;
+    }
+  return true;
+}
+
+/* Get the status of the file a sample called NAME was loaded from.  */
+static bool
+stat_source (const PcktKitFactory *factory, const char *name,
+             struct stat *st)
+{
+  if (name[0] == PCKT_DIR_SEP)
+    return stat (name, st) == 0;
+
+  char *path = pckt_kit_factory_get_abspath (factory, name);
+  bool ok = path && (stat (path, st) == 0);
+  free (path);
+  return ok;
+}
+
+static const void *
+cursor_take (Cursor *cursor, size_t size, size_t align)
+{
+  size_t offset = align_up (cursor->offset, align);
+  if (offset > cursor->size || size > cursor->size - offset)
+    return NULL;
+
+  cursor->offset = offset + size;
+  return cursor->base + offset;
+}
+
+/* Take a name of NAMELEN characters, which must be NUL terminated.  */
+static const char *
+cursor_take_name (Cursor *cursor, uint32_t namelen)
+{
+  const char *name = cursor_take (cursor, (size_t) namelen + 1,
+                                  RECORD_ALIGN);
+  return (name && name[namelen] == '\0') ? name : NULL;
+}
+
+/* Check the samples following drum record DR at CURSOR.  */
+static bool
+check_samples (const CacheParser *parser, Cursor *cursor,
+               const DrumRecord *dr)
+{
+  for (uint32_t i = 0; i < dr->nsamples; ++i)
+    {
+      const SampleRecord *sr = cursor_take (cursor, sizeof (SampleRecord),
+                                            RECORD_ALIGN);
+      if (!sr || sr->channel >= PCKT_NCHANNELS || !sr->rate || !sr->nframes
+          || sr->nframes > SIZE_MAX / sizeof (float)
+          || sr->nlevels > SIZE_MAX / (2 * sizeof (float)))
+        return false;
+
+      struct stat st;
+      const char *name = sr->namelen ? cursor_take_name (cursor,
+                                                         sr->namelen) : "";
+      if (!name
+          || (sr->namelen && (!stat_source (parser->factory, name, &st)
+                              || sr->mtime != (int64_t) st.st_mtime
+                              || sr->size != (int64_t) st.st_size))
+          || !cursor_take (cursor, 2 * sr->nlevels * sizeof (float),
+                           RECORD_ALIGN)
+          || !cursor_take (cursor, sr->nframes * sizeof (float),
+                           FRAMES_ALIGN))
+        return false;
+    }
+
+  return true;
+}
+
+/* Index the records of the mapped cache of PARSER and check that the kit
+   and every sample source are unchanged since it was written.  */
+static bool
+check_cache (CacheParser *parser)
+{
+  const char *filename = pckt_kit_factory_get_filename (parser->factory);
+  Cursor cursor = {parser->base, parser->size, 0};
+  const CacheHeader *header = cursor_take (&cursor, sizeof (CacheHeader),
+                                           RECORD_ALIGN);
+  struct stat st;
+  if (!header || memcmp (header->magic, CACHE_MAGIC, sizeof header->magic)
+      || header->rate != pckt_kit_factory_get_rate (parser->factory)
+      || header->end != parser->size
+      || stat (filename, &st) != 0
+      || header->mtime != (int64_t) st.st_mtime
+      || header->size != (int64_t) st.st_size
+      || header->namelen != strlen (filename))
+    return false;
+
+  const char *name = cursor_take_name (&cursor, header->namelen);
+  if (!name || strcmp (name, filename))
+    return false;
+
+  /* Every record takes at least its own size, so larger counts cannot be
+     met by the rest of the file.  */
+  size_t left = parser->size - cursor.offset;
+  if (header->nmetas > left / sizeof (MetaRecord)
+      || header->ndrums > left / sizeof (DrumRecord))
+    return false;
+
+  parser->metas = calloc ((size_t) header->nmetas + 1,
+                          sizeof (MetaRecord *));
+  parser->drums = calloc ((size_t) header->ndrums + 1,
+                          sizeof (DrumRecord *));
+  if (!parser->metas || !parser->drums)
+    return false;
+
+  for (uint32_t i = 0; i < header->nmetas; ++i)
+    {
+      const MetaRecord *mr = cursor_take (&cursor, sizeof (MetaRecord),
+                                          RECORD_ALIGN);
+      if (!mr || !cursor_take_name (&cursor, mr->namelen))
+        return false;
+      parser->metas[i] = mr;
+    }
+
+  for (uint32_t i = 0; i < header->ndrums; ++i)
+    {
+      const DrumRecord *dr = cursor_take (&cursor, sizeof (DrumRecord),
+                                          RECORD_ALIGN);
+      if (!dr || dr->meta >= header->nmetas || dr->id < 0
+          || dr->id > INT8_MAX
+          || !cursor_take (&cursor, dr->nchokers, RECORD_ALIGN)
+          || !check_samples (parser, &cursor, dr))
+        return false;
+      parser->drums[i] = dr;
+    }
+
+  return true;
+}
+
+static PcktStatus
+cache_parser_load_metas (PcktKitParserIface *iface, PcktKitFactory *factory,
+                         PcktKitFactoryDrumMetaCb callback)
+{
+  CacheParser *parser = (CacheParser *) iface;
+  PcktArena *arena = pckt_kit_factory_get_arena (factory);
+
+  for (const MetaRecord **mr = parser->metas; *mr; ++mr)
+    {
+      PcktDrumMeta *meta = pckt_drum_meta_new_in (arena,
+                                                  (const char *) (*mr + 1));
+      if (!meta)
+        return PCKTE_NOMEM;
+
+      pckt_drum_meta_set_tuning (meta, (*mr)->tuning);
+      pckt_drum_meta_set_dampening (meta, (*mr)->dampening);
+      pckt_drum_meta_set_expression (meta, (*mr)->expression);
+      pckt_drum_meta_set_sample_overlap (meta, (*mr)->overlap);
+      pckt_drum_meta_set_voice_limit (meta, (*mr)->voice_limit);
+      callback (factory, meta, *mr);
+    }
+
+  return PCKTE_SUCCESS;
+}
+
+/* Create the drum of record DR of PARSER with samples viewing the mapped
+   frames, and get its chokers in *CHOKERS.  */
+static PcktDrum *
+load_drum (const CacheParser *parser, const DrumRecord *dr,
+           const PcktDrumMeta *meta, const int8_t **chokers)
+{
+  const PcktKitFactory *factory = parser->factory;
+  PcktArena *arena = pckt_kit_factory_get_arena (factory);
+  PcktDrum *drum = pckt_drum_new_in (arena);
+  if (!drum)
+    return NULL;
+
+  pckt_drum_set_meta (drum, meta);
+  pckt_drum_set_interpolation (drum, (PcktInterpolation) dr->interpolation);
+
+  /* The records have been checked by `check_cache'.  */
+  Cursor cursor = {
+    parser->base, parser->size,
+    ((const char *) dr - parser->base) + sizeof (DrumRecord)
+  };
+  *chokers = cursor_take (&cursor, dr->nchokers, RECORD_ALIGN);
+
+  for (uint32_t i = 0; i < dr->nsamples; ++i)
+    {
+      const SampleRecord *sr = cursor_take (&cursor, sizeof (SampleRecord),
+                                            RECORD_ALIGN);
+      const char *name = sr->namelen ? cursor_take (&cursor, sr->namelen + 1,
+                                                    RECORD_ALIGN) : NULL;
+      const float *levels = cursor_take (&cursor,
+                                         2 * sr->nlevels * sizeof (float),
+                                         RECORD_ALIGN);
+      const float *frames = cursor_take (&cursor,
+                                         sr->nframes * sizeof (float),
+                                         FRAMES_ALIGN);
+
+      PcktSample *sample = pckt_sample_view (frames, sr->nframes, sr->rate);
+      if (!sample)
+        continue;
+
+      pckt_sample_set_interpolation (sample,
+                                     (PcktInterpolation) sr->interpolation);
+      pckt_sample_set_allocator (sample,
+                                 pckt_kit_factory_get_allocator (factory));
+      if (sr->nlevels)
+        pckt_sample_set_levels (sample, levels, sr->nlevels);
+      pckt_sample_lock (sample, PCKT_SAMPLE_ATTACK_FRAMES);
+      if (!pckt_drum_add_sample (drum, sample, (PcktChannel) sr->channel,
+                                 name))
+        pckt_sample_free (sample);
+    }
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    pckt_drum_set_bleed (drum, ch, dr->bleed[ch]);
+
+  return drum;
+}
+
+static PcktStatus
+cache_parser_load_drums (PcktKitParserIface *iface, PcktDrumMeta *meta,
+                         const void *handle, PcktKitFactoryDrumCb callback,
+                         void *user_handle)
+{
+  CacheParser *parser = (CacheParser *) iface;
+
+  uint32_t index = 0;
+  while (parser->metas[index] && parser->metas[index] != handle)
+    ++index;
+  if (!parser->metas[index])
+    return PCKTE_INVAL;
+
+  for (const DrumRecord **dr = parser->drums; *dr; ++dr)
+    {
+      if ((*dr)->meta != index)
+        continue;
+
+      const int8_t *chokers = NULL;
+      PcktDrum *drum = load_drum (parser, *dr, meta, &chokers);
+      if (drum)
+        callback (user_handle, drum, (int8_t) (*dr)->id, chokers,
+                  (*dr)->nchokers);
+    }
+
+  return PCKTE_SUCCESS;
+}
+
+static void
+cache_parser_free (PcktKitParserIface *iface, const PcktKitFactory *factory)
+{
+  CacheParser *parser = (CacheParser *) iface;
+  (void) factory;
+
+  if (parser->owned)
+    munmap ((void *) parser->base, parser->size);
+  if (parser->shared)
+    shared_drop (parser->shared);
+  free (parser->metas);
+  free (parser->drums);
+  free (parser);
+}
+
+/* Get a parser loading the kit of FACTORY from the cache file FD, or NULL
+   if it is stale.  */
+static CacheParser *
+map_cache (const PcktKitFactory *factory, int fd)
+{
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size >= (off_t) sizeof (CacheHeader))
+    mapping = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  /* Shared memory may then be served from huge pages.  */
+  if (cache_in_shm ())
+    madvise (mapping, (size_t) st.st_size, MADV_HUGEPAGE);
+#endif
+
+  CacheParser *parser = malloc (sizeof (CacheParser));
+  if (!parser)
+    {
+      munmap (mapping, (size_t) st.st_size);
+      return NULL;
+    }
+
+  memset (parser, 0, sizeof (CacheParser));
+  parser->iface.load_metas = cache_parser_load_metas;
+  parser->iface.load_drums = cache_parser_load_drums;
+  parser->iface.free = cache_parser_free;
+  parser->factory = factory;
+  parser->base = (const char *) mapping;
+  parser->size = (size_t) st.st_size;
+  parser->owned = true;
+
+  if (!check_cache (parser))
+    {
+      cache_parser_free ((PcktKitParserIface *) parser, factory);
+      return NULL;
+    }
+
+  return parser;
+}
+
+/* Get a parser loading the kit of FACTORY from the cache of SHARED.  Called
+   with SHARED_LOCK held.  */
+static CacheParser *
+open_shared (const PcktKitFactory *factory, SharedCache *shared)
+{
+  int fd = -1;
+  if (shared->fd >= 0)
+    fd = dup (shared->fd);
+  else
+    {
+      char *filename = get_cache_filename (factory);
+      if (filename)
+        fd = open (filename, O_RDONLY);
+      free (filename);
+    }
+
+  CacheParser *parser = (fd >= 0) ? map_cache (factory, fd) : NULL;
+  if (fd >= 0)
+    close (fd);
+  return parser;
+}
+
+/* Wait for any other process writing the cache of FACTORY and keep it from
+   doing so until SHARED is released.  Returns false if the cache has no
+   name or can't be locked.  */
+static bool
+lock_shared (const PcktKitFactory *factory, SharedCache *shared)
+{
+  char *filename = get_cache_filename (factory);
+  char *lockname = filename ? pckt_strdupf ("%s.lock", filename) : NULL;
+  int fd = lockname
+    ? open (lockname, O_RDWR | O_CREAT | O_NOFOLLOW, 0600) : -1;
+  free (lockname);
+  free (filename);
+  if (fd < 0)
+    return false;
+
+  int err;
+  while ((err = flock (fd, LOCK_EX)) != 0 && errno == EINTR)
+    ;
+  if (err != 0)
+    {
+      close (fd);
+      return false;
+    }
+
+  pthread_mutex_lock (&shared_lock);
+  shared->lock_fd = fd;
+  pthread_mutex_unlock (&shared_lock);
+  return true;
+}
+
+/* Get a parser loading the kit of FACTORY from its cache, or NULL if there
+   is no cache of the kit at the rate of FACTORY or it is stale.  If the kit
+   is being cached by another kit, of this process or another, this waits
+   for it to finish.  On a miss FACTORY is left to write the cache with
+   `pckt_kit_cache_new'.  */
+PcktKitParserIface *
+pckt_kit_cache_open (const PcktKitFactory *factory)
+{
+  pthread_mutex_lock (&shared_lock);
+  SharedCache *shared = shared_get (factory);
+  if (!shared)
+    {
+      pthread_mutex_unlock (&shared_lock);
+      return NULL;
+    }
+
+  while (shared->writer
+         && !pthread_equal (shared->thread, pthread_self ()))
+    pthread_cond_wait (&shared_written, &shared_lock);
+
+  CacheParser *parser = open_shared (factory, shared);
+  if (parser)
+    parser->shared = shared;
+  else if (!shared_claim (shared, factory))
+    {
+      shared_put (shared);
+      shared = NULL;
+    }
+  pthread_mutex_unlock (&shared_lock);
+
+  /* Kits of other files aren't kept waiting on other processes.  */
+  if (!parser && shared && lock_shared (factory, shared))
+    {
+      pthread_mutex_lock (&shared_lock);
+      parser = open_shared (factory, shared);
+      if (parser)
+        {
+          ++shared->nrefs;
+          parser->shared = shared;
+        }
+      pthread_mutex_unlock (&shared_lock);
+
+      /* Another process wrote it while we waited.  */
+      if (parser)
+        shared_release (shared);
+    }
+
+  return (PcktKitParserIface *) parser;
+}
+
+/* Hand the mapping of the cache of IFACE to KIT, which must outlive the
+   drums loaded from it.  */
+bool
+pckt_kit_cache_attach (PcktKitParserIface *iface, PcktKit *kit)
+{
+  CacheParser *parser = (CacheParser *) iface;
+  if (!parser || !parser->owned
+      || !hold_shared (kit, parser->shared, (void *) parser->base,
+                       parser->size))
+    return false;
+
+  parser->owned = false;
+  parser->shared = NULL;
+  return true;
+}
+
+static bool
+write_padded (PcktKitCache *cache, const void *data, size_t size,
+              size_t align)
+{
+  static const char zeros[FRAMES_ALIGN] = {0};
+  off_t offset = ftello (cache->file);
+  size_t pad = (offset < 0) ? 0 : align_up (offset, align) - offset;
+
+  cache->ok = cache->ok && (offset >= 0)
+    && (fwrite (zeros, 1, pad, cache->file) == pad)
+    && (!size || fwrite (data, 1, size, cache->file) == size);
+  return cache->ok;
+}
+
+/* Open an unlinked file for CACHE in the spill directory.  */
+static FILE *
+open_unlinked (PcktKitCache *cache)
+{
+  cache->tmp = pckt_strdupf ("%s%ckit-XXXXXX", pckt_spill_dir (),
+                             PCKT_DIR_SEP);
+  int fd = cache->tmp ? mkstemp (cache->tmp) : -1;
+  if (fd < 0)
+    return NULL;
+
+  unlink (cache->tmp);
+  FILE *file = fdopen (fd, "wb");
+  if (!file)
+    close (fd);
+  return file;
+}
+
+/* Start writing a cache of the kit of FACTORY as it's loaded into KIT.
+   Returns NULL if the kit is being cached by another factory.  */
+PcktKitCache *
+pckt_kit_cache_new (const PcktKitFactory *factory, PcktKit *kit)
+{
+  pthread_mutex_lock (&shared_lock);
+  SharedCache *shared = shared_get (factory);
+  if (shared && !shared_claim (shared, factory))
+    {
+      shared_put (shared);
+      shared = NULL;
+    }
+  pthread_mutex_unlock (&shared_lock);
+  if (!shared)
+    return NULL;
+
+  PcktKitCache *cache = malloc (sizeof (PcktKitCache));
+  if (!cache)
+    {
+      shared_release (shared);
+      return NULL;
+    }
+
+  memset (cache, 0, sizeof (PcktKitCache));
+  cache->factory = factory;
+  cache->kit = kit;
+  cache->shared = shared;
+
+  const char *filename = pckt_kit_factory_get_filename (factory);
+  struct stat st;
+  if (stat (filename, &st) != 0)
+    {
+      pckt_kit_cache_free (cache);
+      return NULL;
+    }
+
+  cache->filename = get_cache_filename (factory);
+  if (cache->filename)
+    {
+      /* Created anew, never through a link planted at the name.  */
+      cache->tmp = pckt_strdupf ("%s.XXXXXX", cache->filename);
+      int fd = cache->tmp ? mkstemp (cache->tmp) : -1;
+      if (fd >= 0 && !(cache->file = fdopen (fd, "wb")))
+        {
+          close (fd);
+          unlink (cache->tmp);
+        }
+    }
+  else
+    cache->file = open_unlinked (cache);
+  if (!cache->file)
+    {
+      pckt_kit_cache_free (cache);
+      return NULL;
+    }
+
+  memcpy (cache->header.magic, CACHE_MAGIC, sizeof cache->header.magic);
+  cache->header.rate = pckt_kit_factory_get_rate (factory);
+  cache->header.namelen = strlen (filename);
+  cache->header.mtime = (int64_t) st.st_mtime;
+  cache->header.size = (int64_t) st.st_size;
+  cache->ok = true;
+
+  /* The header is written again with the final counts on commit.  */
+  write_padded (cache, &cache->header, sizeof (CacheHeader), RECORD_ALIGN);
+  write_padded (cache, filename, cache->header.namelen + 1, RECORD_ALIGN);
+  return cache;
+}
+
+/* Discard CACHE unless it has been committed.  */
+void
+pckt_kit_cache_free (PcktKitCache *cache)
+{
+  if (!cache)
+    return;
+
+  if (cache->file)
+    {
+      fclose (cache->file);
+      if (cache->filename)
+        unlink (cache->tmp);
+    }
+  shared_release (cache->shared);
+  free (cache->tmp);
+  free (cache->filename);
+  free (cache);
+}
+
+/* Add META to CACHE, metas are referred to by drums in the order they are
+   added.  Metas must be added before any drum.  */
+bool
+pckt_kit_cache_add_meta (PcktKitCache *cache, const PcktDrumMeta *meta)
+{
+  if (!cache || !meta || cache->header.ndrums > 0)
+    return false;
+
+  const char *name = pckt_drum_meta_get_name (meta);
+  if (!name)
+    name = "";
+
+  MetaRecord mr = {
+    pckt_drum_meta_get_tuning (meta),
+    pckt_drum_meta_get_dampening (meta),
+    pckt_drum_meta_get_expression (meta),
+    pckt_drum_meta_get_sample_overlap (meta),
+    pckt_drum_meta_get_voice_limit (meta),
+    strlen (name)
+  };
+
+  ++cache->header.nmetas;
+  return write_padded (cache, &mr, sizeof (MetaRecord), RECORD_ALIGN)
+    && write_padded (cache, name, mr.namelen + 1, RECORD_ALIGN);
+}
+
+/* Add sample INDEX of channel CH of DRUM to CACHE.  */
+static bool
+add_sample (PcktKitCache *cache, const PcktDrum *drum, PcktChannel ch,
+            size_t index)
+{
+  const char *name = NULL;
+  PcktSample *sample = pckt_drum_get_sample (drum, ch, index, &name);
+  size_t nlevels = 0;
+  const float *levels = pckt_sample_get_levels (sample, &nlevels);
+  if (!levels)
+    nlevels = 0;
+
+  SampleRecord sr = {
+    ch, pckt_sample_rate (sample, 0), pckt_sample_get_interpolation (sample),
+    name ? strlen (name) : 0, pckt_sample_write (sample, NULL, 0), nlevels,
+    0, 0
+  };
+
+  struct stat st;
+  if (name)
+    {
+      cache->ok = cache->ok && stat_source (cache->factory, name, &st);
+      sr.mtime = cache->ok ? (int64_t) st.st_mtime : 0;
+      sr.size = cache->ok ? (int64_t) st.st_size : 0;
+    }
+
+  bool ok = write_padded (cache, &sr, sizeof (SampleRecord), RECORD_ALIGN)
+    && (!name || write_padded (cache, name, sr.namelen + 1, RECORD_ALIGN))
+    && write_padded (cache, levels, 2 * nlevels * sizeof (float),
+                     RECORD_ALIGN)
+    && write_padded (cache, NULL, 0, FRAMES_ALIGN);
+
+  /* Frames are cached with any gain applied.  */
+  float frames[4096];
+  size_t nread;
+  for (size_t offset = 0; ok && offset < sr.nframes; offset += nread)
+    {
+      nread = pckt_sample_read (sample, frames, 4096, offset, 0);
+      ok = (nread > 0) && write_padded (cache, frames, nread * sizeof (float),
+                                        1);
+    }
+
+  cache->ok = ok;
+  return ok;
+}
+
+/* Add DRUM with ID, using meta number META of CACHE and choked by NCHOKERS
+   CHOKERS, to CACHE.  */
+bool
+pckt_kit_cache_add_drum (PcktKitCache *cache, const PcktDrum *drum, int8_t id,
+                         uint32_t meta, const int8_t *chokers,
+                         size_t nchokers)
+{
+  if (!cache || !drum || id < 0 || meta >= cache->header.nmetas)
+    return false;
+
+  DrumRecord dr;
+  memset (&dr, 0, sizeof (DrumRecord));
+  dr.meta = meta;
+  dr.id = id;
+  dr.interpolation = pckt_drum_get_interpolation (drum);
+  dr.nchokers = nchokers;
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      dr.nsamples += pckt_drum_get_nsamples (drum, ch);
+      dr.bleed[ch] = pckt_drum_get_bleed (drum, ch);
+    }
+
+  ++cache->header.ndrums;
+  bool ok = write_padded (cache, &dr, sizeof (DrumRecord), RECORD_ALIGN)
+    && write_padded (cache, chokers, nchokers, RECORD_ALIGN);
+
+  for (PcktChannel ch = PCKT_CH0; ok && ch < PCKT_NCHANNELS; ++ch)
+    {
+      for (size_t i = 0; ok && i < pckt_drum_get_nsamples (drum, ch); ++i)
+        ok = add_sample (cache, drum, ch, i);
+    }
+
+  return ok;
+}
+
+/* Finish and install CACHE, which is freed.  */
+bool
+pckt_kit_cache_commit (PcktKitCache *cache)
+{
+  if (!cache)
+    return false;
+
+  off_t end = ftello (cache->file);
+  cache->header.end = (end > 0) ? (uint64_t) end : 0;
+  bool ok = cache->ok && (end > 0)
+    && (fseeko (cache->file, 0, SEEK_SET) == 0)
+    && (fwrite (&cache->header, sizeof (CacheHeader), 1, cache->file) == 1);
+
+  /* An unlinked cache is kept open for other kits while KIT lives.  */
+  int fd = -1;
+  if (ok && !cache->filename)
+    {
+      ok = (fflush (cache->file) == 0)
+        && ((fd = dup (fileno (cache->file))) >= 0);
+      pthread_mutex_lock (&shared_lock);
+      ++cache->shared->nrefs;
+      pthread_mutex_unlock (&shared_lock);
+      if (!ok || !hold_shared (cache->kit, cache->shared, NULL, 0))
+        {
+          shared_drop (cache->shared);
+          ok = false;
+        }
+    }
+
+  ok = (fclose (cache->file) == 0) && ok;
+  cache->file = NULL;
+  if (cache->filename && (!ok || rename (cache->tmp, cache->filename) != 0))
+    {
+      unlink (cache->tmp);
+      ok = false;
+    }
+
+  pthread_mutex_lock (&shared_lock);
+  if (cache->shared->fd >= 0)
+    close (cache->shared->fd);
+  cache->shared->fd = ok ? fd : -1;
+  pthread_mutex_unlock (&shared_lock);
+  if (!ok && fd >= 0)
+    close (fd);
+
+  pckt_kit_cache_free (cache);
+  return ok;
+}
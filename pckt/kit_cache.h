@@ -0,0 +1,41 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef PCKT_KIT_CACHE_H
+#define PCKT_KIT_CACHE_H 1
+
+#include "pckt.h"
+#include "kit.h"
+#include "kit_factory.h"
+
+__BEGIN_DECLS
+
+typedef struct PcktKitCacheImpl PcktKitCache;
+
+extern PcktKitParserIface *pckt_kit_cache_open (const PcktKitFactory *);
+extern bool pckt_kit_cache_attach (PcktKitParserIface *, PcktKit *);
+extern PcktKitCache *pckt_kit_cache_new (const PcktKitFactory *, PcktKit *);
+extern void pckt_kit_cache_free (PcktKitCache *);
+extern bool pckt_kit_cache_add_meta (PcktKitCache *, const PcktDrumMeta *);
+extern bool pckt_kit_cache_add_drum (PcktKitCache *, const PcktDrum *, int8_t,
+                                     uint32_t, const int8_t *, size_t);
+extern bool pckt_kit_cache_commit (PcktKitCache *);
+
+__END_DECLS
+
+#endif /* ! PCKT_KIT_CACHE_H */
@@ -19,10 +19,14 @@
 #include <string.h>
 #include <libgen.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kit_factory.h"
+#include "kit_cache.h"
 #include "util.h"
 
 #define NUM_PARSERS 2
+#define MAX_NUM_THREADS 64
 
 extern PcktKitParserIface *pckt_kit_parser_bfk_new (const PcktKitFactory *);
 extern PcktKitParserIface *pckt_kit_parser_ttl_new (const PcktKitFactory *);
@@ -31,17 +35,173 @@ typedef struct _DrumMetaHandle DrumMetaHandle;
 struct _DrumMetaHandle {
   PcktDrumMeta *meta;
   const void *handle;
+  uint32_t index;  /* Position of META in the kit cache.  */
   DrumMetaHandle *next;
 };
 
+/* Passes drums on to the callback of `pckt_kit_factory_load_drums' after
+   adding them to the kit cache.  */
+typedef struct {
+  PcktKitCache *cache;
+  uint32_t index;
+  PcktKitFactoryDrumCb callback;
+  void *user_handle;
+} CacheDrumHandle;
+
+/* Threads decoding the jobs of one `pckt_kit_factory_decode' call at a
+   time, together with the calling thread.  */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  /* Signalled when jobs are posted or on stop.  */
+  pthread_cond_t done;  /* Signalled when the last job is finished.  */
+  PcktKitFactoryDecodeJob *jobs;
+  size_t njobs;
+  size_t next;
+  size_t nfinished;
+  uint32_t rate;
+  PcktInterpolation interpolation;
+  const PcktAllocator *allocator;
+  bool stop;
+  pthread_t threads[MAX_NUM_THREADS];
+  size_t nthreads;
+} DecodePool;
+
 struct PcktKitFactoryImpl {
   char *filename;
   char *_basedir;
   char *basedir;
   PcktKitParserIface *parser;
   DrumMetaHandle *meta_handles;
+  uint32_t rate; /* Rate to load samples at, or zero for their own.  */
+  PcktInterpolation interpolation; /* To resample with, NONE for sinc.  */
+  const PcktAllocator *allocator; /* Of sample frames, NULL for the heap.  */
+  PcktKitCache *cache; /* Written as drums are loaded by the parser.  */
+  size_t nthreads;     /* Decoding threads, zero for one per CPU.  */
+  DecodePool *pool;
+  PcktArena *arena;  /* Of the kit being loaded.  */
+  bool cached;  /* Set if the kit is mapped from the kit cache.  */
+  bool preview; /* Set while parsers should only load the loudest hits.  */
 };
 
+static void
+decode_job (PcktKitFactoryDecodeJob *job, uint32_t rate,
+            PcktInterpolation intrpl, const PcktAllocator *allocator)
+{
+  job->nchannels = 0;
+  if (!job->mono)
+    job->samples = pckt_sample_factory (job->filename, rate, intrpl,
+                                        allocator, &job->nchannels);
+  else
+    {
+      job->samples = calloc (2, sizeof (PcktSample *));
+      if (job->samples)
+        job->samples[0] = pckt_sample_factory_mono (job->filename, rate,
+                                                    intrpl, allocator);
+      if (job->samples && job->samples[0])
+        job->nchannels = 1;
+      else
+        {
+          free (job->samples);
+          job->samples = NULL;
+        }
+    }
+}
+
+/* Work on the posted jobs of POOL until there are none left to take.  Must
+   be called with the lock held.  */
+static void
+decode_pool_work (DecodePool *pool)
+{
+  while (pool->next < pool->njobs)
+    {
+      PcktKitFactoryDecodeJob *job = pool->jobs + pool->next++;
+      pthread_mutex_unlock (&pool->lock);
+      decode_job (job, pool->rate, pool->interpolation, pool->allocator);
+      pthread_mutex_lock (&pool->lock);
+      if (++pool->nfinished == pool->njobs)
+        pthread_cond_signal (&pool->done);
+    }
+}
+
+static void *
+decode_pool_run (void *data)
+{
+  DecodePool *pool = (DecodePool *) data;
+
+  pthread_mutex_lock (&pool->lock);
+  while (!pool->stop)
+    {
+      if (pool->next < pool->njobs)
+        decode_pool_work (pool);
+      else
+        pthread_cond_wait (&pool->wake, &pool->lock);
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+static void
+decode_pool_free (DecodePool *pool)
+{
+  if (!pool)
+    return;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast (&pool->wake);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (size_t i = 0; i < pool->nthreads; ++i)
+    pthread_join (pool->threads[i], NULL);
+
+  pthread_cond_destroy (&pool->done);
+  pthread_cond_destroy (&pool->wake);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool);
+}
+
+/* Start threads to decode along with the caller, for NTHREADS in total or
+   one per online CPU if NTHREADS is zero.  Returns NULL if the caller
+   decodes alone.  */
+static DecodePool *
+decode_pool_new (size_t nthreads)
+{
+  if (nthreads == 0)
+    {
+      long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      nthreads = (ncpus > 0) ? (size_t) ncpus : 1;
+    }
+  if (--nthreads > MAX_NUM_THREADS)
+    nthreads = MAX_NUM_THREADS;
+  if (nthreads == 0)
+    return NULL;
+
+  DecodePool *pool = malloc (sizeof (DecodePool));
+  if (!pool)
+    return NULL;
+
+  memset (pool, 0, sizeof (DecodePool));
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->wake, NULL);
+  pthread_cond_init (&pool->done, NULL);
+
+  for (; pool->nthreads < nthreads; ++pool->nthreads)
+    {
+      if (pthread_create (&pool->threads[pool->nthreads], NULL,
+                          decode_pool_run, pool) != 0)
+        break;
+    }
+
+  if (pool->nthreads == 0)
+    {
+      decode_pool_free (pool);
+      pool = NULL;
+    }
+
+  return pool;
+}
+
 PcktKitFactory *
 pckt_kit_factory_new (const char *filename, PcktStatus *status)
 {
@@ -110,6 +270,8 @@ pckt_kit_factory_free (PcktKitFactory *factory)
       free (handle);
     }
 
+  pckt_kit_cache_free (factory->cache);
+  decode_pool_free (factory->pool);
   if (factory->parser && factory->parser->free)
     factory->parser->free (factory->parser, factory);
   if (factory->filename)
@@ -164,6 +326,30 @@ pckt_kit_factory_load_metas (PcktKitFactory *factory, PcktKit *kit)
   if (!factory->parser || !factory->parser->load_metas)
     return PCKTE_INTERNAL;
 
+  factory->arena = pckt_kit_get_arena (kit);
+
+  /* Load the kit from its cache if it's fresh, otherwise cache it while
+     parsing.  */
+  PcktKitParserIface *cached = pckt_kit_cache_open (factory);
+  if (cached && pckt_kit_cache_attach (cached, kit))
+    {
+      if (factory->parser->free)
+        factory->parser->free (factory->parser, factory);
+      factory->parser = cached;
+      factory->cached = true;
+    }
+  else
+    {
+      if (cached)
+        cached->free (cached, factory);
+      pckt_kit_cache_free (factory->cache);
+      factory->cache = pckt_kit_cache_new (factory, kit);
+
+      /* Sound files are only decoded when parsing.  */
+      if (!factory->pool)
+        factory->pool = decode_pool_new (factory->nthreads);
+    }
+
   status = factory->parser->load_metas (factory->parser, factory,
                                         pckt_kit_factory_add_drum_meta);
   handle = &factory->meta_handles;
@@ -183,9 +369,33 @@ pckt_kit_factory_load_metas (PcktKitFactory *factory, PcktKit *kit)
       handle = &(*handle)->next;
     }
 
+  uint32_t index = 0;
+  for (DrumMetaHandle *item = factory->meta_handles; item; item = item->next)
+    {
+      item->index = index++;
+      if (factory->cache)
+        pckt_kit_cache_add_meta (factory->cache, item->meta);
+    }
+
+  if (status != PCKTE_SUCCESS)
+    {
+      pckt_kit_cache_free (factory->cache);
+      factory->cache = NULL;
+    }
+
   return status;
 }
 
+static void
+pckt_kit_factory_cache_drum (void *data, PcktDrum *drum, int8_t id,
+                             const int8_t *chokers, size_t nchokers)
+{
+  CacheDrumHandle *handle = (CacheDrumHandle *) data;
+  pckt_kit_cache_add_drum (handle->cache, drum, id, handle->index, chokers,
+                           nchokers);
+  handle->callback (handle->user_handle, drum, id, chokers, nchokers);
+}
+
 PcktStatus
 pckt_kit_factory_load_drums (PcktKitFactory *factory, PcktDrumMeta *meta,
                              PcktKitFactoryDrumCb callback, void *user_handle)
@@ -214,13 +424,66 @@ pckt_kit_factory_load_drums (PcktKitFactory *factory, PcktDrumMeta *meta,
   if (!meta_handle)
     return PCKTE_INVAL;
 
-  factory->parser->load_drums (factory->parser, meta_handle->meta,
-                               meta_handle->handle, callback, user_handle);
+  if (factory->cache)
+    {
+      CacheDrumHandle cache_handle = {
+        factory->cache, meta_handle->index, callback, user_handle
+      };
+      factory->parser->load_drums (factory->parser, meta_handle->meta,
+                                   meta_handle->handle,
+                                   pckt_kit_factory_cache_drum,
+                                   &cache_handle);
+    }
+  else
+    factory->parser->load_drums (factory->parser, meta_handle->meta,
+                                 meta_handle->handle, callback, user_handle);
   free (meta_handle);
 
+  /* The cache is complete once the drums of every meta are loaded.  */
+  if (factory->cache && !factory->meta_handles)
+    {
+      pckt_kit_cache_commit (factory->cache);
+      factory->cache = NULL;
+    }
+
   return PCKTE_SUCCESS;
 }
 
+/* Load the drums of META like `pckt_kit_factory_load_drums' but with only
+   the loudest hit of every sample set, which parsers take to be the last
+   sound file matched.  The drums are not cached and META is left to be
+   loaded in full later.  */
+PcktStatus
+pckt_kit_factory_preview_drums (PcktKitFactory *factory, PcktDrumMeta *meta,
+                                PcktKitFactoryDrumCb callback,
+                                void *user_handle)
+{
+  DrumMetaHandle *item;
+
+  if (!factory || !meta || !callback)
+    return PCKTE_INVAL;
+
+  if (!factory->parser || !factory->parser->load_drums)
+    return PCKTE_INTERNAL;
+
+  for (item = factory->meta_handles; item; item = item->next)
+    {
+      if (item->meta == meta)
+        break;
+    }
+
+  if (!item)
+    return PCKTE_INVAL;
+
+  factory->preview = true;
+  PcktStatus status = factory->parser->load_drums (factory->parser,
+                                                   item->meta, item->handle,
+                                                   callback, user_handle);
+  factory->preview = false;
+
+  return status;
+}
+
 static void
 pckt_kit_factory_add_drum (void *data, PcktDrum *drum, int8_t id,
                            const int8_t *chokers, size_t nchokers)
@@ -276,6 +539,125 @@ pckt_kit_factory_get_basedir (const PcktKitFactory *factory)
   return factory ? factory->basedir : NULL;
 }
 
+/* Decode NJOBS sound files of JOBS at the rate of FACTORY, concurrently if
+   it has decoding threads.  Returns when all are decoded.  */
+void
+pckt_kit_factory_decode (const PcktKitFactory *factory,
+                         PcktKitFactoryDecodeJob *jobs, size_t njobs)
+{
+  if (!factory || !jobs)
+    return;
+
+  DecodePool *pool = factory->pool;
+  if (!pool || njobs < 2)
+    {
+      for (size_t i = 0; i < njobs; ++i)
+        decode_job (jobs + i, factory->rate, factory->interpolation,
+                    factory->allocator);
+      return;
+    }
+
+  pthread_mutex_lock (&pool->lock);
+  pool->jobs = jobs;
+  pool->njobs = njobs;
+  pool->next = 0;
+  pool->nfinished = 0;
+  pool->rate = factory->rate;
+  pool->interpolation = factory->interpolation;
+  pool->allocator = factory->allocator;
+  pthread_cond_broadcast (&pool->wake);
+
+  decode_pool_work (pool);
+  while (pool->nfinished < pool->njobs)
+    pthread_cond_wait (&pool->done, &pool->lock);
+
+  pool->jobs = NULL;
+  pool->njobs = 0;
+  pool->next = 0;
+  pthread_mutex_unlock (&pool->lock);
+}
+
+/* Load samples resampled to RATE, which also keys their cache.  */
+void
+pckt_kit_factory_set_rate (PcktKitFactory *factory, uint32_t rate)
+{
+  if (factory)
+    factory->rate = rate;
+}
+
+uint32_t
+pckt_kit_factory_get_rate (const PcktKitFactory *factory)
+{
+  return factory ? factory->rate : 0;
+}
+
+/* Resample samples using INTRPL, which also keys their cache, or sinc if
+   INTRPL is PCKT_INTRPL_NONE, which is the default.  */
+void
+pckt_kit_factory_set_interpolation (PcktKitFactory *factory,
+                                    PcktInterpolation intrpl)
+{
+  if (factory && intrpl >= PCKT_INTRPL_NONE && intrpl <= PCKT_INTRPL_SINC)
+    factory->interpolation = intrpl;
+}
+
+PcktInterpolation
+pckt_kit_factory_get_interpolation (const PcktKitFactory *factory)
+{
+  return factory ? factory->interpolation : PCKT_INTRPL_NONE;
+}
+
+/* Allocate the frames of samples from ALLOCATOR, which must outlive the
+   kit, or from the heap if NULL, which is the default.  */
+void
+pckt_kit_factory_set_allocator (PcktKitFactory *factory,
+                                const PcktAllocator *allocator)
+{
+  if (factory)
+    factory->allocator = allocator;
+}
+
+const PcktAllocator *
+pckt_kit_factory_get_allocator (const PcktKitFactory *factory)
+{
+  return factory ? factory->allocator : NULL;
+}
+
+/* Decode sound files with NTHREADS threads including the loading one, or
+   one per online CPU if NTHREADS is zero, which is the default.  Must be
+   set before metas are loaded.  */
+void
+pckt_kit_factory_set_threads (PcktKitFactory *factory, size_t nthreads)
+{
+  if (factory)
+    factory->nthreads = nthreads;
+}
+
+/* Check if the kit of FACTORY is mapped from the kit cache, in which case
+   its drums load without decoding anything.  */
+bool
+pckt_kit_factory_is_cached (const PcktKitFactory *factory)
+{
+  return factory ? factory->cached : false;
+}
+
+/* Check if parsers should only load the loudest hit of every sample set,
+   see `pckt_kit_factory_preview_drums'.  */
+bool
+pckt_kit_factory_is_preview (const PcktKitFactory *factory)
+{
+  return factory ? factory->preview : false;
+}
+
+/* Get the arena for parsers to build drums and metas in, or NULL while
+   previewing since preview drums are replaced long before the kit is
+   freed.  */
+PcktArena *
+pckt_kit_factory_get_arena (const PcktKitFactory *factory)
+{
+  return (factory && !factory->preview) ? factory->arena : NULL;
+}
+
 char *
 pckt_kit_factory_get_abspath (const PcktKitFactory *factory, const char *path)
 {
@@ -42,17 +42,47 @@ struct _PcktKitParserIface {
 };
 typedef PcktKitParserIface * (*PcktKitParserCtor) (const PcktKitFactory *);
 
+/* A sound file to decode with `pckt_kit_factory_decode'.  SAMPLES is set to
+   a NULL terminated array of NCHANNELS samples, or one if MONO is set, which
+   is owned by the caller.  It's NULL if the file couldn't be decoded.  */
+typedef struct {
+  const char *filename;
+  bool mono;
+  PcktSample **samples;
+  size_t nchannels;
+} PcktKitFactoryDecodeJob;
+
 extern PcktKitFactory *pckt_kit_factory_new (const char *, PcktStatus *);
 extern void pckt_kit_factory_free (PcktKitFactory *);
 
 extern PcktStatus pckt_kit_factory_load_metas (PcktKitFactory *, PcktKit *);
 extern PcktStatus pckt_kit_factory_load_drums (PcktKitFactory *, PcktDrumMeta *,
                                                PcktKitFactoryDrumCb, void *);
+extern PcktStatus pckt_kit_factory_preview_drums (PcktKitFactory *,
+                                                  PcktDrumMeta *,
+                                                  PcktKitFactoryDrumCb,
+                                                  void *);
 
 extern PcktKit *pckt_kit_factory_load (PcktKitFactory *);
+extern void pckt_kit_factory_decode (const PcktKitFactory *,
+                                     PcktKitFactoryDecodeJob *, size_t);
 
 extern const char *pckt_kit_factory_get_filename (const PcktKitFactory *);
 extern const char *pckt_kit_factory_get_basedir (const PcktKitFactory *);
+extern void pckt_kit_factory_set_rate (PcktKitFactory *, uint32_t);
+extern uint32_t pckt_kit_factory_get_rate (const PcktKitFactory *);
+extern void pckt_kit_factory_set_interpolation (PcktKitFactory *,
+                                                PcktInterpolation);
+extern PcktInterpolation
+pckt_kit_factory_get_interpolation (const PcktKitFactory *);
+extern void pckt_kit_factory_set_allocator (PcktKitFactory *,
+                                            const PcktAllocator *);
+extern const PcktAllocator *
+pckt_kit_factory_get_allocator (const PcktKitFactory *);
+extern void pckt_kit_factory_set_threads (PcktKitFactory *, size_t);
+extern bool pckt_kit_factory_is_cached (const PcktKitFactory *);
+extern bool pckt_kit_factory_is_preview (const PcktKitFactory *);
+extern PcktArena *pckt_kit_factory_get_arena (const PcktKitFactory *);
 extern char *pckt_kit_factory_get_abspath (const PcktKitFactory *,
                                            const char *);
 
@@ -28,6 +28,8 @@
 #include "sample.h"
 #include "util.h"
 
+#define ARENA_BLOCK_SIZE 4096
+
 typedef struct {
   char *key, *val;
 } StringPair;
@@ -157,10 +159,12 @@ typedef struct {
   PcktKitParserIface iface;
   const PcktKitFactory *factory;
   BfkDrumInfo drums[BFK_NUM_TYPES];
+  PcktArena *arena;  /* Holds the pairs read from files and drum names.  */
 } BfkParser;
 
 static inline bool
-read_next_pair (FILE *fd, char delim, char **key_out, char **val_out)
+read_next_pair (PcktArena *arena, FILE *fd, char delim, char **key_out,
+                char **val_out)
 {
   char line[1024];
   char *c, *key_start, *key_end, *val_start, *val_end;
@@ -174,7 +178,7 @@ read_next_pair (FILE *fd, char delim, char **key_out, char **val_out)
     ++c;
 
   if ((*c == '\0') || (*c == '#'))
-    return read_next_pair (fd, delim, key_out, val_out);
+    return read_next_pair (arena, fd, delim, key_out, val_out);
   else if ((*c == delim) || !isprint (*c))
     return false;
 
@@ -210,16 +214,19 @@ read_next_pair (FILE *fd, char delim, char **key_out, char **val_out)
   *val_end = '\0';
 
   if (key_out)
-    *key_out = strdup (key_start);
+    *key_out = pckt_arena_strdup (arena, key_start);
 
   if (val_out)
-    *val_out = strdup (val_start);
+    *val_out = pckt_arena_strdup (arena, val_start);
 
   return true;
 }
 
+/* Read up to NLINES pairs of FILENAME into a NULL terminated array, which
+   is freed with ARENA.  */
 static StringPair **
-file_get_pairs (const char *filename, char delim, size_t nlines)
+file_get_pairs (PcktArena *arena, const char *filename, char delim,
+                size_t nlines)
 {
   StringPair **pairs, **current;
   FILE *fd = fopen (filename, "r");
@@ -227,7 +234,7 @@ file_get_pairs (const char *filename, char delim, size_t nlines)
   if (!fd)
     return NULL;
 
-  pairs = calloc (nlines + 1, sizeof (StringPair *));
+  pairs = pckt_arena_alloc (arena, (nlines + 1) * sizeof (StringPair *));
   if (!pairs)
     {
       fclose (fd);
@@ -238,38 +245,19 @@ file_get_pairs (const char *filename, char delim, size_t nlines)
   while (nlines-- > 0)
     {
       StringPair pair;
-      if (!read_next_pair (fd, delim, &pair.key, &pair.val))
+      if (!read_next_pair (arena, fd, delim, &pair.key, &pair.val)
+          || !(*current = pckt_arena_alloc (arena, sizeof (StringPair))))
         break;
-      *current = malloc (sizeof (StringPair));
       memcpy (*current, &pair, sizeof (StringPair));
       ++current;
     }
+  *current = NULL;
 
   fclose (fd);
 
   return pairs;
 }
 
-static void
-free_pairs (StringPair **pairs)
-{
-  if (!pairs)
-    return;
-
-  StringPair **pair = pairs;
-  while (*pair)
-    {
-      if ((*pair)->key)
-        free ((*pair)->key);
-      if ((*pair)->val)
-        free ((*pair)->val);
-      free (*pair);
-      ++pair;
-    }
-
-  free (pairs);
-}
-
 static char *
 get_info_filename (const BfkParser *parser)
 {
@@ -338,8 +326,6 @@ get_data_path (const BfkParser *parser, const char *path)
 static inline void
 init_drum_gain (const BfkParser *parser, BfkDrumInfo *info)
 {
-  (void) parser;
-
   char *filename = pckt_strdupf ("%stweaks.txt", info->path);
   StringPair **tweaks = NULL;
 
@@ -348,7 +334,7 @@ init_drum_gain (const BfkParser *parser, BfkDrumInfo *info)
   if (!filename)
     return;
 
-  tweaks = file_get_pairs (filename, '=', 10);
+  tweaks = file_get_pairs (parser->arena, filename, '=', 10);
   free (filename);
   if (!tweaks)
     return;
@@ -370,8 +356,6 @@ init_drum_gain (const BfkParser *parser, BfkDrumInfo *info)
 
       break;
     }
-
-  free_pairs (tweaks);
 }
 
 static bool
@@ -383,14 +367,14 @@ init_drum_info (BfkParser *parser)
   char *dotinfo;
   size_t ndrums = 0;
 
-  paths = file_get_pairs (filename, '=', BFK_NUM_TYPES);
+  paths = file_get_pairs (parser->arena, filename, '=', BFK_NUM_TYPES);
   if (!paths)
     return false;
 
   dotinfo = get_info_filename (parser);
   if (dotinfo)
     {
-      names = file_get_pairs (dotinfo, ':', BFK_NUM_TYPES);
+      names = file_get_pairs (parser->arena, dotinfo, ':', BFK_NUM_TYPES);
       free (dotinfo);
       dotinfo = NULL;
     }
@@ -422,27 +406,24 @@ init_drum_info (BfkParser *parser)
           if (!strcmp ((*pair)->key, info->keys->info_key)
               && (*pair)->val && strlen ((*pair)->val))
             {
-              info->name = strdup ((*pair)->val);
+              info->name = pckt_arena_strdup (parser->arena, (*pair)->val);
               break;
             }
         }
     }
 
-  if (names)
-    free_pairs (names);
-  free_pairs (paths);
-
   return (ndrums > 0) ? true : false;
 }
 
 static inline void
 load_drum_samples (const BfkParser *parser, PcktDrum *drum,
-                   const char *filename, const BfkDrumInfo *info)
+                   const PcktKitFactoryDecodeJob *job, const BfkDrumInfo *info)
 {
   (void) parser;
 
-  size_t nchannels = 0;
-  PcktSample **samples = pckt_sample_factory (filename, &nchannels);
+  const char *filename = job->filename;
+  size_t nchannels = job->nchannels;
+  PcktSample **samples = job->samples;
   if (!samples)
     return;
 
@@ -513,12 +494,28 @@ load_drum_hit (const BfkParser *parser, const BfkDrumInfo *info,
       return NULL;
     }
 
-  drum = pckt_drum_new ();
+  drum = pckt_drum_new_in (pckt_kit_factory_get_arena (parser->factory));
 
-  if (drum)
+  /* Decode all files of the hit at once, then map their channels in glob
+     order so that merges don't depend on which file was decoded first.
+     Files are numbered by force, so a preview only needs the last one.  */
+  size_t first = 0;
+  size_t njobs = globbuf.gl_pathc;
+  if (pckt_kit_factory_is_preview (parser->factory) && njobs > 1)
+    {
+      first = njobs - 1;
+      njobs = 1;
+    }
+  PcktKitFactoryDecodeJob *jobs = drum ? calloc (njobs, sizeof (*jobs)) : NULL;
+  if (jobs)
     {
-      for (char **path = globbuf.gl_pathv; *path != NULL; ++path)
-        load_drum_samples (parser, drum, *path, info);
+      for (size_t i = 0; i < njobs; ++i)
+        jobs[i].filename = globbuf.gl_pathv[first + i];
+
+      pckt_kit_factory_decode (parser->factory, jobs, njobs);
+      for (size_t i = 0; i < njobs; ++i)
+        load_drum_samples (parser, drum, jobs + i, info);
+      free (jobs);
     }
 
   globfree (&globbuf);
@@ -574,7 +571,8 @@ bfk_parser_load_metas (PcktKitParserIface *iface, PcktKitFactory *factory,
       BfkDrumInfo *info = &parser->drums[t];
       if (info->path)
         {
-          PcktDrumMeta *meta = pckt_drum_meta_new (info->name);
+          PcktArena *arena = pckt_kit_factory_get_arena (factory);
+          PcktDrumMeta *meta = pckt_drum_meta_new_in (arena, info->name);
           if (meta)
             callback (factory, meta, info);
         }
@@ -630,12 +628,11 @@ bfk_parser_free (PcktKitParserIface *iface, const PcktKitFactory *factory)
   for (BfkDrumType t = 0; t < BFK_NUM_TYPES; ++t)
     {
       BfkDrumInfo *info = &parser->drums[t];
-      if (info->name)
-        free (info->name);
       if (info->path)
         free (info->path);
     }
 
+  pckt_arena_free (parser->arena);
   free (parser);
 }
 
@@ -660,10 +657,11 @@ pckt_kit_parser_bfk_new (const PcktKitFactory *factory)
   iface->free = bfk_parser_free;
 
   parser->factory = factory;
+  parser->arena = pckt_arena_new (ARENA_BLOCK_SIZE);
 
-  if (!init_drum_info (parser))
+  if (!parser->arena || !init_drum_info (parser))
     {
-      free (parser);
+      bfk_parser_free (iface, factory);
       iface = NULL;
     }
 
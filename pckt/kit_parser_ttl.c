@@ -285,10 +285,35 @@ load_drum_samples (const TurtleParser *parser, PcktDrum *drum,
       if (!get_sample_pattern (parser, sample_node, &globbuf))
         continue;
 
-      for (char **path = globbuf.gl_pathv; *path != NULL; ++path)
+      /* Decode all matching files at once, or only the last one for a
+         preview since drums play samples in name order from soft to
+         hard.  */
+      size_t first = 0;
+      size_t njobs = globbuf.gl_pathc;
+      if (pckt_kit_factory_is_preview (parser->factory) && njobs > 1)
         {
-          char *name = *path;
-          PcktSample *sample = pckt_sample_factory_mono (name);
+          first = njobs - 1;
+          njobs = 1;
+        }
+      PcktKitFactoryDecodeJob *jobs = calloc (njobs, sizeof (*jobs));
+      if (!jobs)
+        {
+          globfree (&globbuf);
+          continue;
+        }
+
+      for (size_t i = 0; i < njobs; ++i)
+        {
+          jobs[i].filename = globbuf.gl_pathv[first + i];
+          jobs[i].mono = true;
+        }
+      pckt_kit_factory_decode (parser->factory, jobs, njobs);
+
+      for (size_t i = 0; i < njobs; ++i)
+        {
+          const char *name = jobs[i].filename;
+          PcktSample *sample = jobs[i].samples ? jobs[i].samples[0] : NULL;
+          free (jobs[i].samples);
           if (!sample)
             continue;
 
@@ -302,6 +327,7 @@ load_drum_samples (const TurtleParser *parser, PcktDrum *drum,
             pckt_sample_free (sample);
         }
 
+      free (jobs);
       globfree (&globbuf);
     }
   sord_iter_free (sample_it);
@@ -316,7 +342,7 @@ load_drum_hit (const TurtleParser *parser, const SordNode *hit_node)
   if (!sound_it)
     return drum;
 
-  drum = pckt_drum_new ();
+  drum = pckt_drum_new_in (pckt_kit_factory_get_arena (parser->factory));
   for (; !sord_iter_end (sound_it); sord_iter_next (sound_it))
     {
       const SordNode *sound_node = sord_iter_get_node (sound_it, SORD_OBJECT);
@@ -436,7 +462,8 @@ ttl_parser_load_metas (PcktKitParserIface *iface, PcktKitFactory *factory,
           name = (name_node
                   ? (const char *) sord_node_get_string (name_node)
                   : NULL);
-          meta = pckt_drum_meta_new (name);
+          meta = pckt_drum_meta_new_in (pckt_kit_factory_get_arena (factory),
+                                        name);
 
           if (name_node)
             sord_node_free (parser->world, name_node);
@@ -18,19 +18,50 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sample.h"
+#include "dsp.h"
+#include "util.h"
 
-typedef size_t (*PcktInterpolator) (const float *, size_t,
-                                    float *, size_t,
-                                    float);
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+/* Interpolators read from source position PHASE, given in 32.32 fixed point
+   frames, and advance it by STEP per frame written to DEST.  */
+typedef size_t (*PcktInterpolator) (const float *src, size_t src_size,
+                                    uint64_t *phase, uint64_t step,
+                                    float *dest, size_t dest_size);
+
+#define PHASE_SCALE (1.f / PCKT_PHASE_ONE)
+#define SINC_TAPS 16
+#define SINC_PHASE_BITS 8
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+#define SINC_CUTOFF .9
+#define PACKED_WINDOW_FRAMES 1024
 
 struct PcktSampleImpl
 {
   uint32_t rate;
-  float *frames;
+  float *frames;   /* NULL if the frames are packed.  */
+  void *packed;    /* Integer frames if FORMAT isn't float.  */
+  const PcktAllocator *allocator;  /* Of own frames, NULL for the heap.  */
+  PcktSampleFormat format;
   size_t nframes;
   size_t realsize;
-  PcktInterpolator interpolator;
+  PcktInterpolation interpolation;
+  float *levels;  /* RMS and peak of every PCKT_SAMPLE_LEVEL_FRAMES frames.  */
+  size_t nlevels;
+  float gain;  /* Applied on read when FRAMES can't be scaled in place.  */
+  void *mapping;  /* Memory mapped file region holding FRAMES, if any.  */
+  size_t mapsize; /* Zero if the mapping is owned by someone else.  */
+  size_t nlocked;  /* Number of leading FRAMES locked in memory.  */
+  size_t nhead;    /* Number of leading mapped FRAMES faulted in.  */
+  uint32_t nvoices;  /* Sounds of a pool playing SAMPLE.  */
 };
 
 PcktSample *
@@ -41,23 +72,503 @@ pckt_sample_new ()
     {
       sample->rate = PCKT_SAMPLE_RATE_DEFAULT;
       sample->frames = NULL;
+      sample->packed = NULL;
+      sample->allocator = NULL;
+      sample->format = PCKT_SAMPLE_FLOAT;
       sample->nframes = 0;
       sample->realsize = 0;
-      sample->interpolator = NULL;
+      sample->interpolation = PCKT_INTRPL_NONE;
+      sample->levels = NULL;
+      sample->nlevels = 0;
+      sample->gain = 1.f;
+      sample->mapping = NULL;
+      sample->mapsize = 0;
+      sample->nlocked = 0;
+      sample->nhead = 0;
+      sample->nvoices = 0;
     }
   return sample;
 }
 
+static inline const PcktAllocator *
+get_allocator (const PcktSample *sample)
+{
+  return sample->allocator ? sample->allocator : pckt_allocator_heap ();
+}
+
+/* Allocate SIZE bytes of frames for SAMPLE.  */
+static void *
+alloc_frames (const PcktSample *sample, size_t size)
+{
+  const PcktAllocator *allocator = get_allocator (sample);
+  return allocator->alloc (size ? size : 1, allocator->data);
+}
+
+/* Free FRAMES of SIZE bytes of SAMPLE.  */
+static void
+free_frames (const PcktSample *sample, void *frames, size_t size)
+{
+  const PcktAllocator *allocator = get_allocator (sample);
+  if (frames)
+    allocator->free (frames, size ? size : 1, allocator->data);
+}
+
+/* Move the own frames of SAMPLE to SIZE new bytes, or free them if out of
+   memory.  */
+static void
+realloc_frames (PcktSample *sample, size_t size)
+{
+  float *frames = alloc_frames (sample, size);
+  if (frames && sample->frames)
+    {
+      size_t n = sizeof (float) * sample->nframes;
+      memcpy (frames, sample->frames, (n < size) ? n : size);
+    }
+
+  free_frames (sample, sample->frames, sample->realsize);
+  sample->frames = frames;
+  sample->realsize = frames ? size : 0;
+}
+
+/* Allocate the frames SAMPLE gets from now on from ALLOCATOR, or from the
+   heap if NULL.  ALLOCATOR must outlive SAMPLE.  Fails if SAMPLE already
+   holds frames of its own.  */
+bool
+pckt_sample_set_allocator (PcktSample *sample,
+                           const PcktAllocator *allocator)
+{
+  if (!sample || (!sample->mapping && (sample->frames || sample->packed)))
+    return false;
+  sample->allocator = allocator;
+  return true;
+}
+
+const PcktAllocator *
+pckt_sample_get_allocator (const PcktSample *sample)
+{
+  return sample ? sample->allocator : NULL;
+}
+
+/* Get the page aligned memory range covering NFRAMES frames at FRAMES.  */
+static inline void
+get_page_range (const float *frames, size_t nframes, void **addr,
+                size_t *len)
+{
+  uintptr_t pagesize = (uintptr_t) sysconf (_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t) frames & ~(pagesize - 1);
+  *addr = (void *) begin;
+  *len = ((uintptr_t) (frames + nframes)) - begin;
+}
+
+/* Undo `pckt_sample_lock'.  */
+static void
+unlock_frames (PcktSample *sample)
+{
+  if (sample->nlocked > 0)
+    {
+      void *addr;
+      size_t len;
+      get_page_range (sample->frames, sample->nlocked, &addr, &len);
+      munlock (addr, len);
+      sample->nlocked = 0;
+    }
+}
+
+/* Convert N packed frames of SAMPLE from frame FIRST to floats scaled by
+   GAIN in DEST.  */
+static inline void
+unpack_frames (const PcktSample *sample, float *dest, size_t first, size_t n,
+               float gain)
+{
+  if (sample->format == PCKT_SAMPLE_INT16)
+    pckt_dsp_from_int16 (dest, (const int16_t *) sample->packed + first, n,
+                         gain);
+  else
+    pckt_dsp_from_int24 (dest, (const uint8_t *) sample->packed + (3 * first),
+                         n, gain);
+}
+
+/* Get N unscaled frames of SAMPLE from frame FIRST, unpacked into BUFFER if
+   needed.  */
+static inline const float *
+get_frames (const PcktSample *sample, size_t first, size_t n, float *buffer)
+{
+  if (!sample->packed)
+    return sample->frames + first;
+  unpack_frames (sample, buffer, first, n, 1.f);
+  return buffer;
+}
+
+/* Release the frames of SAMPLE, whether they are on the heap, packed or
+   mapped.  */
+static void
+release_frames (PcktSample *sample)
+{
+  unlock_frames (sample);
+  if (sample->mapping)
+    {
+      if (sample->mapsize)
+        munmap (sample->mapping, sample->mapsize);
+    }
+  else if (sample->packed)
+    free_frames (sample, sample->packed, sample->realsize);
+  else if (sample->frames)
+    free_frames (sample, sample->frames, sample->realsize);
+
+  sample->frames = NULL;
+  sample->packed = NULL;
+  sample->format = PCKT_SAMPLE_FLOAT;
+  sample->mapping = NULL;
+  sample->mapsize = 0;
+  sample->realsize = 0;
+  sample->nhead = 0;
+}
+
+/* Make the frames of SAMPLE writable by moving them to the heap as floats,
+   with any gain applied.  */
+static bool
+prepare_write (PcktSample *sample)
+{
+  if (!sample->mapping && !sample->packed)
+    {
+      unlock_frames (sample); /* Heap frames may move.  */
+      return true;
+    }
+
+  size_t realsize = sizeof (float) * sample->nframes;
+  float *frames = alloc_frames (sample, realsize);
+  if (!frames)
+    return false;
+
+  if (sample->packed)
+    unpack_frames (sample, frames, 0, sample->nframes, sample->gain);
+  else
+    {
+      memcpy (frames, sample->frames, realsize);
+      if (sample->gain != 1.f)
+        pckt_dsp_scale (frames, sample->nframes, sample->gain);
+    }
+
+  release_frames (sample);
+  sample->frames = frames;
+  sample->realsize = realsize;
+  sample->gain = 1.f;
+  return true;
+}
+
 void
 pckt_sample_free (PcktSample *sample)
 {
   if (!sample)
     return;
-  if (sample->frames)
-    free (sample->frames);
+  release_frames (sample);
+  if (sample->levels)
+    free (sample->levels);
   free (sample);
 }
 
+/* Create a sample reading NFRAMES frames of native floats directly from
+   byte OFFSET of FILENAME through a read-only memory mapping.  Operations
+   that modify the frames move them to the heap first.  */
+PcktSample *
+pckt_sample_map (const char *filename, size_t offset, size_t nframes,
+                 uint32_t rate)
+{
+  if (!filename || !nframes || !rate || (offset % sizeof (float)) != 0)
+    return NULL;
+
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  /* Reading past the end of the file would raise SIGBUS.  */
+  struct stat st;
+  if (fstat (fd, &st) != 0
+      || (uint64_t) st.st_size < offset + (nframes * sizeof (float)))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  size_t pagesize = (size_t) sysconf (_SC_PAGESIZE);
+  size_t start = offset - (offset % pagesize);
+  size_t mapsize = (offset - start) + (nframes * sizeof (float));
+  void *mapping = mmap (NULL, mapsize, PROT_READ, MAP_SHARED, fd,
+                        (off_t) start);
+  close (fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  PcktSample *sample = pckt_sample_new ();
+  if (!sample)
+    {
+      munmap (mapping, mapsize);
+      return NULL;
+    }
+
+  sample->rate = rate;
+  sample->frames = (float *) ((char *) mapping + (offset - start));
+  sample->nframes = nframes;
+  sample->mapping = mapping;
+  sample->mapsize = mapsize;
+  return sample;
+}
+
+/* Create a sample reading NFRAMES frames at RATE from a read-only mapping
+   owned by the caller, which must outlive the sample.  The frames are
+   treated like those of `pckt_sample_map'.  */
+PcktSample *
+pckt_sample_view (const float *frames, size_t nframes, uint32_t rate)
+{
+  if (!frames || !nframes || !rate)
+    return NULL;
+
+  PcktSample *sample = pckt_sample_new ();
+  if (!sample)
+    return NULL;
+
+  sample->rate = rate;
+  sample->frames = (float *) frames;
+  sample->nframes = nframes;
+  sample->mapping = (void *) frames;
+  return sample;
+}
+
+/* Fault in the first NFRAMES frames of SAMPLE and try to lock them in memory
+   so that the attack of the sample can be played back without page faults.
+   Returns false if the frames could only be faulted in.  */
+bool
+pckt_sample_lock (PcktSample *sample, size_t nframes)
+{
+  if (!sample || !sample->frames)
+    return false;
+  else if (nframes > sample->nframes)
+    nframes = sample->nframes;
+
+  if (nframes <= sample->nlocked)
+    return true;
+
+  void *addr;
+  size_t len;
+  get_page_range (sample->frames, nframes, &addr, &len);
+  posix_madvise (addr, len, POSIX_MADV_WILLNEED);
+
+  volatile float sink = 0;
+  size_t stride = (size_t) sysconf (_SC_PAGESIZE) / sizeof (float);
+  for (size_t i = 0; i < nframes; i += stride)
+    sink += sample->frames[i];
+  (void) sink;
+
+  if (nframes > sample->nhead)
+    __atomic_store_n (&sample->nhead, nframes, __ATOMIC_RELEASE);
+
+  if (mlock (addr, len) != 0)
+    return false;
+
+  sample->nlocked = nframes;
+  return true;
+}
+
+/* Undo `pckt_sample_lock' and drop the pages of mapped SAMPLE from memory,
+   after which it's played through a stream from the start.  The frames stay
+   mapped and are read back from their file, so sounds still playing them
+   only risk page faults.  Returns false if SAMPLE isn't mapped.  */
+bool
+pckt_sample_unlock (PcktSample *sample)
+{
+  if (!sample || !sample->mapping || !sample->frames)
+    return false;
+
+  unlock_frames (sample);
+  __atomic_store_n (&sample->nhead, 0, __ATOMIC_RELEASE);
+
+  /* Leave pages shared with neighbouring frames alone.  */
+  uintptr_t pagesize = (uintptr_t) sysconf (_SC_PAGESIZE);
+  uintptr_t begin = ((uintptr_t) sample->frames + pagesize - 1)
+    & ~(pagesize - 1);
+  uintptr_t end = (uintptr_t) (sample->frames + sample->nframes)
+    & ~(pagesize - 1);
+  if (end > begin)
+    madvise ((void *) begin, end - begin, MADV_DONTNEED);
+  return true;
+}
+
+/* Move the float frames of SAMPLE from the heap to an unlinked file in DIR
+   and map them from there, so that they can be paged out like the frames
+   of cached samples.  Must not be called while SAMPLE is played.  Returns
+   false if the frames are packed or already mapped.  */
+bool
+pckt_sample_spill (PcktSample *sample, const char *dir)
+{
+  if (!sample || !dir || !sample->frames || sample->mapping
+      || sample->nframes == 0)
+    return false;
+
+  char *path = pckt_strdupf ("%s%cpckt-XXXXXX", dir, PCKT_DIR_SEP);
+  int fd = path ? mkstemp (path) : -1;
+  if (fd < 0)
+    {
+      free (path);
+      return false;
+    }
+  unlink (path);
+  free (path);
+
+  size_t size = sample->nframes * sizeof (float);
+  const char *data = (const char *) sample->frames;
+  size_t nwritten = 0;
+  while (nwritten < size)
+    {
+      ssize_t n = write (fd, data + nwritten, size - nwritten);
+      if (n <= 0)
+        break;
+      nwritten += (size_t) n;
+    }
+
+  void *mapping = MAP_FAILED;
+  if (nwritten == size)
+    mapping = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  float gain = sample->gain;
+  release_frames (sample);
+  sample->frames = (float *) mapping;
+  sample->mapping = mapping;
+  sample->mapsize = size;
+  sample->gain = gain;
+  return true;
+}
+
+/* Get the bytes of memory the frames of SAMPLE may take.  Mapped frames
+   are all counted since playing them faults them in, until they are
+   dropped by `pckt_sample_unlock'.  */
+size_t
+pckt_sample_get_memory (const PcktSample *sample)
+{
+  if (!sample)
+    return 0;
+  else if (sample->mapping)
+    return sample->nframes * sizeof (float);
+  return sample->realsize;
+}
+
+/* Count a sound of a pool starting or stopping to play SAMPLE, done by the
+   audio thread.  */
+void
+pckt_sample_add_voice (PcktSample *sample)
+{
+  if (sample)
+    __atomic_add_fetch (&sample->nvoices, 1, __ATOMIC_ACQ_REL);
+}
+
+void
+pckt_sample_remove_voice (PcktSample *sample)
+{
+  if (sample)
+    __atomic_sub_fetch (&sample->nvoices, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Check if any sound of a pool is playing SAMPLE.  */
+bool
+pckt_sample_is_playing (const PcktSample *sample)
+{
+  return sample && __atomic_load_n (&sample->nvoices, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Check if the frames of SAMPLE are read from a memory mapped file.  */
+bool
+pckt_sample_is_mapped (const PcktSample *sample)
+{
+  return (sample && sample->mapping && sample->frames) ? true : false;
+}
+
+/* Store the frames of SAMPLE as FORMAT.  Integer frames are scaled to the
+   peak of the sample and converted back on read, which halves the memory
+   taken by 16 bit frames at the cost of some quantization noise.  */
+bool
+pckt_sample_compact (PcktSample *sample, PcktSampleFormat format)
+{
+  if (!sample || format < PCKT_SAMPLE_FLOAT || format > PCKT_SAMPLE_INT24)
+    return false;
+  else if (format == sample->format)
+    return true;
+  else if (!prepare_write (sample))
+    return false;
+  else if (format == PCKT_SAMPLE_FLOAT)
+    return true;
+
+  size_t width = (format == PCKT_SAMPLE_INT16) ? 2 : 3;
+  float limit = (format == PCKT_SAMPLE_INT16) ? INT16_MAX : 0x7fffff;
+  uint8_t *packed = alloc_frames (sample, width * sample->nframes);
+  if (!packed)
+    return false;
+
+  float peak = pckt_dsp_peak (sample->frames, sample->nframes);
+  float scale = (peak > 0) ? peak / limit : 1.f;
+  for (size_t i = 0; i < sample->nframes; ++i)
+    {
+      float x = roundf (sample->frames[i] / scale);
+      int32_t v = (int32_t) fmaxf (-limit, fminf (limit, x));
+      if (format == PCKT_SAMPLE_INT16)
+        ((int16_t *) packed)[i] = (int16_t) v;
+      else
+        {
+          uint8_t *p = packed + (3 * i);
+          p[0] = (uint8_t) v;
+          p[1] = (uint8_t) (v >> 8);
+          p[2] = (uint8_t) (v >> 16);
+        }
+    }
+
+  free_frames (sample, sample->frames, sample->realsize);
+  sample->frames = NULL;
+  sample->packed = packed;
+  sample->format = format;
+  sample->realsize = width * sample->nframes;
+  sample->gain = scale;
+  return true;
+}
+
+/* Get the storage format of the frames of SAMPLE.  */
+PcktSampleFormat
+pckt_sample_get_format (const PcktSample *sample)
+{
+  return sample ? sample->format : PCKT_SAMPLE_FLOAT;
+}
+
+/* Update level envelope of SAMPLE from block FIRST onwards.  */
+static bool
+analyze_levels (PcktSample *sample, size_t first)
+{
+  size_t nlevels = (sample->nframes + PCKT_SAMPLE_LEVEL_FRAMES - 1)
+    / PCKT_SAMPLE_LEVEL_FRAMES;
+  float *levels = realloc (sample->levels,
+                           2 * (nlevels ? nlevels : 1) * sizeof (float));
+  if (!levels)
+    return false;
+
+  sample->levels = levels;
+  sample->nlevels = nlevels;
+  for (size_t i = first; i < nlevels; ++i)
+    {
+      float buffer[PCKT_SAMPLE_LEVEL_FRAMES];
+      size_t offset = i * PCKT_SAMPLE_LEVEL_FRAMES;
+      size_t n = sample->nframes - offset;
+      float sum = 0, sum2 = 0;
+      if (n > PCKT_SAMPLE_LEVEL_FRAMES)
+        n = PCKT_SAMPLE_LEVEL_FRAMES;
+
+      const float *frames = get_frames (sample, offset, n, buffer);
+      pckt_dsp_moments (frames, n, 0, &sum, &sum2);
+      levels[2 * i] = sqrtf (sum2 / n) * sample->gain;
+      levels[(2 * i) + 1] = pckt_dsp_peak (frames, n) * sample->gain;
+    }
+
+  return true;
+}
+
 uint32_t
 pckt_sample_rate (PcktSample *sample, uint32_t rate)
 {
@@ -69,102 +580,384 @@ pckt_sample_rate (PcktSample *sample, uint32_t rate)
 }
 
 static inline size_t
-interpolate_constant (const float *src, size_t src_size,
-                      float *dest, size_t dest_size,
-                      float ratio)
+interpolate_constant (const float *src, size_t src_size, uint64_t *phase,
+                      uint64_t step, float *dest, size_t dest_size)
 {
-  uint32_t i, frame;
-  for (i = 0; i < dest_size; ++i)
+  uint64_t pos = *phase;
+  size_t i;
+  for (i = 0; i < dest_size; ++i, pos += step)
     {
-      frame = (i * ratio);
+      size_t frame = pos >> PCKT_PHASE_BITS;
       if (frame >= src_size)
         break;
       dest[i] = src[frame];
     }
+  *phase = pos;
   return i;
 }
 
 static inline size_t
-interpolate_linear (const float *src, size_t src_size,
-                    float *dest, size_t dest_size,
-                    float ratio)
+interpolate_linear (const float *src, size_t src_size, uint64_t *phase,
+                    uint64_t step, float *dest, size_t dest_size)
 {
-  uint32_t i, f1, f2;
-  float pos, w1, w2;
-  for (i = 0; i < dest_size; ++i)
+  uint64_t pos = *phase;
+  size_t i;
+  for (i = 0; i < dest_size; ++i, pos += step)
     {
-      pos = (float) i * ratio;
-      f1 = floorf (pos); /* Lower source frame position.  */
-      f2 = ceilf (pos); /* Upper source frame position.  */
+      size_t f1 = pos >> PCKT_PHASE_BITS; /* Lower source frame position.  */
       if (f1 >= src_size)
         break;
-      else if (f1 == f2 || f2 >= src_size)
+      else if (f1 + 1 >= src_size)
         {
           dest[i] = src[f1];
           continue;
         }
-      w1 = (float) f2 - pos; /* Lower source frame weight.  */
-      w2 = pos - (float) f1; /* Upper source frame weight.  */
-      dest[i] = (src[f1] * w1) + (src[f2] * w2);
+      float w2 = (uint32_t) pos * PHASE_SCALE; /* Upper frame weight.  */
+      dest[i] = (src[f1] * (1.f - w2)) + (src[f1 + 1] * w2);
     }
+  *phase = pos;
   return i;
 }
 
-bool
-pckt_sample_set_interpolation (PcktSample *sample, PcktInterpolation intrpl)
+/* Windowed sinc kernel in polyphase form.  Row P holds the taps applied to
+   source frames F - 7 to F + 8 for a read position of F + P / SINC_PHASES,
+   the extra row makes it possible to interpolate between phases.  */
+static float sinc_table[SINC_PHASES + 1][SINC_TAPS]
+  __attribute__ ((aligned (32)));
+static pthread_once_t sinc_table_once = PTHREAD_ONCE_INIT;
+
+static void
+sinc_table_build ()
 {
-  if (!sample)
-    return false;
+  for (uint32_t p = 0; p <= SINC_PHASES; ++p)
+    {
+      double sum = 0;
+      for (uint32_t j = 0; j < SINC_TAPS; ++j)
+        {
+          double x = (double) j - (SINC_TAPS / 2 - 1)
+            - (double) p / SINC_PHASES;
+          double t = x / (SINC_TAPS / 2); /* Window position in [-1, 1].  */
+          double y = SINC_CUTOFF;
+          if (x != 0)
+            y = sin (M_PI * SINC_CUTOFF * x) / (M_PI * x);
+          /* Blackman window.  */
+          y *= .42 + (.5 * cos (M_PI * t)) + (.08 * cos (2 * M_PI * t));
+          sinc_table[p][j] = (float) y;
+          sum += y;
+        }
+      /* Normalize each phase for unity gain at DC.  */
+      for (uint32_t j = 0; j < SINC_TAPS; ++j)
+        sinc_table[p][j] /= (float) sum;
+    }
+}
+
+/* Build the kernel once, samples may be resampled by several threads.  */
+static inline void
+sinc_table_init ()
+{
+  pthread_once (&sinc_table_once, sinc_table_build);
+}
+
+/* Get the kernel value at TAP, a 32.32 fixed point position in taps from
+   the first, blending the two phases around it like the table path.  */
+static inline float
+sinc_kernel (int64_t tap)
+{
+  const uint32_t phase_shift = PCKT_PHASE_BITS - SINC_PHASE_BITS;
+  const float phase_scale = 1.f / ((uint32_t) 1 << phase_shift);
+  if (tap <= -(int64_t) PCKT_PHASE_ONE)
+    return 0;
+
+  /* Tap J is the one at or after TAP, FRAC the distance back to TAP.  */
+  uint64_t j = (uint64_t) (tap + (int64_t) PCKT_PHASE_ONE - 1)
+    >> PCKT_PHASE_BITS;
+  if (j >= SINC_TAPS)
+    return 0;
+
+  uint32_t frac = (uint32_t) ((j << PCKT_PHASE_BITS) - (uint64_t) tap);
+  uint32_t p = frac >> phase_shift;
+  float w = (frac & (((uint32_t) 1 << phase_shift) - 1)) * phase_scale;
+  return (sinc_table[p][j] * (1.f - w)) + (sinc_table[p + 1][j] * w);
+}
+
+static inline size_t
+interpolate_sinc (const float *src, size_t src_size, uint64_t *phase,
+                  uint64_t step, float *dest, size_t dest_size)
+{
+  const size_t before = SINC_TAPS / 2 - 1;
+  const uint32_t phase_shift = PCKT_PHASE_BITS - SINC_PHASE_BITS;
+  const float phase_scale = 1.f / ((uint32_t) 1 << phase_shift);
+  float ratio = step * PHASE_SCALE, scale = 1.f / ratio, window[SINC_TAPS];
+  uint64_t pos = *phase;
+  size_t i;
+
+  /* The stretched kernel reaches further and moves TAP_SCALE taps per
+     source frame, which are stepped in 32.32 fixed point.  */
+  size_t reach = (size_t) ((SINC_TAPS / 2) * ratio) + 1;
+  double tap_scale = (step > PCKT_PHASE_ONE)
+    ? (double) PCKT_PHASE_ONE / step : 1;
+  int64_t tap_step = (int64_t) (tap_scale * PCKT_PHASE_ONE);
+
+  for (i = 0; i < dest_size; ++i, pos += step)
+    {
+      size_t f = pos >> PCKT_PHASE_BITS;
+      uint32_t frac = (uint32_t) pos;
+      if (f >= src_size)
+        break;
 
+      if (ratio <= 1)
+        {
+          /* Blend the two table rows around the read position.  */
+          const float *frames = window;
+          if (f >= before && f + SINC_TAPS - before <= src_size)
+            frames = src + f - before;
+          else
+            {
+              /* Pad with silence at the edges of the sample.  */
+              for (size_t j = 0; j < SINC_TAPS; ++j)
+                {
+                  size_t k = f + j;
+                  window[j] = (k >= before && k - before < src_size)
+                    ? src[k - before] : 0;
+                }
+            }
+
+          uint32_t p = frac >> phase_shift;
+          float w = (frac & (((uint32_t) 1 << phase_shift) - 1)) * phase_scale;
+          float y1 = pckt_dsp_dot (sinc_table[p], frames, SINC_TAPS);
+          float y2 = pckt_dsp_dot (sinc_table[p + 1], frames, SINC_TAPS);
+          dest[i] = (y1 * (1.f - w)) + (y2 * w);
+        }
+      else
+        {
+          /* Stretch the kernel to keep the cutoff below the new Nyquist
+             frequency when frames are skipped.  */
+          size_t first = (f > reach) ? f - reach : 0;
+          size_t last = (f + reach < src_size) ? f + reach : src_size - 1;
+          int64_t x = (((int64_t) first - (int64_t) f)
+                       * (int64_t) PCKT_PHASE_ONE) - frac;
+          int64_t tap = (int64_t) (x * tap_scale)
+            + ((int64_t) before << PCKT_PHASE_BITS);
+          float y = 0;
+          for (size_t k = first; k <= last; ++k, tap += tap_step)
+            y += src[k] * sinc_kernel (tap);
+          dest[i] = y * scale;
+        }
+    }
+  *phase = pos;
+  return i;
+}
+
+/* Get interpolator function for INTRPL.  */
+static PcktInterpolator
+get_interpolator (PcktInterpolation intrpl)
+{
   switch (intrpl)
     {
-    case PCKT_INTRPL_NONE:
-      sample->interpolator = NULL;
-      break;
     case PCKT_INTRPL_CONSTANT:
-      sample->interpolator = interpolate_constant;
-      break;
+      return interpolate_constant;
     case PCKT_INTRPL_LINEAR:
-      sample->interpolator = interpolate_linear;
-      break;
+      return interpolate_linear;
+    case PCKT_INTRPL_SINC:
+      sinc_table_init ();
+      return interpolate_sinc;
     default:
-      return false;
+      return NULL;
     }
+}
+
+bool
+pckt_sample_set_interpolation (PcktSample *sample, PcktInterpolation intrpl)
+{
+  if (!sample || intrpl < PCKT_INTRPL_NONE || intrpl > PCKT_INTRPL_SINC)
+    return false;
 
+  get_interpolator (intrpl); /* Prepare tables.  */
+  sample->interpolation = intrpl;
   return true;
 }
 
+PcktInterpolation
+pckt_sample_get_interpolation (const PcktSample *sample)
+{
+  return sample ? sample->interpolation : PCKT_INTRPL_NONE;
+}
+
+/* Get the distance in 32.32 fixed point source frames between two frames of
+   SAMPLE played back at RATE and sped up by PITCH.  A RATE of zero means the
+   rate of the sample.  */
+uint64_t
+pckt_sample_step (const PcktSample *sample, uint32_t rate, float pitch)
+{
+  if (!sample || pitch <= 0)
+    return 0;
+
+  double ratio = (rate > 0) ? (double) sample->rate / rate : 1.;
+  return (uint64_t) ((ratio * pitch * PCKT_PHASE_ONE) + .5);
+}
+
+/* Interpolate NFRAMES frames from the packed frames of SAMPLE, converting
+   the source frames around the read position a window at a time.  */
+static size_t
+read_packed (const PcktSample *sample, float *frames, size_t nframes,
+             uint64_t *phase, uint64_t step, PcktInterpolation intrpl)
+{
+  if (!step)
+    return 0;
+
+  float window[PACKED_WINDOW_FRAMES];
+  size_t reach = pckt_sample_get_reach (step, intrpl);
+  if (2 * reach + 2 >= PACKED_WINDOW_FRAMES)
+    return 0; /* Pitched beyond any sensible range.  */
+
+  uint64_t span = (uint64_t) (PACKED_WINDOW_FRAMES - (2 * reach) - 2)
+    << PCKT_PHASE_BITS;
+  size_t done = 0;
+  while (done < nframes && (*phase >> PCKT_PHASE_BITS) < sample->nframes)
+    {
+      size_t n = nframes - done;
+      if (n > span / step)
+        n = (span / step) ? span / step : 1;
+
+      size_t pos = *phase >> PCKT_PHASE_BITS;
+      size_t end = (*phase + ((n - 1) * step)) >> PCKT_PHASE_BITS;
+      size_t first = (pos > reach) ? pos - reach : 0;
+      size_t last = end + reach + 1;
+      if (last > sample->nframes)
+        last = sample->nframes;
+
+      unpack_frames (sample, window, first, last - first, 1.f);
+      size_t nread = pckt_sample_read_window (sample, window, first,
+                                              last - first, frames + done,
+                                              n, phase, step, intrpl);
+      done += nread;
+      if (nread < n)
+        break;
+    }
+
+  return done;
+}
+
+/* Read NFRAMES frames of SAMPLE from source position PHASE, given in 32.32
+   fixed point frames, into FRAMES.  PHASE is advanced by STEP per frame
+   read using interpolation INTRPL, or by whole frames without
+   interpolation.  Returns the number of frames read.  */
 size_t
-pckt_sample_read (const PcktSample *sample, float *frames, size_t nframes,
-                  size_t offset, uint32_t rate)
+pckt_sample_read_phase (const PcktSample *sample, float *frames,
+                        size_t nframes, uint64_t *phase, uint64_t step,
+                        PcktInterpolation intrpl)
 {
-  if (!sample || !frames || !nframes)
+  if (!sample || !frames || !nframes || !phase)
     return 0;
 
-  if ((rate == 0) || (rate == sample->rate) || !sample->interpolator)
+  PcktInterpolator interpolator = get_interpolator (intrpl);
+  if (!interpolator
+      || (step == PCKT_PHASE_ONE && (uint32_t) *phase == 0))
     {
+      size_t offset = *phase >> PCKT_PHASE_BITS;
       if (offset >= sample->nframes)
         return 0;
       else if (offset + nframes > sample->nframes)
         nframes = sample->nframes - offset;
 
+      *phase += (uint64_t) nframes << PCKT_PHASE_BITS;
+      if (sample->packed)
+        {
+          unpack_frames (sample, frames, offset, nframes, sample->gain);
+          return nframes;
+        }
       memcpy (frames, sample->frames + offset, sizeof (float) * nframes);
     }
+  else if (sample->packed)
+    nframes = read_packed (sample, frames, nframes, phase, step, intrpl);
   else
+    nframes = interpolator (sample->frames, sample->nframes, phase, step,
+                            frames, nframes);
+
+  if (sample->gain != 1.f)
+    pckt_dsp_scale (frames, nframes, sample->gain);
+
+  return nframes;
+}
+
+/* Get the number of source frames on either side of the read position that
+   interpolation INTRPL looks at when advancing by STEP.  */
+size_t
+pckt_sample_get_reach (uint64_t step, PcktInterpolation intrpl)
+{
+  switch (get_interpolator (intrpl) ? intrpl : PCKT_INTRPL_NONE)
     {
-      float ratio = (float) sample->rate / rate;
-      offset *= ratio;
-      if (ratio <= 0 || offset >= sample->nframes)
-        return 0;
+    case PCKT_INTRPL_LINEAR:
+      return 1;
+    case PCKT_INTRPL_SINC:
+      if (step > PCKT_PHASE_ONE)
+        return (size_t) ((SINC_TAPS / 2) * (step * PHASE_SCALE)) + 1;
+      return SINC_TAPS / 2;
+    default:
+      return 0;
+    }
+}
+
+/* Read like `pckt_sample_read_phase' from WINDOW, which holds NWINDOW frames
+   of SAMPLE from frame FIRST onwards as returned by `pckt_sample_read'.
+   Reading stops short where the interpolator would reach outside the
+   window, other than past the edges of the sample.  */
+size_t
+pckt_sample_read_window (const PcktSample *sample, const float *window,
+                         size_t first, size_t nwindow, float *frames,
+                         size_t nframes, uint64_t *phase, uint64_t step,
+                         PcktInterpolation intrpl)
+{
+  if (!sample || !window || !frames || !nframes || !phase || !step)
+    return 0;
 
-      nframes = sample->interpolator (sample->frames + offset,
-                                      sample->nframes - offset,
-                                      frames, nframes, ratio);
+  PcktInterpolator interpolator = get_interpolator (intrpl);
+  size_t reach = pckt_sample_get_reach (step, intrpl);
+  size_t last = first + nwindow;
+  size_t lo = (first > 0) ? first + reach : 0;
+  size_t hi = (last < sample->nframes) ? last : sample->nframes;
+  if (last < sample->nframes)
+    hi = (hi > reach) ? hi - reach : 0;
+
+  uint64_t pos = *phase;
+  if ((pos >> PCKT_PHASE_BITS) < lo || (pos >> PCKT_PHASE_BITS) >= hi)
+    return 0;
+
+  /* Count the frames whose read positions are below HI.  */
+  uint64_t end = (uint64_t) hi << PCKT_PHASE_BITS;
+  uint64_t n = ((end - pos) + step - 1) / step;
+  if (n < nframes)
+    nframes = n;
+
+  pos -= (uint64_t) first << PCKT_PHASE_BITS;
+  if (!interpolator || (step == PCKT_PHASE_ONE && (uint32_t) pos == 0))
+    {
+      size_t offset = pos >> PCKT_PHASE_BITS;
+      if (!interpolator && offset + nframes > hi - first)
+        nframes = hi - first - offset;
+      memcpy (frames, window + offset, sizeof (float) * nframes);
+      pos += (uint64_t) nframes << PCKT_PHASE_BITS;
     }
+  else
+    nframes = interpolator (window, nwindow, &pos, step, frames, nframes);
 
+  *phase = pos + ((uint64_t) first << PCKT_PHASE_BITS);
   return nframes;
 }
 
+size_t
+pckt_sample_read (const PcktSample *sample, float *frames, size_t nframes,
+                  size_t offset, uint32_t rate)
+{
+  if (!sample)
+    return 0;
+
+  uint64_t step = pckt_sample_step (sample, rate, 1.f);
+  uint64_t phase = offset * step;
+  return pckt_sample_read_phase (sample, frames, nframes, &phase, step,
+                                 sample->interpolation);
+}
+
 size_t
 pckt_sample_write (PcktSample *sample, const float *frames, size_t nframes)
 {
@@ -172,23 +965,27 @@ pckt_sample_write (PcktSample *sample, const float *frames, size_t nframes)
     return 0;
   else if (!frames || !nframes)
     return sample->nframes;
+  else if (!prepare_write (sample))
+    return sample->nframes;
 
   size_t minsize = sizeof (float) * (sample->nframes + nframes);
   if (sample->realsize < minsize)
     {
-      if (sample->realsize == 0)
-        sample->realsize = 1;
-      while (sample->realsize < minsize)
-        sample->realsize <<= 1;
-      sample->frames = realloc (sample->frames, sample->realsize);
+      size_t realsize = sample->realsize ? sample->realsize : 1;
+      while (realsize < minsize)
+        realsize <<= 1;
+      realloc_frames (sample, realsize);
     }
 
   if (sample->frames)
     {
+      size_t offset = sample->nframes;
       memcpy (sample->frames + sample->nframes,
               frames,
               sizeof (float) * nframes);
       sample->nframes += nframes;
+      if (sample->levels)
+        analyze_levels (sample, offset / PCKT_SAMPLE_LEVEL_FRAMES);
     }
   else
     sample->nframes = 0;
@@ -203,17 +1000,21 @@ pckt_sample_resize (PcktSample *sample, size_t nframes)
     return false;
   else if (nframes == sample->nframes)
     return true;
+  else if (!prepare_write (sample))
+    return false;
 
-  sample->realsize = sizeof (float) * nframes;
-  sample->frames = realloc (sample->frames, sample->realsize);
-  if (!sample->frames && nframes > 0)
+  realloc_frames (sample, sizeof (float) * nframes);
+  if (!sample->frames)
     {
-      sample->realsize = 0;
       sample->nframes = 0;
       return false;
     }
   else if (nframes < sample->nframes)
-    sample->nframes = nframes;
+    {
+      sample->nframes = nframes;
+      if (sample->levels)
+        analyze_levels (sample, nframes / PCKT_SAMPLE_LEVEL_FRAMES);
+    }
 
   return true;
 }
@@ -221,29 +1022,38 @@ pckt_sample_resize (PcktSample *sample, size_t nframes)
 bool
 pckt_sample_merge (PcktSample *s1, const PcktSample *s2, float w1, float w2)
 {
-  uint32_t f = 0;
-
-  if (!s1 || !s2)
+  if (!s1 || !s2 || !prepare_write (s1))
     return false;
 
   if ((s1->nframes < s2->nframes) && !pckt_sample_resize (s1, s2->nframes))
     return false;
 
-  for (; (f < s1->nframes) && (f < s2->nframes); ++f)
-    s1->frames[f] = (s1->frames[f] * w1) + (s2->frames[f] * w2);
-
-  if (f < s1->nframes)
+  w2 *= s2->gain;
+  for (size_t f = 0; f < s2->nframes; f += PCKT_SAMPLE_LEVEL_FRAMES)
     {
-      for (; f < s1->nframes; ++f)
-        s1->frames[f] *= w1;
-    }
-  else if (f < s2->nframes)
-    {
-      for (; f < s2->nframes; ++f)
-        s1->frames[f] = s2->frames[f] * w2;
-      s1->nframes = f;
+      float buffer[PCKT_SAMPLE_LEVEL_FRAMES];
+      size_t n = s2->nframes - f;
+      if (n > PCKT_SAMPLE_LEVEL_FRAMES)
+        n = PCKT_SAMPLE_LEVEL_FRAMES;
+
+      const float *frames = get_frames (s2, f, n, buffer);
+      for (size_t i = 0; i < n; ++i)
+        {
+          if (f + i < s1->nframes)
+            s1->frames[f + i] = (s1->frames[f + i] * w1) + (frames[i] * w2);
+          else
+            s1->frames[f + i] = frames[i] * w2;
+        }
     }
 
+  for (size_t f = s2->nframes; f < s1->nframes; ++f)
+    s1->frames[f] *= w1;
+  if (s1->nframes < s2->nframes)
+    s1->nframes = s2->nframes;
+
+  if (s1->levels)
+    analyze_levels (s1, 0);
+
   return true;
 }
 
@@ -255,11 +1065,23 @@ pckt_sample_normalize (PcktSample *sample)
   if (!sample)
     return 0.f;
 
-  for (uint32_t i = 0; i < sample->nframes; ++i)
+  if (sample->levels)
+    {
+      for (size_t i = 0; i < sample->nlevels; ++i)
+        peak = fmaxf (peak, sample->levels[(2 * i) + 1]);
+    }
+  else
     {
-      float amp = fabsf (sample->frames[i]);
-      if (amp > peak)
-        peak = amp;
+      for (size_t f = 0; f < sample->nframes; f += PCKT_SAMPLE_LEVEL_FRAMES)
+        {
+          float buffer[PCKT_SAMPLE_LEVEL_FRAMES];
+          size_t n = sample->nframes - f;
+          if (n > PCKT_SAMPLE_LEVEL_FRAMES)
+            n = PCKT_SAMPLE_LEVEL_FRAMES;
+          peak = fmaxf (peak, pckt_dsp_peak (get_frames (sample, f, n,
+                                                         buffer), n));
+        }
+      peak *= sample->gain;
     }
 
   if (peak == 0.f)
@@ -269,12 +1091,163 @@ pckt_sample_normalize (PcktSample *sample)
 
   factor = 1.f / peak;
 
-  for (uint32_t i = 0; i < sample->nframes; ++i)
-    sample->frames[i] *= factor;
+  /* Mapped and packed frames are scaled on read instead.  */
+  if (sample->mapping || sample->packed)
+    sample->gain *= factor;
+  else
+    pckt_dsp_scale (sample->frames, sample->nframes, factor);
+  if (sample->levels)
+    pckt_dsp_scale (sample->levels, 2 * sample->nlevels, factor);
 
   return factor;
 }
 
+/* Calculate the level envelope of SAMPLE, see `pckt_sample_rms' and
+   `pckt_sample_peak'.  */
+bool
+pckt_sample_analyze (PcktSample *sample)
+{
+  if (!sample)
+    return false;
+  return analyze_levels (sample, 0);
+}
+
+/* Get the number of frames in SAMPLE.  */
+size_t
+pckt_sample_get_length (const PcktSample *sample)
+{
+  return sample ? sample->nframes : 0;
+}
+
+/* Get the number of leading frames of SAMPLE that can be read without
+   waiting for the disk, i.e. all frames on the heap or the faulted in head
+   of mapped frames.  */
+size_t
+pckt_sample_get_head (const PcktSample *sample)
+{
+  if (!sample)
+    return 0;
+  return (sample->mapping
+          ? __atomic_load_n (&sample->nhead, __ATOMIC_ACQUIRE)
+          : sample->nframes);
+}
+
+/* Get the level envelope of SAMPLE as NLEVELS pairs of RMS and peak.  */
+const float *
+pckt_sample_get_levels (const PcktSample *sample, size_t *nlevels)
+{
+  if (!sample || !sample->levels)
+    return NULL;
+  if (nlevels)
+    *nlevels = sample->nlevels;
+  return sample->levels;
+}
+
+/* Restore a level envelope of SAMPLE previously returned by
+   `pckt_sample_get_levels' instead of analyzing the frames again.  */
+bool
+pckt_sample_set_levels (PcktSample *sample, const float *levels,
+                        size_t nlevels)
+{
+  if (!sample || !levels
+      || nlevels != ((sample->nframes + PCKT_SAMPLE_LEVEL_FRAMES - 1)
+                     / PCKT_SAMPLE_LEVEL_FRAMES))
+    return false;
+
+  float *copy = realloc (sample->levels,
+                         2 * (nlevels ? nlevels : 1) * sizeof (float));
+  if (!copy)
+    return false;
+
+  memcpy (copy, levels, 2 * nlevels * sizeof (float));
+  sample->levels = copy;
+  sample->nlevels = nlevels;
+  return true;
+}
+
+/* Look up level KIND (0 for RMS, 1 for peak) at frame OFFSET when played
+   back at RATE.  */
+static inline float
+lookup_level (const PcktSample *sample, size_t offset, uint32_t rate,
+              uint8_t kind)
+{
+  if (rate > 0 && rate != sample->rate)
+    offset *= (float) sample->rate / rate;
+
+  size_t i = offset / PCKT_SAMPLE_LEVEL_FRAMES;
+  return (i < sample->nlevels) ? sample->levels[(2 * i) + kind] : 0;
+}
+
+/* Get RMS level of the frames around OFFSET when SAMPLE is played back at
+   RATE, or 1 if the sample hasn't been analyzed.  */
+float
+pckt_sample_rms (const PcktSample *sample, size_t offset, uint32_t rate)
+{
+  if (!sample)
+    return 0;
+  else if (!sample->levels)
+    return sample->nframes ? 1.f : 0;
+  return lookup_level (sample, offset, rate, 0);
+}
+
+/* Get peak level of the frames around OFFSET when SAMPLE is played back at
+   RATE, or 1 if the sample hasn't been analyzed.  */
+float
+pckt_sample_peak (const PcktSample *sample, size_t offset, uint32_t rate)
+{
+  if (!sample)
+    return 0;
+  else if (!sample->levels)
+    return sample->nframes ? 1.f : 0;
+  return lookup_level (sample, offset, rate, 1);
+}
+
+/* Get a copy of SAMPLE sped up by PITCH using interpolation INTRPL, so that
+   the copy can be played back at the rate of SAMPLE without interpolation.
+   Returns NULL on failure.  */
+PcktSample *
+pckt_sample_transpose (const PcktSample *sample, float pitch,
+                       PcktInterpolation intrpl)
+{
+  if (!sample || pitch <= 0)
+    return NULL;
+
+  PcktSample *copy = pckt_sample_new ();
+  if (!copy)
+    return NULL;
+
+  uint64_t step = pckt_sample_step (sample, 0, pitch);
+  size_t nframes = ceil (sample->nframes * ((double) PCKT_PHASE_ONE / step));
+  copy->rate = sample->rate;
+  copy->interpolation = sample->interpolation;
+  copy->allocator = sample->allocator;
+  if (intrpl == PCKT_INTRPL_NONE)
+    intrpl = sample->interpolation;
+
+  if (nframes > 0)
+    {
+      uint64_t phase = 0;
+      copy->frames = alloc_frames (copy, nframes * sizeof (float));
+      if (!copy->frames)
+        {
+          pckt_sample_free (copy);
+          return NULL;
+        }
+      copy->realsize = nframes * sizeof (float);
+      copy->nframes = pckt_sample_read_phase (sample, copy->frames, nframes,
+                                              &phase, step, intrpl);
+    }
+
+  if ((sample->levels && !analyze_levels (copy, 0))
+      || !pckt_sample_compact (copy, sample->format))
+    {
+      pckt_sample_free (copy);
+      return NULL;
+    }
+
+  return copy;
+}
+
 bool
 pckt_resample (PcktSample *sample, uint32_t rate)
 {
@@ -283,20 +1256,25 @@ pckt_resample (PcktSample *sample, uint32_t rate)
   else if (sample->rate == rate || sample->nframes == 0)
     return true;
 
+  PcktSampleFormat format = sample->format;
   float ratio = (float) rate / sample->rate;
   size_t nframes = ratio * sample->nframes;
-  float *frames = malloc (nframes * sizeof (float));
+  float *frames = alloc_frames (sample, nframes * sizeof (float));
   if (!frames)
     return false;
 
   memset (frames, 0, nframes * sizeof (float));
   pckt_sample_read (sample, frames, nframes, 0, rate);
 
-  free (sample->frames);
+  release_frames (sample);
   sample->frames = frames;
   sample->nframes = nframes;
   sample->realsize = nframes * sizeof (float);
   sample->rate = rate;
+  sample->gain = 1.f;
 
-  return true;
+  if (sample->levels)
+    analyze_levels (sample, 0);
+
+  return pckt_sample_compact (sample, format);
 }
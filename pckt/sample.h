@@ -20,8 +20,13 @@
 
 #include <stdlib.h>
 #include "pckt.h"
+#include "alloc.h"
 
 #define PCKT_SAMPLE_RATE_DEFAULT 44100
+#define PCKT_SAMPLE_LEVEL_FRAMES 256
+#define PCKT_SAMPLE_ATTACK_FRAMES 8192 /* Mapped frames to keep resident.  */
+#define PCKT_PHASE_BITS 32
+#define PCKT_PHASE_ONE ((uint64_t) 1 << PCKT_PHASE_BITS)
 
 __BEGIN_DECLS
 
@@ -29,22 +34,68 @@ typedef struct PcktSampleImpl PcktSample;
 typedef enum {
   PCKT_INTRPL_NONE = 0,
   PCKT_INTRPL_CONSTANT,
-  PCKT_INTRPL_LINEAR
+  PCKT_INTRPL_LINEAR,
+  PCKT_INTRPL_SINC
 } PcktInterpolation;
 
+/* In-memory storage of sample frames.  The integer formats are scaled to
+   use their full range and hold 2 and 3 bytes per frame respectively.  */
+typedef enum {
+  PCKT_SAMPLE_FLOAT = 0,
+  PCKT_SAMPLE_INT16,
+  PCKT_SAMPLE_INT24
+} PcktSampleFormat;
+
 extern PcktSample *pckt_sample_new ();
 extern void pckt_sample_free (PcktSample *);
+extern bool pckt_sample_set_allocator (PcktSample *, const PcktAllocator *);
+extern const PcktAllocator *pckt_sample_get_allocator (const PcktSample *);
+extern PcktSample *pckt_sample_map (const char *, size_t, size_t, uint32_t);
+extern PcktSample *pckt_sample_view (const float *, size_t, uint32_t);
+extern bool pckt_sample_lock (PcktSample *, size_t);
+extern bool pckt_sample_unlock (PcktSample *);
+extern bool pckt_sample_is_mapped (const PcktSample *);
+extern void pckt_sample_add_voice (PcktSample *);
+extern void pckt_sample_remove_voice (PcktSample *);
+extern bool pckt_sample_is_playing (const PcktSample *);
+extern bool pckt_sample_spill (PcktSample *, const char *);
+extern size_t pckt_sample_get_memory (const PcktSample *);
+extern bool pckt_sample_compact (PcktSample *, PcktSampleFormat);
+extern PcktSampleFormat pckt_sample_get_format (const PcktSample *);
 extern uint32_t pckt_sample_rate (PcktSample *, uint32_t);
 extern bool pckt_sample_set_interpolation (PcktSample *, PcktInterpolation);
+extern PcktInterpolation pckt_sample_get_interpolation (const PcktSample *);
 extern size_t pckt_sample_read (const PcktSample *, float *, size_t, size_t,
                                 uint32_t);
+extern uint64_t pckt_sample_step (const PcktSample *, uint32_t, float);
+extern size_t pckt_sample_read_phase (const PcktSample *, float *, size_t,
+                                      uint64_t *, uint64_t,
+                                      PcktInterpolation);
+extern size_t pckt_sample_get_reach (uint64_t, PcktInterpolation);
+extern size_t pckt_sample_read_window (const PcktSample *, const float *,
+                                       size_t, size_t, float *, size_t,
+                                       uint64_t *, uint64_t,
+                                       PcktInterpolation);
 extern size_t pckt_sample_write (PcktSample *, const float *, size_t);
 extern bool pckt_sample_resize (PcktSample *, size_t);
 extern bool pckt_sample_merge (PcktSample *, const PcktSample *, float, float);
 extern float pckt_sample_normalize (PcktSample *);
+extern bool pckt_sample_analyze (PcktSample *);
+extern size_t pckt_sample_get_length (const PcktSample *);
+extern size_t pckt_sample_get_head (const PcktSample *);
+extern const float *pckt_sample_get_levels (const PcktSample *, size_t *);
+extern bool pckt_sample_set_levels (PcktSample *, const float *, size_t);
+extern float pckt_sample_rms (const PcktSample *, size_t, uint32_t);
+extern float pckt_sample_peak (const PcktSample *, size_t, uint32_t);
+extern PcktSample *pckt_sample_transpose (const PcktSample *, float,
+                                          PcktInterpolation);
 extern bool pckt_resample (PcktSample *, uint32_t);
-extern PcktSample *pckt_sample_factory_mono (const char *);
-extern PcktSample **pckt_sample_factory (const char *, size_t *);
+extern PcktSample *pckt_sample_factory_mono (const char *, uint32_t,
+                                             PcktInterpolation,
+                                             const PcktAllocator *);
+extern PcktSample **pckt_sample_factory (const char *, uint32_t,
+                                         PcktInterpolation,
+                                         const PcktAllocator *, size_t *);
 
 __END_DECLS
 
@@ -16,8 +16,416 @@
    along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <sndfile.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "sample.h"
+#include "codec.h"
+#include "util.h"
+
+/* Decoded and resampled samples are cached in the directory given by
+   `pckt_cache_path'.  By default frames are cached as native floats and
+   memory mapped by later loads, if CACHE_COMPRESS_ENV is set they are
+   compressed losslessly and decoded onto the heap instead.  */
+#define CACHE_COMPRESS_ENV "PCKT_SAMPLE_CACHE_COMPRESS"
+#define CACHE_MAGIC "PCKTSMP1"
+#define CACHE_MAGIC_COMPRESSED "PCKTSMZ1"
+#define CACHE_ALIGN 4096
+
+/* Header of a sample cache file.  It is followed by the name of the source
+   file and, from DATA_OFFSET, by NFRAMES frames of each channel and then
+   NLEVELS level pairs of each channel.  In compressed caches DATA_OFFSET
+   instead holds an index with the file offset of every block of every
+   channel, ending with the end of the last block, followed by the levels
+   of each channel and the blocks.  */
+typedef struct {
+  char magic[8];
+  uint32_t rate;
+  uint32_t nchannels;
+  uint64_t nframes;
+  uint64_t nlevels;
+  int64_t mtime;
+  int64_t size;
+  uint64_t namelen;
+  uint64_t data_offset;
+} CacheHeader;
+
+static bool
+cache_is_compressed ()
+{
+  const char *compress = getenv (CACHE_COMPRESS_ENV);
+  return compress && *compress && strcmp (compress, "0");
+}
+
+/* Get the interpolation to resample with for INTRPL, which is sinc unless
+   another one is asked for since it's done once per load.  */
+static PcktInterpolation
+get_resample_interpolation (PcktInterpolation intrpl)
+{
+  return intrpl == PCKT_INTRPL_NONE ? PCKT_INTRPL_SINC : intrpl;
+}
+
+/* Get the name of the cache file for FILENAME resampled to RATE using
+   INTRPL, or NULL if caching is off.  */
+static char *
+get_cache_filename (const char *filename, bool mono, uint32_t rate,
+                    PcktInterpolation intrpl)
+{
+  char suffix[48];
+  const char *method = "";
+  intrpl = get_resample_interpolation (intrpl);
+  if (rate && intrpl == PCKT_INTRPL_LINEAR)
+    method = "-linear";
+  else if (rate && intrpl == PCKT_INTRPL_CONSTANT)
+    method = "-constant";
+  snprintf (suffix, sizeof suffix, "-%u%s%s.%s", rate, method,
+            mono ? "-mono" : "", cache_is_compressed () ? "pcz" : "pcm");
+  return pckt_cache_path (filename, suffix);
+}
+
+/* Read HEADER of a cache of FILENAME, whose status is SRC, from FILE and
+   check that it's a MAGIC cache of the current file at RATE.  */
+static bool
+read_header (FILE *file, const char *magic, const char *filename,
+             const struct stat *src, uint32_t rate, CacheHeader *header)
+{
+  size_t namelen = strlen (filename);
+  char name[namelen + 1];
+
+  memset (header, 0, sizeof (CacheHeader));
+  return ((fread (header, sizeof (CacheHeader), 1, file) == 1)
+          && !memcmp (header->magic, magic, sizeof header->magic)
+          && (header->mtime == (int64_t) src->st_mtime)
+          && (header->size == (int64_t) src->st_size)
+          && (!rate || header->rate == rate)
+          && (header->namelen == namelen)
+          && (fread (name, 1, namelen, file) == namelen)
+          && !memcmp (name, filename, namelen)
+          && (header->nchannels > 0) && (header->nframes > 0));
+}
+
+/* Map the samples of FILENAME, whose status is SRC, from CACHE, to be
+   copied into frames from ALLOCATOR when changed.  Returns a NULL
+   terminated array of *NCHANNELS samples or NULL if the cache is missing
+   or stale.  */
+static PcktSample **
+map_cache (const char *cache, const char *filename, const struct stat *src,
+           uint32_t rate, const PcktAllocator *allocator, size_t *nchannels)
+{
+  CacheHeader header;
+  FILE *file = fopen (cache, "rb");
+  if (!file)
+    return NULL;
+
+  bool valid = read_header (file, CACHE_MAGIC, filename, src, rate, &header);
+  uint64_t chsize = header.nframes * sizeof (float);
+  size_t nlevels = 2 * header.nlevels;
+  float *levels = valid ? malloc (nlevels * sizeof (float)) : NULL;
+  PcktSample **samples = NULL;
+  if (levels)
+    samples = calloc (header.nchannels + 1, sizeof (PcktSample *));
+
+  for (uint32_t ch = 0; samples && ch < header.nchannels; ++ch)
+    {
+      uint64_t offset = header.data_offset + (header.nchannels * chsize)
+        + (ch * nlevels * sizeof (float));
+      samples[ch] = pckt_sample_map (cache, header.data_offset + (ch * chsize),
+                                     header.nframes, header.rate);
+      if (!samples[ch] || (fseeko (file, (off_t) offset, SEEK_SET) != 0)
+          || (fread (levels, sizeof (float), nlevels, file) != nlevels)
+          || !pckt_sample_set_levels (samples[ch], levels, header.nlevels))
+        {
+          for (uint32_t i = 0; i <= ch; ++i)
+            pckt_sample_free (samples[i]);
+          free (samples);
+          samples = NULL;
+          break;
+        }
+
+      pckt_sample_set_interpolation (samples[ch], PCKT_INTRPL_LINEAR);
+      pckt_sample_set_allocator (samples[ch], allocator);
+      pckt_sample_lock (samples[ch], PCKT_SAMPLE_ATTACK_FRAMES);
+    }
+
+  if (samples && nchannels)
+    *nchannels = header.nchannels;
+
+  free (levels);
+  fclose (file);
+  return samples;
+}
+
+/* Decode the samples of FILENAME, whose status is SRC, from the compressed
+   CACHE into frames from ALLOCATOR.  Returns a NULL terminated array of
+   *NCHANNELS samples or NULL if the cache is missing, stale or corrupt.  */
+static PcktSample **
+decode_cache (const char *cache, const char *filename, const struct stat *src,
+              uint32_t rate, const PcktAllocator *allocator,
+              size_t *nchannels)
+{
+  CacheHeader header;
+  struct stat st;
+  FILE *file = fopen (cache, "rb");
+  if (!file)
+    return NULL;
+
+  bool valid = (fstat (fileno (file), &st) == 0)
+    && read_header (file, CACHE_MAGIC_COMPRESSED, filename, src, rate,
+                    &header);
+  uint64_t nblocks = (header.nframes + PCKT_CODEC_BLOCK_FRAMES - 1)
+    / PCKT_CODEC_BLOCK_FRAMES;
+  size_t nindex = (header.nchannels * nblocks) + 1;
+  size_t nlevels = 2 * header.nlevels;
+  uint64_t *index = valid ? malloc (nindex * sizeof (uint64_t)) : NULL;
+  float *levels = index ? malloc (header.nchannels * nlevels
+                                  * sizeof (float)) : NULL;
+  uint8_t *data = NULL;
+  valid = levels
+    && (fseeko (file, (off_t) header.data_offset, SEEK_SET) == 0)
+    && (fread (index, sizeof (uint64_t), nindex, file) == nindex)
+    && (fread (levels, sizeof (float), header.nchannels * nlevels, file)
+        == header.nchannels * nlevels)
+    && (index[0] == (uint64_t) ftello (file))
+    && (index[nindex - 1] >= index[0])
+    && (index[nindex - 1] <= (uint64_t) st.st_size);
+
+  /* Read all blocks at once and decode them through the index.  */
+  size_t datasize = valid ? index[nindex - 1] - index[0] : 0;
+  if (valid)
+    data = malloc (datasize ? datasize : 1);
+  valid = data && (fread (data, 1, datasize, file) == datasize);
+  fclose (file);
+
+  PcktSample **samples = NULL;
+  if (valid)
+    samples = calloc (header.nchannels + 1, sizeof (PcktSample *));
+
+  for (uint32_t ch = 0; samples && ch < header.nchannels; ++ch)
+    {
+      float frames[PCKT_CODEC_BLOCK_FRAMES];
+      PcktSample *sample = pckt_sample_new ();
+      samples[ch] = sample;
+      bool ok = sample && pckt_sample_set_allocator (sample, allocator)
+        && pckt_sample_resize (sample, header.nframes);
+      if (ok)
+        {
+          pckt_sample_rate (sample, header.rate);
+          pckt_sample_set_interpolation (sample, PCKT_INTRPL_LINEAR);
+        }
+
+      for (uint64_t b = 0; ok && b < nblocks; ++b)
+        {
+          const uint64_t *block = index + (ch * nblocks) + b;
+          size_t n = header.nframes - (b * PCKT_CODEC_BLOCK_FRAMES);
+          if (n > PCKT_CODEC_BLOCK_FRAMES)
+            n = PCKT_CODEC_BLOCK_FRAMES;
+          ok = (block[0] <= block[1]) && (block[1] <= index[nindex - 1])
+            && pckt_codec_decode (data + (block[0] - index[0]),
+                                  block[1] - block[0], frames, n)
+            && (pckt_sample_write (sample, frames, n)
+                == (b * PCKT_CODEC_BLOCK_FRAMES) + n);
+        }
+
+      if (!ok || !pckt_sample_set_levels (sample, levels + (ch * nlevels),
+                                          header.nlevels))
+        {
+          for (uint32_t i = 0; i <= ch; ++i)
+            pckt_sample_free (samples[i]);
+          free (samples);
+          samples = NULL;
+        }
+    }
+
+  if (samples && nchannels)
+    *nchannels = header.nchannels;
+
+  free (data);
+  free (levels);
+  free (index);
+  return samples;
+}
+
+/* Write the frames of NCHANNELS SAMPLES to FILE as NFRAMES compressed
+   blocks per channel, preceded by the block index and the levels.  */
+static bool
+write_blocks (FILE *file, PcktSample **samples, size_t nchannels,
+              size_t nframes, size_t nlevels)
+{
+  size_t nblocks = (nframes + PCKT_CODEC_BLOCK_FRAMES - 1)
+    / PCKT_CODEC_BLOCK_FRAMES;
+  size_t nindex = (nchannels * nblocks) + 1;
+  uint64_t *index = malloc (nindex * sizeof (uint64_t));
+  uint8_t *block = malloc (PCKT_CODEC_BOUND (PCKT_CODEC_BLOCK_FRAMES));
+  off_t start = ftello (file);
+  bool ok = index && block && (start >= 0);
+
+  /* Leave room for the index, it's written when the blocks are.  */
+  ok = ok && (fseeko (file, (off_t) (nindex * sizeof (uint64_t)),
+                      SEEK_CUR) == 0);
+  for (size_t ch = 0; ok && ch < nchannels; ++ch)
+    {
+      const float *levels = pckt_sample_get_levels (samples[ch], NULL);
+      ok = (fwrite (levels, sizeof (float), 2 * nlevels, file)
+            == 2 * nlevels);
+    }
+
+  for (size_t ch = 0; ok && ch < nchannels; ++ch)
+    {
+      for (size_t b = 0; ok && b < nblocks; ++b)
+        {
+          float frames[PCKT_CODEC_BLOCK_FRAMES];
+          size_t n = pckt_sample_read (samples[ch], frames,
+                                       PCKT_CODEC_BLOCK_FRAMES,
+                                       b * PCKT_CODEC_BLOCK_FRAMES, 0);
+          size_t size = pckt_codec_encode (frames, n, block);
+          index[(ch * nblocks) + b] = (uint64_t) ftello (file);
+          ok = (size > 0) && (fwrite (block, 1, size, file) == size);
+        }
+    }
+
+  if (ok)
+    {
+      index[nindex - 1] = (uint64_t) ftello (file);
+      ok = (fseeko (file, start, SEEK_SET) == 0)
+        && (fwrite (index, sizeof (uint64_t), nindex, file) == nindex);
+    }
+
+  free (block);
+  free (index);
+  return ok;
+}
+
+/* Write NCHANNELS decoded SAMPLES of FILENAME, whose status is SRC, to
+   CACHE.  */
+static bool
+write_cache (const char *cache, const char *filename, const struct stat *src,
+             PcktSample **samples, size_t nchannels)
+{
+  size_t nlevels = 0, namelen = strlen (filename);
+  uint32_t rate = pckt_sample_rate (samples[0], 0);
+  size_t nframes = pckt_sample_write (samples[0], NULL, 0);
+  if (nframes == 0 || !pckt_sample_get_levels (samples[0], &nlevels))
+    return false;
+
+  for (size_t ch = 1; ch < nchannels; ++ch)
+    {
+      if (pckt_sample_rate (samples[ch], 0) != rate
+          || pckt_sample_write (samples[ch], NULL, 0) != nframes
+          || !pckt_sample_get_levels (samples[ch], NULL))
+        return false;
+    }
+
+  bool compress = cache_is_compressed ();
+  CacheHeader header = {
+    CACHE_MAGIC, rate, (uint32_t) nchannels, nframes, nlevels,
+    (int64_t) src->st_mtime, (int64_t) src->st_size, namelen,
+    ((sizeof (CacheHeader) + namelen + CACHE_ALIGN - 1) / CACHE_ALIGN)
+    * CACHE_ALIGN
+  };
+
+  /* Write to a temporary file first so that other processes never map a
+     partial cache, with a serial since threads may decode the same file.  */
+  static uint32_t serial = 0;
+  char *tmp = pckt_strdupf ("%s.%ld.%u", cache, (long) getpid (),
+                            __atomic_fetch_add (&serial, 1,
+                                                __ATOMIC_RELAXED));
+  FILE *file = tmp ? fopen (tmp, "wb") : NULL;
+  if (!file)
+    {
+      free (tmp);
+      return false;
+    }
+
+  if (compress)
+    memcpy (header.magic, CACHE_MAGIC_COMPRESSED, sizeof header.magic);
+
+  bool ok = ((fwrite (&header, sizeof (CacheHeader), 1, file) == 1)
+             && (fwrite (filename, 1, namelen, file) == namelen)
+             && (fseeko (file, (off_t) header.data_offset, SEEK_SET) == 0));
+
+  if (compress)
+    {
+      ok = ok && write_blocks (file, samples, nchannels, nframes, nlevels);
+      nchannels = 0; /* Frames and levels have been written.  */
+    }
+
+  float frames[4096];
+  for (size_t ch = 0; ok && ch < nchannels; ++ch)
+    {
+      size_t nread;
+      for (size_t offset = 0; ok && offset < nframes; offset += nread)
+        {
+          nread = pckt_sample_read (samples[ch], frames, 4096, offset, 0);
+          ok = (nread > 0) && (fwrite (frames, sizeof (float), nread, file)
+                               == nread);
+        }
+    }
+
+  for (size_t ch = 0; ok && ch < nchannels; ++ch)
+    {
+      const float *levels = pckt_sample_get_levels (samples[ch], NULL);
+      ok = (fwrite (levels, sizeof (float), 2 * nlevels, file)
+            == 2 * nlevels);
+    }
+
+  ok = (fclose (file) == 0) && ok;
+  if (ok)
+    ok = (rename (tmp, cache) == 0);
+  else
+    remove (tmp);
+
+  free (tmp);
+  return ok;
+}
+
+/* Get the samples of FILENAME resampled to RATE using INTRPL from the
+   cache with frames from ALLOCATOR, or NULL if it isn't cached.  */
+static PcktSample **
+load_cached (const char *filename, bool mono, uint32_t rate,
+             PcktInterpolation intrpl, const PcktAllocator *allocator,
+             size_t *nchannels)
+{
+  struct stat st;
+  PcktSample **samples = NULL;
+  char *cache = get_cache_filename (filename, mono, rate, intrpl);
+  if (cache && stat (filename, &st) == 0)
+    samples = cache_is_compressed ()
+      ? decode_cache (cache, filename, &st, rate, allocator, nchannels)
+      : map_cache (cache, filename, &st, rate, allocator, nchannels);
+  free (cache);
+  return samples;
+}
+
+/* Cache NCHANNELS decoded SAMPLES of FILENAME resampled to RATE using
+   INTRPL and, unless the cache is compressed, replace them with memory
+   mapped copies.  */
+static bool
+store_cached (const char *filename, bool mono, uint32_t rate,
+              PcktInterpolation intrpl, PcktSample **samples,
+              size_t nchannels)
+{
+  struct stat st;
+  PcktSample **mapped = NULL;
+  char *cache = get_cache_filename (filename, mono, rate, intrpl);
+  if (cache && stat (filename, &st) == 0
+      && write_cache (cache, filename, &st, samples, nchannels)
+      && !cache_is_compressed ())
+    mapped = map_cache (cache, filename, &st, rate,
+                        pckt_sample_get_allocator (samples[0]), NULL);
+  free (cache);
+
+  if (!mapped)
+    return false;
+
+  for (size_t ch = 0; ch < nchannels; ++ch)
+    {
+      pckt_sample_free (samples[ch]);
+      samples[ch] = mapped[ch];
+    }
+  free (mapped);
+  return true;
+}
 
 static bool
 load_sample (PcktSample *sample, SNDFILE *file, const SF_INFO *info)
@@ -45,12 +453,42 @@ load_sample (PcktSample *sample, SNDFILE *file, const SF_INFO *info)
       pckt_sample_write (sample, mono, nread);
     }
 
-  return true;
+  return pckt_sample_analyze (sample);
+}
+
+/* Resample SAMPLE to RATE, unless RATE is zero, using INTRPL, see
+   `get_resample_interpolation'.  */
+static bool
+resample_sample (PcktSample *sample, uint32_t rate, PcktInterpolation intrpl)
+{
+  if (!rate)
+    return true;
+
+  PcktInterpolation prev = pckt_sample_get_interpolation (sample);
+  bool ok = pckt_sample_set_interpolation (sample,
+                                           get_resample_interpolation (intrpl))
+    && pckt_resample (sample, rate);
+  pckt_sample_set_interpolation (sample, prev);
+  return ok;
 }
 
+/* Load FILENAME mixed down to one channel and resampled to RATE using
+   INTRPL, or sinc if it's PCKT_INTRPL_NONE, or at its own rate if RATE is
+   zero.  Frames are allocated from ALLOCATOR, or the heap if NULL.  */
 PcktSample *
-pckt_sample_factory_mono (const char *filename)
+pckt_sample_factory_mono (const char *filename, uint32_t rate,
+                          PcktInterpolation intrpl,
+                          const PcktAllocator *allocator)
 {
+  PcktSample **cached = load_cached (filename, true, rate, intrpl, allocator,
+                                     NULL);
+  if (cached)
+    {
+      PcktSample *sample = cached[0];
+      free (cached);
+      return sample;
+    }
+
   SF_INFO info;
   info.format = 0;
   SNDFILE *file = sf_open (filename, SFM_READ, &info);
@@ -58,27 +496,41 @@ pckt_sample_factory_mono (const char *filename)
     return NULL;
 
   PcktSample *sample = pckt_sample_new ();
+  pckt_sample_set_allocator (sample, allocator);
   pckt_sample_rate (sample, (uint32_t) info.samplerate);
   pckt_sample_resize (sample, (size_t) info.frames);
   pckt_sample_set_interpolation (sample, PCKT_INTRPL_LINEAR);
-  if (!load_sample (sample, file, &info))
+  if (!load_sample (sample, file, &info)
+      || !resample_sample (sample, rate, intrpl))
     {
       pckt_sample_free (sample);
       sample = NULL;
     }
+  else
+    store_cached (filename, true, rate, intrpl, &sample, 1);
 
   sf_close (file);
   return sample;
 }
 
+/* Load the channels of FILENAME resampled to RATE using INTRPL into frames
+   from ALLOCATOR as in `pckt_sample_factory_mono' into a NULL terminated
+   array of *NCHANNELS samples.  */
 PcktSample **
-pckt_sample_factory (const char *filename, size_t *nchannels)
+pckt_sample_factory (const char *filename, uint32_t rate,
+                     PcktInterpolation intrpl,
+                     const PcktAllocator *allocator, size_t *nchannels)
 {
   PcktSample **samples = NULL;
   SF_INFO info;
   SNDFILE *file;
   uint8_t ch;
 
+  samples = load_cached (filename, false, rate, intrpl, allocator,
+                         nchannels);
+  if (samples)
+    return samples;
+
   info.format = 0;
   file = sf_open (filename, SFM_READ, &info);
 
@@ -95,6 +547,7 @@ pckt_sample_factory (const char *filename, size_t *nchannels)
   for (ch = 0; ch < info.channels; ++ch)
     {
       samples[ch] = pckt_sample_new ();
+      pckt_sample_set_allocator (samples[ch], allocator);
       pckt_sample_rate (samples[ch], (uint32_t) info.samplerate);
       pckt_sample_resize (samples[ch], (size_t) info.frames);
       pckt_sample_set_interpolation (samples[ch], PCKT_INTRPL_LINEAR);
@@ -116,6 +569,15 @@ pckt_sample_factory (const char *filename, size_t *nchannels)
         }
     }
 
+  for (ch = 0; ch < info.channels; ++ch)
+    {
+      pckt_sample_analyze (samples[ch]);
+      resample_sample (samples[ch], rate, intrpl);
+    }
+
+  store_cached (filename, false, rate, intrpl, samples,
+                (size_t) info.channels);
+
   if (nchannels)
     *nchannels = (size_t) info.channels;
 
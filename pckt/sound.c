@@ -18,31 +18,459 @@
 #include <string.h>
 #include <math.h>
 #include "sound.h"
+#include "stream.h"
+#include "dsp.h"
+
+#define NO_VOICE UINT32_MAX
+
+typedef enum {
+  VOICE_FREE = 0, /* Silent and on the free list.  */
+  VOICE_PENDING,  /* Handed out but not yet processed, can't be stolen.  */
+  VOICE_LIVE      /* Playing and on the heap.  */
+} VoiceState;
+
+/* Pool side bookkeeping of a sound.  */
+typedef struct {
+  VoiceState state;
+  const void *source;
+  uint32_t prev;     /* Previous voice of the same source.  */
+  uint32_t next;     /* Next voice of the same source.  */
+  uint32_t heappos;  /* Position in heap if live.  */
+} Voice;
+
+/* Hash table entry listing the voices of a source.  */
+typedef struct {
+  const void *source;
+  uint32_t head;
+  uint32_t nvoices;
+} SourceEntry;
+
+/* Per block rendering parameters of a sound.  */
+typedef struct {
+  uint32_t rate;
+  float pitch;
+  PcktInterpolation interpolation;
+  float decay;
+  float expdecay;
+  bool smoothen;
+  PcktDspSmoother smoother;
+} RenderParams;
+
+/* Voice state stored as a structure of arrays, where every array holds one
+   entry per voice.  The state of one channel is contiguous across voices.  */
+typedef struct {
+  PcktSample **samples[PCKT_NCHANNELS];
+  PcktStream **streams[PCKT_NCHANNELS]; /* NULL unless tail is streamed.  */
+  float *bleed[PCKT_NCHANNELS];
+  uint64_t *phase[PCKT_NCHANNELS];
+  float *tail[PCKT_NCHANNELS];
+  uint16_t *active;
+  uint16_t *held;       /* Channels counted as voices of their samples.  */
+  float *impact;
+  float *pitch;
+  float *smoothness;
+  float *stiffness;
+  float *level;         /* Loudness according to the steal metric.  */
+  bool *choke;
+  PcktInterpolation *interpolation;
+} VoiceBank;
 
 struct PcktSoundPoolImpl {
-  PcktSound *sounds;
+  PcktSound *sounds;    /* Handed out by `pckt_soundpool_get'.  */
+  VoiceBank bank;       /* State of processed voices.  */
+  RenderParams *params; /* Scratch space for `pckt_soundpool_process'.  */
+  uint32_t *playing;
+  float *peaks;
+  Voice *voices;
   size_t nsounds;
+  uint32_t *freelist;   /* Stack of silent voices.  */
+  size_t nfree;
+  uint32_t *heap;       /* Min-heap of live voices keyed on level.  */
+  size_t nheap;
+  SourceEntry *sources; /* Open addressing with linear probing.  */
+  size_t sourcemask;
+  PcktStealMetric metric;
+  PcktStreamer *streamer;
 };
 
+static inline size_t
+source_hash (const PcktSoundPool *pool, const void *source)
+{
+  uintptr_t h = (uintptr_t) source;
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return (size_t) h & pool->sourcemask;
+}
+
+static inline SourceEntry *
+source_find (PcktSoundPool *pool, const void *source)
+{
+  size_t i = source_hash (pool, source);
+  while (pool->sources[i].source)
+    {
+      if (pool->sources[i].source == source)
+        return pool->sources + i;
+      i = (i + 1) & pool->sourcemask;
+    }
+  return NULL;
+}
+
+static inline SourceEntry *
+source_insert (PcktSoundPool *pool, const void *source)
+{
+  size_t i = source_hash (pool, source);
+  while (pool->sources[i].source)
+    {
+      if (pool->sources[i].source == source)
+        return pool->sources + i;
+      i = (i + 1) & pool->sourcemask;
+    }
+  pool->sources[i].source = source;
+  pool->sources[i].head = NO_VOICE;
+  pool->sources[i].nvoices = 0;
+  return pool->sources + i;
+}
+
+static void
+source_remove (PcktSoundPool *pool, SourceEntry *entry)
+{
+  size_t i = entry - pool->sources, j = i, k;
+
+  /* Shift following entries of the same probe sequence back into the gap so
+     that lookups don't need tombstones.  */
+  for (;;)
+    {
+      j = (j + 1) & pool->sourcemask;
+      if (!pool->sources[j].source)
+        break;
+      k = source_hash (pool, pool->sources[j].source);
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+        {
+          pool->sources[i] = pool->sources[j];
+          i = j;
+        }
+    }
+  pool->sources[i].source = NULL;
+}
+
+static void
+voice_link (PcktSoundPool *pool, uint32_t v, const void *source)
+{
+  SourceEntry *entry = source_insert (pool, source);
+  Voice *voice = pool->voices + v;
+  voice->source = source;
+  voice->prev = NO_VOICE;
+  voice->next = entry->head;
+  if (entry->head != NO_VOICE)
+    pool->voices[entry->head].prev = v;
+  entry->head = v;
+  ++entry->nvoices;
+}
+
+static void
+voice_unlink (PcktSoundPool *pool, uint32_t v)
+{
+  Voice *voice = pool->voices + v;
+  SourceEntry *entry = source_find (pool, voice->source);
+  if (!entry)
+    return;
+
+  if (voice->prev != NO_VOICE)
+    pool->voices[voice->prev].next = voice->next;
+  else
+    entry->head = voice->next;
+  if (voice->next != NO_VOICE)
+    pool->voices[voice->next].prev = voice->prev;
+
+  voice->prev = voice->next = NO_VOICE;
+  voice->source = NULL;
+  if (--entry->nvoices == 0)
+    source_remove (pool, entry);
+}
+
+static inline float
+heap_key (const PcktSoundPool *pool, size_t pos)
+{
+  return pool->bank.level[pool->heap[pos]];
+}
+
+static inline void
+heap_set (PcktSoundPool *pool, size_t pos, uint32_t v)
+{
+  pool->heap[pos] = v;
+  pool->voices[v].heappos = pos;
+}
+
+static void
+heap_sift_up (PcktSoundPool *pool, size_t pos)
+{
+  uint32_t v = pool->heap[pos];
+  float key = pool->bank.level[v];
+  while (pos > 0)
+    {
+      size_t parent = (pos - 1) / 2;
+      if (heap_key (pool, parent) <= key)
+        break;
+      heap_set (pool, pos, pool->heap[parent]);
+      pos = parent;
+    }
+  heap_set (pool, pos, v);
+}
+
+static void
+heap_sift_down (PcktSoundPool *pool, size_t pos)
+{
+  uint32_t v = pool->heap[pos];
+  float key = pool->bank.level[v];
+  for (;;)
+    {
+      size_t child = (2 * pos) + 1;
+      if (child >= pool->nheap)
+        break;
+      if (child + 1 < pool->nheap
+          && heap_key (pool, child + 1) < heap_key (pool, child))
+        ++child;
+      if (key <= heap_key (pool, child))
+        break;
+      heap_set (pool, pos, pool->heap[child]);
+      pos = child;
+    }
+  heap_set (pool, pos, v);
+}
+
+static void
+heap_push (PcktSoundPool *pool, uint32_t v)
+{
+  heap_set (pool, pool->nheap++, v);
+  heap_sift_up (pool, pool->nheap - 1);
+}
+
+static void
+heap_remove (PcktSoundPool *pool, uint32_t v)
+{
+  size_t pos = pool->voices[v].heappos;
+  uint32_t last = pool->heap[--pool->nheap];
+  if (last == v)
+    return;
+  heap_set (pool, pos, last);
+  heap_sift_up (pool, pos);
+  heap_sift_down (pool, pool->voices[last].heappos);
+}
+
+/* Close the stream of channel CH of voice V, if any, and stop counting
+   the voice as playing the sample of the channel.  */
+static inline void
+voice_close_channel (PcktSoundPool *pool, uint32_t v, PcktChannel ch)
+{
+  if (pool->bank.streams[ch][v])
+    {
+      pckt_stream_close (pool->bank.streams[ch][v]);
+      pool->bank.streams[ch][v] = NULL;
+    }
+  if (pool->bank.held[v] & PCKT_CHANNEL_BIT (ch))
+    {
+      pckt_sample_remove_voice (pool->bank.samples[ch][v]);
+      pool->bank.held[v] &= ~PCKT_CHANNEL_BIT (ch);
+    }
+}
+
+static void
+voice_close_channels (PcktSoundPool *pool, uint32_t v)
+{
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    voice_close_channel (pool, v, ch);
+}
+
+/* Count voice V as playing the samples of its active channels, so that
+   they aren't cooled under it.  */
+static void
+voice_hold_samples (PcktSoundPool *pool, uint32_t v)
+{
+  pool->bank.held[v] = pool->bank.active[v];
+  for (uint16_t mask = pool->bank.held[v]; mask; mask &= mask - 1)
+    {
+      PcktChannel ch = (PcktChannel) __builtin_ctz (mask);
+      pckt_sample_add_voice (pool->bank.samples[ch][v]);
+    }
+}
+
+/* Start streaming the tails of the samples of voice V that don't fit in
+   their heads.  */
+static void
+voice_open_streams (PcktSoundPool *pool, uint32_t v)
+{
+  for (uint16_t mask = pool->bank.active[v]; mask; mask &= mask - 1)
+    {
+      PcktChannel ch = (PcktChannel) __builtin_ctz (mask);
+      const PcktSample *sample = pool->bank.samples[ch][v];
+      if (pckt_sample_get_head (sample) < pckt_sample_get_length (sample))
+        pool->bank.streams[ch][v] = pckt_streamer_open (pool->streamer,
+                                                        sample);
+    }
+}
+
+/* Move voice V to the free list.  */
+static void
+voice_release (PcktSoundPool *pool, uint32_t v)
+{
+  Voice *voice = pool->voices + v;
+  if (voice->state == VOICE_FREE)
+    return;
+  if (voice->state == VOICE_LIVE)
+    heap_remove (pool, v);
+  voice_unlink (pool, v);
+  voice_close_channels (pool, v);
+  voice->state = VOICE_FREE;
+  pool->freelist[pool->nfree++] = v;
+}
+
+/* Restore heap order after the keys of any number of voices have changed.  */
+static void
+heap_rebuild (PcktSoundPool *pool)
+{
+  for (size_t pos = pool->nheap / 2; pos-- > 0;)
+    heap_sift_down (pool, pos);
+}
+
+/* Copy SOUND into the bank slot of voice V.  */
+static void
+bank_load (VoiceBank *bank, uint32_t v, const PcktSound *sound)
+{
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      bank->samples[ch][v] = sound->samples[ch];
+      bank->bleed[ch][v] = sound->bleed[ch];
+      bank->phase[ch][v] = sound->phase[ch];
+      bank->tail[ch][v] = sound->tail[ch];
+    }
+  bank->active[v] = sound->active;
+  bank->impact[v] = sound->impact;
+  bank->pitch[v] = sound->pitch;
+  bank->smoothness[v] = sound->smoothness;
+  bank->stiffness[v] = sound->stiffness;
+  bank->level[v] = sound->variance;
+  bank->choke[v] = sound->choke;
+  bank->interpolation[v] = sound->interpolation;
+}
+
+/* Copy the bank slot of voice V into SOUND.  */
+static void
+bank_store (const VoiceBank *bank, uint32_t v, PcktSound *sound)
+{
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      sound->samples[ch] = bank->samples[ch][v];
+      sound->bleed[ch] = bank->bleed[ch][v];
+      sound->phase[ch] = bank->phase[ch][v];
+      sound->tail[ch] = bank->tail[ch][v];
+    }
+  sound->active = bank->active[v];
+  sound->impact = bank->impact[v];
+  sound->pitch = bank->pitch[v];
+  sound->smoothness = bank->smoothness[v];
+  sound->stiffness = bank->stiffness[v];
+  sound->variance = bank->level[v];
+  sound->choke = bank->choke[v];
+  sound->interpolation = bank->interpolation[v];
+}
+
+/* Allocate room for NVOICES voices in BANK, one block per member.  */
+static bool
+bank_alloc (VoiceBank *bank, size_t nvoices)
+{
+  size_t nslots = PCKT_NCHANNELS * nvoices;
+  PcktSample **samples = malloc (nslots * sizeof (PcktSample *));
+  PcktStream **streams = malloc (nslots * sizeof (PcktStream *));
+  float *bleed = malloc (nslots * sizeof (float));
+  uint64_t *phase = malloc (nslots * sizeof (uint64_t));
+  float *tail = malloc (nslots * sizeof (float));
+
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      bank->samples[ch] = samples ? samples + (ch * nvoices) : NULL;
+      bank->streams[ch] = streams ? streams + (ch * nvoices) : NULL;
+      bank->bleed[ch] = bleed ? bleed + (ch * nvoices) : NULL;
+      bank->phase[ch] = phase ? phase + (ch * nvoices) : NULL;
+      bank->tail[ch] = tail ? tail + (ch * nvoices) : NULL;
+    }
+  bank->active = malloc (nvoices * sizeof (uint16_t));
+  bank->held = calloc (nvoices, sizeof (uint16_t));
+  bank->impact = malloc (nvoices * sizeof (float));
+  bank->pitch = malloc (nvoices * sizeof (float));
+  bank->smoothness = malloc (nvoices * sizeof (float));
+  bank->stiffness = malloc (nvoices * sizeof (float));
+  bank->level = malloc (nvoices * sizeof (float));
+  bank->choke = malloc (nvoices * sizeof (bool));
+  bank->interpolation = malloc (nvoices * sizeof (PcktInterpolation));
+  if (streams)
+    memset (streams, 0, nslots * sizeof (PcktStream *));
+
+  return samples && streams && bleed && phase && tail && bank->active
+    && bank->held && bank->impact && bank->pitch && bank->smoothness
+    && bank->stiffness && bank->level && bank->choke && bank->interpolation;
+}
+
+static void
+bank_free (VoiceBank *bank)
+{
+  free (bank->samples[PCKT_CH0]);
+  free (bank->streams[PCKT_CH0]);
+  free (bank->bleed[PCKT_CH0]);
+  free (bank->phase[PCKT_CH0]);
+  free (bank->tail[PCKT_CH0]);
+  free (bank->active);
+  free (bank->held);
+  free (bank->impact);
+  free (bank->pitch);
+  free (bank->smoothness);
+  free (bank->stiffness);
+  free (bank->level);
+  free (bank->choke);
+  free (bank->interpolation);
+}
+
+static inline bool
+voice_is_dead (const PcktSoundPool *pool, uint32_t v)
+{
+  return pool->bank.active[v] == 0;
+}
+
 PcktSoundPool *
 pckt_soundpool_new (size_t poolsize)
 {
   PcktSoundPool *pool = malloc (sizeof (PcktSoundPool));
-  if (pool)
+  if (!pool)
+    return NULL;
+
+  memset (pool, 0, sizeof (PcktSoundPool));
+  pool->nsounds = poolsize;
+  if (poolsize == 0)
+    return pool;
+
+  /* Keep the source table at most half full.  */
+  size_t nsources = 2;
+  while (nsources < 2 * poolsize)
+    nsources <<= 1;
+  pool->sourcemask = nsources - 1;
+
+  pool->sounds = malloc (poolsize * sizeof (PcktSound));
+  pool->params = malloc (poolsize * sizeof (RenderParams));
+  pool->playing = malloc (poolsize * sizeof (uint32_t));
+  pool->peaks = malloc (poolsize * sizeof (float));
+  pool->voices = malloc (poolsize * sizeof (Voice));
+  pool->freelist = malloc (poolsize * sizeof (uint32_t));
+  pool->heap = malloc (poolsize * sizeof (uint32_t));
+  pool->sources = malloc (nsources * sizeof (SourceEntry));
+  if (!bank_alloc (&pool->bank, poolsize) || !pool->sounds || !pool->params
+      || !pool->playing || !pool->peaks || !pool->voices || !pool->freelist
+      || !pool->heap || !pool->sources)
     {
-      pool->nsounds = poolsize;
-      if (poolsize > 0)
-        {
-          pool->sounds = malloc (poolsize * sizeof (PcktSound));
-          if (pool->sounds)
-            pckt_soundpool_clear (pool);
-          else
-            {
-              free (pool);
-              pool = NULL;
-            }
-        }
+      pckt_soundpool_free (pool);
+      return NULL;
     }
+
+  pckt_soundpool_clear (pool);
   return pool;
 }
 
@@ -51,64 +479,116 @@ pckt_soundpool_free (PcktSoundPool *pool)
 {
   if (pool)
     {
+      for (uint32_t v = 0; (pool->bank.streams[PCKT_CH0] && pool->bank.held
+                            && v < pool->nsounds); ++v)
+        voice_close_channels (pool, v);
+      bank_free (&pool->bank);
       if (pool->sounds)
         free (pool->sounds);
+      if (pool->params)
+        free (pool->params);
+      if (pool->playing)
+        free (pool->playing);
+      if (pool->peaks)
+        free (pool->peaks);
+      if (pool->voices)
+        free (pool->voices);
+      if (pool->freelist)
+        free (pool->freelist);
+      if (pool->heap)
+        free (pool->heap);
+      if (pool->sources)
+        free (pool->sources);
       free (pool);
     }
 }
 
+/* Set the METRIC used to find the quietest sound when stealing.  */
+bool
+pckt_soundpool_set_steal_metric (PcktSoundPool *pool, PcktStealMetric metric)
+{
+  if (!pool || metric < PCKT_STEAL_VARIANCE || metric > PCKT_STEAL_GAIN)
+    return false;
+
+  pool->metric = metric;
+  return true;
+}
+
+PcktStealMetric
+pckt_soundpool_get_steal_metric (const PcktSoundPool *pool)
+{
+  return pool ? pool->metric : PCKT_STEAL_VARIANCE;
+}
+
+/* Stream sample frames past the head of mapped samples through STREAMER
+   for sounds started from now on.  STREAMER must outlive POOL.  */
+bool
+pckt_soundpool_set_streamer (PcktSoundPool *pool, PcktStreamer *streamer)
+{
+  if (!pool)
+    return false;
+
+  pool->streamer = streamer;
+  return true;
+}
+
+/* Get sound at INDEX.  The sound of a voice that has been processed is a
+   copy of the voice state and changes to it are not picked up by POOL.  */
 PcktSound *
 pckt_soundpool_at (PcktSoundPool *pool, uint32_t index)
 {
-  if (pool && index < pool->nsounds)
-    return pool->sounds + index;
-  return NULL;
+  if (!pool || index >= pool->nsounds)
+    return NULL;
+
+  if (pool->voices[index].state == VOICE_LIVE)
+    bank_store (&pool->bank, index, pool->sounds + index);
+  return pool->sounds + index;
 }
 
 PcktSound *
-pckt_soundpool_get (PcktSoundPool *pool, const void *source)
+pckt_soundpool_get (PcktSoundPool *pool, const void *source, size_t limit)
 {
   if (!pool || pool->nsounds == 0)
     return NULL;
 
-  PcktSound *sound = NULL;
-  for (uint32_t i = 0; i < pool->nsounds; ++i)
+  uint32_t v = NO_VOICE;
+  SourceEntry *entry = source ? source_find (pool, source) : NULL;
+  bool capped = entry && (limit > 0) && (entry->nvoices >= limit);
+
+  if (!capped && pool->nfree > 0)
+    v = pool->freelist[--pool->nfree]; /* Steal silent sounds first.  */
+  else
     {
-      bool is_dead = true;
-      for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+      /* Steal the quietest sound, preferably from the given drum.  Pending
+         sounds are not on the heap, this prevents them from being stolen
+         before they have had a chance to start playing.  A source that has
+         reached LIMIT may only steal from itself.  */
+      if (entry)
         {
-          if (pool->sounds[i].bleed[ch] > 0)
+          for (uint32_t i = entry->head; i != NO_VOICE;
+               i = pool->voices[i].next)
             {
-              is_dead = false;
-              break;
+              if (pool->voices[i].state == VOICE_LIVE
+                  && (v == NO_VOICE || (pool->bank.level[i]
+                                        < pool->bank.level[v])))
+                v = i;
             }
         }
-      if (is_dead)
-        {
-          sound = pool->sounds + i;
-          break; /* Steal silent sounds first.  */
-        }
-      else if (pool->sounds[i].variance < 0)
-        /* Variance is set to -1 when the sound is cleared. This prevents it
-           from being stolen before it has had a chance to start playing.  */
-        continue;
-      else if (!sound || (sound->source != source
-                          && pool->sounds[i].source == source))
-        {
-          /* Sound is first in loop or has source priority over previous
-             candidate (steal sound from given drum if exists). */
-          sound = pool->sounds + i;
-        }
-      else if ((sound->source != source || pool->sounds[i].source == source)
-               && pool->sounds[i].variance < sound->variance)
-        {
-          /* Sound has equal or greater source priorty and lower variance
-             (steal the quietest sound, preferably from the given drum).  */
-          sound = pool->sounds + i;
-        }
+      if (v == NO_VOICE && !capped && pool->nheap > 0)
+        v = pool->heap[0];
+      if (v == NO_VOICE)
+        return NULL;
+
+      heap_remove (pool, v);
+      voice_unlink (pool, v);
+      voice_close_channels (pool, v);
     }
 
-  return sound;
+  pool->voices[v].state = VOICE_PENDING;
+  if (source)
+    voice_link (pool, v, source);
+
+  return pool->sounds + v;
 }
 
 bool
@@ -116,11 +596,35 @@ pckt_soundpool_choke (PcktSoundPool *pool, const void *source)
 {
   if (!pool || !source || pool->nsounds == 0)
     return false;
-  for (uint32_t i = 0; i < pool->nsounds; ++i)
+
+  SourceEntry *entry = source_find (pool, source);
+  if (!entry)
+    return true;
+
+  for (uint32_t v = entry->head; v != NO_VOICE; v = pool->voices[v].next)
     {
-      if (pool->sounds[i].source == source)
-        pool->sounds[i].choke = true;
+      if (pool->voices[v].state == VOICE_PENDING)
+        pool->sounds[v].choke = true;
+      else
+        pool->bank.choke[v] = true;
     }
+
+  return true;
+}
+
+/* Silence all sounds of SOURCE at once rather than fading them out like
+   `pckt_soundpool_choke'.  The samples they were playing may be freed once
+   the streamer of POOL is synced.  */
+bool
+pckt_soundpool_stop (PcktSoundPool *pool, const void *source)
+{
+  if (!pool || !source || pool->nsounds == 0)
+    return false;
+
+  SourceEntry *entry;
+  while ((entry = source_find (pool, source)) && entry->head != NO_VOICE)
+    voice_release (pool, entry->head);
+
   return true;
 }
 
@@ -130,8 +634,316 @@ pckt_soundpool_clear (PcktSoundPool *pool)
   if (!pool)
     return false;
 
-  for (uint32_t i = 0; i < pool->nsounds; ++i)
-    pckt_sound_clear (pool->sounds + i);
+  pool->nfree = 0;
+  pool->nheap = 0;
+  for (uint32_t i = pool->nsounds; i-- > 0;)
+    {
+      voice_close_channels (pool, i);
+      pckt_sound_clear (pool->sounds + i);
+      bank_load (&pool->bank, i, pool->sounds + i);
+      pool->voices[i].state = VOICE_FREE;
+      pool->voices[i].source = NULL;
+      pool->voices[i].prev = pool->voices[i].next = NO_VOICE;
+      pool->freelist[pool->nfree++] = i;
+    }
+  for (size_t i = 0; pool->nsounds > 0 && i <= pool->sourcemask; ++i)
+    pool->sources[i].source = NULL;
+
+  return true;
+}
+
+/* Move playing sounds from SRC to DEST, dropping the quietest ones if DEST
+   doesn't have room for all of them.  Returns the number of sounds moved.  */
+size_t
+pckt_soundpool_transfer (PcktSoundPool *dest, PcktSoundPool *src)
+{
+  if (!dest || !src)
+    return 0;
+
+  size_t nmoved = 0, nplaying = src->nsounds - src->nfree;
+  while (nplaying > dest->nfree && src->nheap > 0)
+    {
+      voice_release (src, src->heap[0]);
+      --nplaying;
+    }
+
+  for (uint32_t v = 0; v < src->nsounds && dest->nfree > 0; ++v)
+    {
+      Voice *voice = src->voices + v;
+      if (voice->state == VOICE_FREE)
+        continue;
+
+      PcktSound *sound = pckt_soundpool_get (dest, voice->source, 0);
+      uint32_t w = sound - dest->sounds;
+      if (voice->state == VOICE_LIVE)
+        {
+          bank_store (&src->bank, v, sound);
+          bank_load (&dest->bank, w, sound);
+          for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+            {
+              dest->bank.streams[ch][w] = src->bank.streams[ch][v];
+              src->bank.streams[ch][v] = NULL;
+            }
+          dest->bank.held[w] = src->bank.held[v];
+          src->bank.held[v] = 0;
+          dest->voices[w].state = VOICE_LIVE;
+          heap_push (dest, w);
+        }
+      else
+        *sound = src->sounds[v];
+      voice_release (src, v);
+      ++nmoved;
+    }
+
+  return nmoved;
+}
+
+#define CHOKE_DECAY_RATE(amp, rate) \
+  ((amp) / (PCKT_CHOKE_TIME * (rate)))
+
+#define STIFFNESS_DECAY_RATE(rate) \
+  (1.f - powf (0.5f, 1.f / ((float) (rate) * PCKT_STIFF_HL)))
+
+/* Calculate PARAMS of a sound with the given properties for playback at
+   RATE frames per second.  */
+static void
+render_params_init (RenderParams *params, float impact, float pitch,
+                    float smoothness, float stiffness, bool choke,
+                    PcktInterpolation interpolation, uint32_t rate)
+{
+  params->rate = rate;
+  params->pitch = 1.f;
+  params->interpolation = interpolation;
+  params->decay = 0;
+  params->expdecay = 0;
+  params->smoothen = (smoothness > 0) && (smoothness <= 1);
+
+  /* Read faster or slower if sound is pitched.  */
+  if ((pitch > 0) && (pitch != 1))
+    params->pitch = pitch;
+
+  /* Calculate linear decay rate if sound is choked.  */
+  if (choke && (impact > 0))
+    params->decay = CHOKE_DECAY_RATE (impact, rate);
+
+  /* Calculate exponential decay rate if sound is stiffened.  */
+  if ((stiffness > 0) && (stiffness <= 1))
+    params->expdecay = 1.f - (STIFFNESS_DECAY_RATE (rate) * stiffness);
+
+  if (params->smoothen)
+    pckt_dsp_smoother_init (&params->smoother, smoothness);
+}
+
+/* Render NFRAMES frames of SAMPLE from PHASE into OUT, using BUFFER as
+   scratch space.  Frames are read through STREAM unless it is NULL.
+   BLEED, PHASE and TAIL are updated and the moments of the rendered frames
+   are added to SUM and SUM2 unless they are NULL.  Returns the number of
+   frames read from SAMPLE.  */
+static size_t
+render_channel (const RenderParams *params, const PcktSample *sample,
+                PcktStream *stream, float *bleed, uint64_t *phase,
+                float *tail, float *out, float *buffer, size_t nframes,
+                float *sum, float *sum2)
+{
+  PcktDspEnvelope envelope;
+  size_t nread;
+  float k;
+
+  /* Read NFRAMES frames from sample into BUFFER.  */
+  PcktInterpolation interpolation = params->interpolation;
+  if (interpolation == PCKT_INTRPL_NONE)
+    interpolation = pckt_sample_get_interpolation (sample);
+  uint64_t step = pckt_sample_step (sample, params->rate, params->pitch);
+  if (stream)
+    nread = pckt_stream_read (stream, buffer, nframes, phase, step,
+                              interpolation);
+  else
+    nread = pckt_sample_read_phase (sample, buffer, nframes, phase, step,
+                                    interpolation);
+  k = (nread > 0) ? buffer[0] * *bleed : 0;
+
+  /* Apply gain envelope.  */
+  if (params->decay > 0)
+    pckt_dsp_envelope_linear (&envelope, *bleed, params->decay);
+  else if (params->expdecay > 0)
+    pckt_dsp_envelope_exp (&envelope, *bleed, params->expdecay);
+  else
+    pckt_dsp_envelope_constant (&envelope, *bleed);
+  *bleed = pckt_dsp_envelope_apply (&envelope, buffer, nread);
+
+  if (params->smoothen)
+    *tail = pckt_dsp_smooth (&params->smoother, buffer, nread, *tail);
+  else if (nread > 0)
+    *tail = buffer[nread - 1];
+
+  /* Write buffered frames to output.  */
+  pckt_dsp_mix (out, buffer, nread);
+  if (sum && sum2)
+    pckt_dsp_moments (buffer, nread, k, sum, sum2);
+
+  if (nread < nframes)
+    {
+      /* Mute channel if we're out of frames.  */
+      *bleed = 0;
+      /* Sum remainder for variance.  */
+      if (sum && sum2)
+        {
+          *sum -= k * (nframes - nread);
+          *sum2 += k * k * (nframes - nread);
+        }
+    }
+
+  return nread;
+}
+
+/* Process every playing sound in POOL and update the stealing order.
+   Voices are rendered one channel at a time so that the state touched by
+   the inner loop is contiguous in the voice bank.  */
+bool
+pckt_soundpool_process (PcktSoundPool *pool, float **out, size_t nframes,
+                        uint32_t rate)
+{
+  if (!pool || !out)
+    return false;
+  else if (!nframes)
+    return true;
+
+  VoiceBank *bank = &pool->bank;
+  size_t nplaying = 0;
+  for (uint32_t v = 0; v < pool->nsounds; ++v)
+    {
+      if (pool->voices[v].state == VOICE_FREE)
+        continue;
+      else if (pool->voices[v].state == VOICE_PENDING)
+        {
+          bank_load (bank, v, pool->sounds + v);
+          voice_hold_samples (pool, v);
+          if (pool->streamer)
+            voice_open_streams (pool, v);
+        }
+
+      if (rate)
+        render_params_init (pool->params + v, bank->impact[v],
+                            bank->pitch[v], bank->smoothness[v],
+                            bank->stiffness[v], bank->choke[v],
+                            bank->interpolation[v], rate);
+      /* The peak follower of a new sound starts from silence.  */
+      if (pool->metric != PCKT_STEAL_PEAK
+          || pool->voices[v].state == VOICE_PENDING)
+        bank->level[v] = 0;
+      pool->peaks[nplaying] = 0;
+      pool->playing[nplaying++] = v;
+    }
+
+  float buffer[nframes];
+  RenderParams native;
+  for (PcktChannel ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+    {
+      if (!out[ch])
+        continue;
+
+      uint16_t bit = PCKT_CHANNEL_BIT (ch);
+      for (size_t i = 0; i < nplaying; ++i)
+        {
+          uint32_t v = pool->playing[i];
+          if (!(bank->active[v] & bit))
+            continue;
+
+          const RenderParams *params = pool->params + v;
+          if (!rate)
+            {
+              /* Use the samples native rate if no specific rate was
+                 requested.  */
+              uint32_t samplerate;
+              samplerate = pckt_sample_rate (bank->samples[ch][v], 0);
+              if (!samplerate)
+                continue;
+              render_params_init (&native, bank->impact[v], bank->pitch[v],
+                                  bank->smoothness[v], bank->stiffness[v],
+                                  bank->choke[v], bank->interpolation[v],
+                                  samplerate);
+              params = &native;
+            }
+
+          if (pool->metric == PCKT_STEAL_VARIANCE)
+            {
+              float sum = 0, sum2 = 0;
+              render_channel (params, bank->samples[ch][v],
+                              bank->streams[ch][v], bank->bleed[ch] + v,
+                              bank->phase[ch] + v, bank->tail[ch] + v,
+                              out[ch], buffer, nframes, &sum, &sum2);
+              bank->level[v] += (sum2 - (sum * sum) / nframes) / nframes;
+            }
+          else
+            {
+              size_t nread;
+              nread = render_channel (params, bank->samples[ch][v],
+                                      bank->streams[ch][v],
+                                      bank->bleed[ch] + v,
+                                      bank->phase[ch] + v,
+                                      bank->tail[ch] + v, out[ch], buffer,
+                                      nframes, NULL, NULL);
+              if (pool->metric == PCKT_STEAL_PEAK)
+                {
+                  float peak = pckt_dsp_peak (buffer, nread);
+                  if (peak * peak > pool->peaks[i])
+                    pool->peaks[i] = peak * peak;
+                }
+            }
+          if (bank->bleed[ch][v] <= 0)
+            {
+              bank->active[v] &= ~bit;
+              voice_close_channel (pool, v, ch);
+            }
+        }
+    }
+
+  /* Calculate levels and update voice states.  Keys of all live voices have
+     changed, so the heap is rebuilt rather than sifted.  */
+  float release = (pool->metric == PCKT_STEAL_PEAK)
+    ? expf (-(float) nframes / ((rate ? rate : PCKT_SAMPLE_RATE_DEFAULT)
+                                * PCKT_PEAK_RELEASE))
+    : 0;
+  for (size_t i = 0; i < nplaying; ++i)
+    {
+      uint32_t v = pool->playing[i];
+      Voice *voice = pool->voices + v;
+
+      switch (pool->metric)
+        {
+        case PCKT_STEAL_PEAK:
+          /* Follow the squared peak, falling back at the release rate.  */
+          bank->level[v] = fmaxf (pool->peaks[i], bank->level[v] * release);
+          break;
+        case PCKT_STEAL_GAIN:
+          /* Envelope gain times the precomputed sample level, known without
+             looking at the output.  */
+          bank->level[v] = 0;
+          for (uint16_t mask = bank->active[v]; mask; mask &= mask - 1)
+            {
+              PcktChannel ch = (PcktChannel) __builtin_ctz (mask);
+              float gain = bank->bleed[ch][v]
+                * pckt_sample_rms (bank->samples[ch][v],
+                                   bank->phase[ch][v] >> PCKT_PHASE_BITS,
+                                   0);
+              bank->level[v] += gain * gain;
+            }
+          bank->level[v] /= PCKT_NCHANNELS;
+          break;
+        default:
+          bank->level[v] /= PCKT_NCHANNELS;
+          break;
+        }
+
+      if (voice_is_dead (pool, v))
+        voice_release (pool, v);
+      else if (voice->state == VOICE_PENDING)
+        {
+          voice->state = VOICE_LIVE;
+          heap_set (pool, pool->nheap++, v);
+        }
+    }
+  heap_rebuild (pool);
 
   return true;
 }
@@ -146,26 +958,22 @@ pckt_sound_clear (PcktSound *sound)
     {
       sound->samples[ch] = NULL;
       sound->bleed[ch] = 0;
-      sound->progress[ch] = 0;
+      sound->phase[ch] = 0;
       sound->tail[ch] = 0;
     }
+  sound->active = 0;
   sound->impact = 0;
   sound->pitch = 0;
   sound->smoothness = 0;
   sound->stiffness = 0;
   sound->variance = -1;
   sound->choke = false;
+  sound->interpolation = PCKT_INTRPL_NONE;
   sound->source = NULL;
 
   return true;
 }
 
-#define CHOKE_DECAY_RATE(amp, rate) \
-  ((amp) / (PCKT_CHOKE_TIME * (rate)))
-
-#define STIFFNESS_DECAY_RATE(rate) \
-  (1.f - powf (0.5f, 1.f / ((float) (rate) * PCKT_STIFF_HL)))
-
 int32_t
 pckt_sound_process (PcktSound *sound, float **out, size_t nframes,
                     uint32_t rate)
@@ -173,38 +981,29 @@ pckt_sound_process (PcktSound *sound, float **out, size_t nframes,
   if (!sound || !out || !nframes)
     return 0;
 
-  float frame, buffer[nframes], decay = 0, expdecay = 0;
-  float k, sum[PCKT_NCHANNELS], sum2[PCKT_NCHANNELS]; /* For variance.  */
+  float buffer[nframes];
+  float sum[PCKT_NCHANNELS], sum2[PCKT_NCHANNELS]; /* For variance.  */
   size_t nread, nreadmax = 0;
-  uint32_t framerate = rate, samplerate;
-  bool choke = sound->choke && (sound->impact > 0);
-  bool shift = (sound->pitch > 0) && (sound->pitch != 1);
-  bool smoothen = (sound->smoothness > 0) && (sound->smoothness <= 1);
-  bool stiffen = (sound->stiffness > 0) && (sound->stiffness <= 1);
+  uint32_t samplerate;
 
+  /* Rendering parameters are shared by all channels.  */
+  RenderParams params;
   if (rate)
-    {
-      /* Calculate new frame rate if sound is pitched.  */
-      if (shift)
-        framerate = rate / sound->pitch;
-
-      /* Calculate linear decay rate if sound is choked.  */
-      if (choke)
-        decay = CHOKE_DECAY_RATE (sound->impact, rate);
-
-      /* Calculate exponential decay rate if sound is stiffened.  */
-      if (stiffen)
-        expdecay = 1.f - (STIFFNESS_DECAY_RATE (rate) * sound->stiffness);
-    }
+    render_params_init (&params, sound->impact, sound->pitch,
+                        sound->smoothness, sound->stiffness, sound->choke,
+                        sound->interpolation, rate);
 
+  /* Only channels in the active mask are visited, silent channels don't
+     contribute to output or variance.  */
+  uint16_t active = sound->active, mask;
   PcktChannel ch;
-  uint32_t i;
-  for (ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
+  for (mask = active; mask; mask &= mask - 1)
     {
+      ch = (PcktChannel) __builtin_ctz (mask);
       sum[ch] = 0;
       sum2[ch] = 0;
 
-      if (!sound->samples[ch] || !out[ch] || sound->bleed[ch] <= 0)
+      if (!out[ch])
         continue;
 
       if (!rate)
@@ -214,59 +1013,30 @@ pckt_sound_process (PcktSound *sound, float **out, size_t nframes,
           samplerate = pckt_sample_rate (sound->samples[ch], 0);
           if (!samplerate)
             continue;
-
-          if (shift)
-            framerate = samplerate / sound->pitch;
-          if (choke)
-            decay = CHOKE_DECAY_RATE (sound->impact, samplerate);
-          if (stiffen)
-            expdecay = 1.f - (STIFFNESS_DECAY_RATE (samplerate)
-                              * sound->stiffness);
+          render_params_init (&params, sound->impact, sound->pitch,
+                              sound->smoothness, sound->stiffness,
+                              sound->choke, sound->interpolation,
+                              samplerate);
         }
 
-      /* Read NFRAMES frames from sample into BUFFER.  */
-      nread = pckt_sample_read (sound->samples[ch], buffer, nframes,
-                                sound->progress[ch], framerate);
-      sound->progress[ch] += nread;
-
-      /* Write buffered frames to output.  */
-      k = buffer[0] * sound->bleed[ch];
-      for (i = 0; i < nread; ++i)
-        {
-          if (decay >= sound->bleed[ch])
-            sound->bleed[ch] = 0;
-          else if (decay > 0)
-            sound->bleed[ch] -= decay;
-          else if (expdecay > 0)
-            sound->bleed[ch] *= expdecay;
-
-          frame = buffer[i] * sound->bleed[ch];
-          if (smoothen)
-            {
-              frame *= 1.f - sound->smoothness;
-              frame += sound->tail[ch] * sound->smoothness;
-            }
-          sound->tail[ch] = frame;
-          out[ch][i] += frame;
-          sum[ch] += frame - k;
-          sum2[ch] += (frame - k) * (frame - k);
-        }
-      if (nread < nframes)
-        {
-          /* Mute channel if we're out of frames.  */
-          sound->bleed[ch] = 0;
-          /* Sum remainder for variance.  */
-          sum[ch] -= k * (nframes - nread);
-          sum2[ch] += k * k * (nframes - nread);
-        }
+      nread = render_channel (&params, sound->samples[ch], NULL,
+                              sound->bleed + ch, sound->phase + ch,
+                              sound->tail + ch, out[ch], buffer, nframes,
+                              sum + ch, sum2 + ch);
+      if (sound->bleed[ch] <= 0)
+        sound->active &= ~PCKT_CHANNEL_BIT (ch);
       if (nread > nreadmax)
         nreadmax = nread;
     }
 
   /* Calculate average variance.  */
   sound->variance = 0;
-  for (ch = PCKT_CH0; ch < PCKT_NCHANNELS; ++ch)
-    sound->variance += (sum2[ch] - (sum[ch] * sum[ch]) / nframes) / nframes;
+  for (mask = active; mask; mask &= mask - 1)
+    {
+      ch = (PcktChannel) __builtin_ctz (mask);
+      sound->variance += (sum2[ch] - (sum[ch] * sum[ch]) / nframes)
+                         / nframes;
+    }
   sound->variance /= PCKT_NCHANNELS;
 
   return (int32_t) nreadmax;
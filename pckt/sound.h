@@ -20,9 +20,11 @@
 
 #include "pckt.h"
 #include "sample.h"
+#include "stream.h"
 
 #define PCKT_CHOKE_TIME .5f
 #define PCKT_STIFF_HL .02f
+#define PCKT_PEAK_RELEASE .05f
 
 __BEGIN_DECLS
 
@@ -35,29 +37,52 @@ typedef enum
   PCKT_NCHANNELS
 } PcktChannel;
 
+/* Bit of channel CH in the active channel mask of a sound.  */
+#define PCKT_CHANNEL_BIT(ch) ((uint16_t) (1u << (ch)))
+
 typedef struct
 {
   PcktSample *samples[PCKT_NCHANNELS];
   float bleed[PCKT_NCHANNELS];
-  size_t progress[PCKT_NCHANNELS];
+  uint64_t phase[PCKT_NCHANNELS]; /* 32.32 fixed point sample frames.  */
   float tail[PCKT_NCHANNELS];
+  uint16_t active; /* Channels with a sample and positive bleed.  */
   float impact;
   float pitch;
   float smoothness;
   float stiffness;
   float variance;
   bool choke;
+  PcktInterpolation interpolation; /* Overrides the samples unless NONE.  */
   const void *source;
 } PcktSound;
 
+/* Loudness measure used to pick the quietest sound to steal.  VARIANCE is
+   the variance of the output, PEAK follows the output peak and GAIN is the
+   envelope gain times the RMS level of the sample, which costs nothing per
+   frame.  */
+typedef enum {
+  PCKT_STEAL_VARIANCE = 0,
+  PCKT_STEAL_PEAK,
+  PCKT_STEAL_GAIN
+} PcktStealMetric;
+
 typedef struct PcktSoundPoolImpl PcktSoundPool;
 
 extern PcktSoundPool *pckt_soundpool_new (size_t);
 extern void pckt_soundpool_free (PcktSoundPool *);
+extern bool pckt_soundpool_set_steal_metric (PcktSoundPool *,
+                                             PcktStealMetric);
+extern PcktStealMetric pckt_soundpool_get_steal_metric (const PcktSoundPool *);
+extern bool pckt_soundpool_set_streamer (PcktSoundPool *, PcktStreamer *);
 extern PcktSound *pckt_soundpool_at (PcktSoundPool *, uint32_t);
-extern PcktSound *pckt_soundpool_get (PcktSoundPool *, const void *);
+extern PcktSound *pckt_soundpool_get (PcktSoundPool *, const void *, size_t);
 extern bool pckt_soundpool_choke (PcktSoundPool *, const void *);
+extern bool pckt_soundpool_stop (PcktSoundPool *, const void *);
 extern bool pckt_soundpool_clear (PcktSoundPool *);
+extern size_t pckt_soundpool_transfer (PcktSoundPool *, PcktSoundPool *);
+extern bool pckt_soundpool_process (PcktSoundPool *, float **, size_t,
+                                    uint32_t);
 extern bool pckt_sound_clear (PcktSound *);
 extern int32_t pckt_sound_process (PcktSound *, float **, size_t, uint32_t);
 
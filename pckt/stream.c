@@ -0,0 +1,366 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stream.h"
+
+#define RING_FRAMES 16384 /* Must be a power of two.  */
+#define WINDOW_FRAMES 4096
+#define FILL_FRAMES 4096  /* Most frames fetched for one stream at a time.  */
+#define IDLE_NSEC 1000000
+
+typedef enum {
+  STREAM_FREE = 0, /* Can be opened by the audio thread.  */
+  STREAM_ACTIVE,   /* Filled by the I/O thread.  */
+  STREAM_CLOSING   /* Closed but possibly still touched by the I/O thread.  */
+} StreamState;
+
+/* Single producer, single consumer ring of frames following the head of a
+   sample.  The I/O thread owns POSITION and NWRITTEN while the stream is
+   active, the audio thread owns everything else.  */
+struct PcktStreamImpl
+{
+  uint32_t state;
+  const PcktSample *sample;
+  size_t start;     /* Frame of SAMPLE at the start of the ring.  */
+  size_t position;  /* Next frame of SAMPLE to fetch.  */
+  size_t nwritten;  /* Frames written to RING.  */
+  size_t nread;     /* Frames read from RING.  */
+  size_t first;     /* Frame of SAMPLE at the start of WINDOW.  */
+  size_t nwindow;
+  PcktStreamer *streamer;
+  float ring[RING_FRAMES];
+  float window[WINDOW_FRAMES]; /* Contiguous frames around the cursor.  */
+};
+
+struct PcktStreamerImpl
+{
+  PcktStream *streams;
+  size_t nstreams;
+  size_t cursor;    /* Where to look for a free stream next.  */
+  size_t underruns;
+  bool running;
+  pthread_t thread;
+};
+
+/* Fetch the next frames of STREAM in the I/O thread.  Returns true if there
+   was anything to fetch.  */
+static bool
+stream_fill (PcktStream *stream)
+{
+  uint32_t state = __atomic_load_n (&stream->state, __ATOMIC_ACQUIRE);
+  if (state == STREAM_CLOSING)
+    {
+      __atomic_store_n (&stream->state, STREAM_FREE, __ATOMIC_RELEASE);
+      return false;
+    }
+  else if (state != STREAM_ACTIVE)
+    return false;
+
+  size_t nread = __atomic_load_n (&stream->nread, __ATOMIC_ACQUIRE);
+  size_t space = RING_FRAMES - (stream->nwritten - nread);
+  size_t n = pckt_sample_get_length (stream->sample) - stream->position;
+  if (n > space)
+    n = space;
+  if (n > FILL_FRAMES)
+    n = FILL_FRAMES;
+  if (n == 0)
+    return false;
+
+  /* Split the read where the ring wraps around.  */
+  size_t offset = stream->nwritten & (RING_FRAMES - 1);
+  size_t n1 = (offset + n > RING_FRAMES) ? RING_FRAMES - offset : n;
+  pckt_sample_read (stream->sample, stream->ring + offset, n1,
+                    stream->position, 0);
+  if (n > n1)
+    pckt_sample_read (stream->sample, stream->ring, n - n1,
+                      stream->position + n1, 0);
+
+  stream->position += n;
+  __atomic_store_n (&stream->nwritten, stream->nwritten + n,
+                    __ATOMIC_RELEASE);
+  return true;
+}
+
+static void *
+streamer_run (void *data)
+{
+  PcktStreamer *streamer = (PcktStreamer *) data;
+  const struct timespec idle = {0, IDLE_NSEC};
+
+  while (__atomic_load_n (&streamer->running, __ATOMIC_ACQUIRE))
+    {
+      bool busy = false;
+      for (size_t i = 0; i < streamer->nstreams; ++i)
+        busy = stream_fill (streamer->streams + i) || busy;
+      if (!busy)
+        nanosleep (&idle, NULL);
+    }
+
+  return NULL;
+}
+
+/* Create NSTREAMS streams and start the I/O thread filling them.  */
+PcktStreamer *
+pckt_streamer_new (size_t nstreams)
+{
+  if (nstreams == 0)
+    return NULL;
+
+  PcktStreamer *streamer = malloc (sizeof (PcktStreamer));
+  if (!streamer)
+    return NULL;
+
+  memset (streamer, 0, sizeof (PcktStreamer));
+  streamer->streams = malloc (nstreams * sizeof (PcktStream));
+  if (!streamer->streams)
+    {
+      free (streamer);
+      return NULL;
+    }
+
+  /* Touch every page up front rather than in the audio thread.  */
+  memset (streamer->streams, 0, nstreams * sizeof (PcktStream));
+  for (size_t i = 0; i < nstreams; ++i)
+    streamer->streams[i].streamer = streamer;
+  streamer->nstreams = nstreams;
+  streamer->running = true;
+
+  if (pthread_create (&streamer->thread, NULL, streamer_run, streamer) != 0)
+    {
+      free (streamer->streams);
+      free (streamer);
+      return NULL;
+    }
+
+  return streamer;
+}
+
+void
+pckt_streamer_free (PcktStreamer *streamer)
+{
+  if (!streamer)
+    return;
+
+  __atomic_store_n (&streamer->running, false, __ATOMIC_RELEASE);
+  pthread_join (streamer->thread, NULL);
+  free (streamer->streams);
+  free (streamer);
+}
+
+/* Claim a stream for reading SAMPLE past its head, or get NULL if all
+   streams are busy.  Called from the audio thread.  */
+PcktStream *
+pckt_streamer_open (PcktStreamer *streamer, const PcktSample *sample)
+{
+  if (!streamer || !sample)
+    return NULL;
+
+  for (size_t i = 0; i < streamer->nstreams; ++i)
+    {
+      PcktStream *stream = streamer->streams + streamer->cursor;
+      streamer->cursor = (streamer->cursor + 1) % streamer->nstreams;
+      if (__atomic_load_n (&stream->state, __ATOMIC_ACQUIRE) != STREAM_FREE)
+        continue;
+
+      stream->sample = sample;
+      stream->start = pckt_sample_get_head (sample);
+      stream->position = stream->start;
+      stream->nwritten = 0;
+      stream->nread = 0;
+      stream->first = 0;
+      stream->nwindow = 0;
+      __atomic_store_n (&stream->state, STREAM_ACTIVE, __ATOMIC_RELEASE);
+      return stream;
+    }
+
+  return NULL;
+}
+
+/* Wait until the I/O thread has let go of every closed stream, after which
+   the samples they were reading may be freed.  */
+void
+pckt_streamer_sync (PcktStreamer *streamer)
+{
+  if (!streamer)
+    return;
+
+  const struct timespec idle = {0, IDLE_NSEC};
+  for (size_t i = 0; i < streamer->nstreams; ++i)
+    {
+      while (__atomic_load_n (&streamer->streams[i].state, __ATOMIC_ACQUIRE)
+             == STREAM_CLOSING)
+        nanosleep (&idle, NULL);
+    }
+}
+
+/* Get the number of reads that ran ahead of the I/O thread.  */
+size_t
+pckt_streamer_get_underruns (const PcktStreamer *streamer)
+{
+  return streamer ? streamer->underruns : 0;
+}
+
+/* Return STREAM to its streamer.  Called from the audio thread.  */
+void
+pckt_stream_close (PcktStream *stream)
+{
+  if (stream)
+    __atomic_store_n (&stream->state, STREAM_CLOSING, __ATOMIC_RELEASE);
+}
+
+/* Fill the window of STREAM with frames FIRST to LAST of its sample, where
+   frames before the ring are read from the head of the sample.  Returns
+   false if the I/O thread has fallen behind.  */
+static bool
+stream_fetch (PcktStream *stream, size_t first, size_t last)
+{
+  if (first > stream->first)
+    {
+      size_t drop = first - stream->first;
+      if (drop < stream->nwindow)
+        {
+          stream->nwindow -= drop;
+          memmove (stream->window, stream->window + drop,
+                   stream->nwindow * sizeof (float));
+        }
+      else
+        stream->nwindow = 0;
+      stream->first = first;
+    }
+
+  size_t nread = stream->nread;
+  bool complete = true;
+  while (stream->first + stream->nwindow < last)
+    {
+      size_t frame = stream->first + stream->nwindow;
+      float *dest = stream->window + stream->nwindow;
+      size_t n = last - frame;
+
+      if (frame < stream->start)
+        {
+          if (n > stream->start - frame)
+            n = stream->start - frame;
+          n = pckt_sample_read (stream->sample, dest, n, frame, 0);
+        }
+      else
+        {
+          /* Skip frames that were never needed, e.g. after an underrun.  */
+          size_t nwritten = __atomic_load_n (&stream->nwritten,
+                                             __ATOMIC_ACQUIRE);
+          size_t k = frame - stream->start;
+          if (nread < k)
+            nread = (nwritten < k) ? nwritten : k;
+
+          size_t avail = nwritten - nread;
+          if (nread < k || avail == 0)
+            {
+              complete = false;
+              break;
+            }
+          if (n > avail)
+            n = avail;
+
+          size_t offset = nread & (RING_FRAMES - 1);
+          size_t n1 = (offset + n > RING_FRAMES) ? RING_FRAMES - offset : n;
+          memcpy (dest, stream->ring + offset, n1 * sizeof (float));
+          memcpy (dest + n1, stream->ring, (n - n1) * sizeof (float));
+          nread += n;
+        }
+
+      if (n == 0)
+        {
+          complete = false;
+          break;
+        }
+      stream->nwindow += n;
+    }
+
+  __atomic_store_n (&stream->nread, nread, __ATOMIC_RELEASE);
+  return complete;
+}
+
+/* Read like `pckt_sample_read_phase' from the sample of STREAM, with frames
+   past the head of the sample fetched by the I/O thread.  Frames that
+   haven't arrived in time are read as silence and counted as an underrun.
+   Called from the audio thread.  */
+size_t
+pckt_stream_read (PcktStream *stream, float *frames, size_t nframes,
+                  uint64_t *phase, uint64_t step, PcktInterpolation intrpl)
+{
+  if (!stream || !frames || !phase || !step)
+    return 0;
+
+  const PcktSample *sample = stream->sample;
+  size_t length = pckt_sample_get_length (sample);
+  size_t reach = pckt_sample_get_reach (step, intrpl);
+  size_t done = 0;
+
+  while (done < nframes && (*phase >> PCKT_PHASE_BITS) < length)
+    {
+      /* Read as many frames at once as the window can cover.  */
+      size_t n = nframes - done;
+      size_t span = WINDOW_FRAMES - (2 * reach) - 2;
+      uint64_t max = ((uint64_t) span << PCKT_PHASE_BITS) / step;
+      if (n > span)
+        n = span;
+      if (n > max)
+        n = max ? max : 1;
+
+      size_t pos = *phase >> PCKT_PHASE_BITS;
+      size_t end = (*phase + ((n - 1) * step)) >> PCKT_PHASE_BITS;
+      if (end < pos + n - 1)
+        end = pos + n - 1; /* Frames are copied without interpolation.  */
+      size_t first = (pos > reach) ? pos - reach : 0;
+      size_t last = end + reach + 1;
+      if (last > length)
+        last = length;
+
+      size_t nread;
+      bool complete = true;
+      if (last <= stream->start)
+        nread = pckt_sample_read_phase (sample, frames + done, n, phase,
+                                        step, intrpl);
+      else
+        {
+          complete = stream_fetch (stream, first, last);
+          nread = pckt_sample_read_window (sample, stream->window,
+                                           stream->first, stream->nwindow,
+                                           frames + done, n, phase, step,
+                                           intrpl);
+        }
+
+      done += nread;
+      if (nread < n)
+        {
+          if (!complete)
+            {
+              /* Keep time with silence and let the ring catch up.  */
+              ++stream->streamer->underruns;
+              memset (frames + done, 0, (nframes - done) * sizeof (float));
+              *phase += (nframes - done) * step;
+              done = nframes;
+            }
+          break;
+        }
+    }
+
+  return done;
+}
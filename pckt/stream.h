@@ -0,0 +1,40 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCKT_STREAM_H
+#define PCKT_STREAM_H 1
+
+#include "pckt.h"
+#include "sample.h"
+
+__BEGIN_DECLS
+
+typedef struct PcktStreamerImpl PcktStreamer;
+typedef struct PcktStreamImpl PcktStream;
+
+extern PcktStreamer *pckt_streamer_new (size_t);
+extern void pckt_streamer_free (PcktStreamer *);
+extern PcktStream *pckt_streamer_open (PcktStreamer *, const PcktSample *);
+extern void pckt_streamer_sync (PcktStreamer *);
+extern size_t pckt_streamer_get_underruns (const PcktStreamer *);
+extern void pckt_stream_close (PcktStream *);
+extern size_t pckt_stream_read (PcktStream *, float *, size_t, uint64_t *,
+                                uint64_t, PcktInterpolation);
+
+__END_DECLS
+
+#endif /* ! PCKT_STREAM_H */
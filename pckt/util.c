@@ -19,8 +19,13 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <sys/stat.h>
 #include "util.h"
 
+/* Caches of decoded samples and kits are kept in the directory named by
+   this environment variable.  */
+#define CACHE_DIR_ENV "PCKT_SAMPLE_CACHE"
+
 char *
 pckt_vstrdupf (const char *format, va_list ap)
 {
@@ -52,6 +57,44 @@ pckt_strdupf (const char *format, ...)
   return str;
 }
 
+/* Get the path of the cache file for KEY, named by a hash of KEY followed
+   by SUFFIX, or NULL if caching is off.  */
+char *
+pckt_cache_path (const char *key, const char *suffix)
+{
+  return pckt_cache_path_in (getenv (CACHE_DIR_ENV), key, suffix);
+}
+
+/* Like `pckt_cache_path' but in DIR, which is created if missing.  */
+char *
+pckt_cache_path_in (const char *dir, const char *key, const char *suffix)
+{
+  if (!dir || !*dir || !key || !suffix)
+    return NULL;
+
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a.  */
+  for (const char *c = key; *c; ++c)
+    {
+      hash ^= (uint8_t) *c;
+      hash *= 1099511628211ULL;
+    }
+
+  mkdir (dir, 0755); /* Fails harmlessly if it exists.  */
+  return pckt_strdupf ("%s%c%016llx%s", dir, PCKT_DIR_SEP,
+                       (unsigned long long) hash, suffix);
+}
+
+/* Get the directory to keep files backing spilled samples in, which is the
+   cache directory if there is one.  */
+const char *
+pckt_spill_dir ()
+{
+  const char *dir = getenv (CACHE_DIR_ENV);
+  if (!dir || !*dir)
+    dir = getenv ("TMPDIR");
+  return (dir && *dir) ? dir : "/tmp";
+}
+
 static inline float
 parse_digits (const char **c)
 {
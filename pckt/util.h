@@ -35,6 +35,9 @@ __BEGIN_DECLS
 extern char *pckt_vstrdupf (const char *, va_list);
 extern char *pckt_strdupf (const char *, ...);
 extern float pckt_strtof (const char *, char **);
+extern char *pckt_cache_path (const char *, const char *);
+extern char *pckt_cache_path_in (const char *, const char *, const char *);
+extern const char *pckt_spill_dir ();
 
 static inline char *
 pckt_fix_path (char *path)
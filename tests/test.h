@@ -0,0 +1,109 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef PCKT_TEST_H
+#define PCKT_TEST_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../pckt/sample.h"
+
+/* Number of failed checks so far, see `test_exit_status'.  */
+static int test_nfailures = 0;
+
+/* Check that EXPR is true and report it with its location if not.  */
+#define TEST_CHECK(expr) test_check ((expr), #expr, __FILE__, __LINE__)
+
+static inline bool
+test_check (bool ok, const char *expr, const char *file, int line)
+{
+  if (!ok)
+    {
+      fprintf (stderr, "%s:%d: check failed: %s\n", file, line, expr);
+      ++test_nfailures;
+    }
+  return ok;
+}
+
+/* Check that N frames of GOT are within TOLERANCE of the frames of WANT,
+   reporting the first one that isn't as a failure of WHAT.  */
+static inline bool
+test_close (const char *what, const float *got, const float *want, size_t n,
+            float tolerance)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      /* Written so that NaN fails too.  */
+      if (!(fabsf (got[i] - want[i]) <= tolerance))
+        {
+          fprintf (stderr, "%s: frame %zu is %.9g, expected %.9g\n", what, i,
+                   got[i], want[i]);
+          ++test_nfailures;
+          return false;
+        }
+    }
+  return true;
+}
+
+/* Fill N frames of BUF with noise in [-1, 1) from the generator state
+   SEED, so that every run sees the same frames.  */
+static inline void
+test_noise (float *buf, size_t n, uint32_t *seed)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      *seed = (*seed * 1664525u) + 1013904223u;
+      buf[i] = (float) (*seed >> 8) / (1 << 23) - 1.f;
+    }
+}
+
+/* Get a sample of NFRAMES frames of decaying noise at 44.1 kHz from the
+   generator state SEED, or NULL if out of memory.  */
+static inline PcktSample *
+test_sample_new (size_t nframes, uint32_t seed)
+{
+  PcktSample *sample = pckt_sample_new ();
+  float *frames = malloc (nframes * sizeof (float));
+  if (!sample || !frames)
+    {
+      pckt_sample_free (sample);
+      free (frames);
+      return NULL;
+    }
+
+  test_noise (frames, nframes, &seed);
+  for (size_t i = 0; i < nframes; ++i)
+    frames[i] *= expf (-(float) i / nframes);
+
+  pckt_sample_rate (sample, 44100);
+  pckt_sample_write (sample, frames, nframes);
+  pckt_sample_analyze (sample);
+  free (frames);
+  return sample;
+}
+
+static inline int
+test_exit_status ()
+{
+  return test_nfailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif /* ! PCKT_TEST_H */
@@ -0,0 +1,197 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Checks that the sample cache codec gives back every bit of the frames it
+   encodes, whether they are integers from PCM files or arbitrary floats,
+   and that it rejects blocks that are cut short or out of range.  */
+
+#include <string.h>
+#include <float.h>
+#include "../pckt/codec.h"
+#include "test.h"
+
+#define NFRAMES PCKT_CODEC_BLOCK_FRAMES
+#define MODE_INT 0 /* First byte of blocks coded as integers.  */
+
+static uint8_t encoded[PCKT_CODEC_BOUND (NFRAMES)];
+
+/* Encode and decode the N FRAMES, which must come back bit for bit, and
+   get the encoded size, or zero on failure.  */
+static size_t
+round_trip (const char *what, const float *frames, size_t n)
+{
+  float decoded[NFRAMES];
+  size_t size = pckt_codec_encode (frames, n, encoded);
+  if (!TEST_CHECK (size > 0 && size <= PCKT_CODEC_BOUND (n))
+      || !TEST_CHECK (pckt_codec_decode (encoded, size, decoded, n)))
+    return 0;
+
+  for (size_t i = 0; i < n; ++i)
+    {
+      if (memcmp (decoded + i, frames + i, sizeof (float)))
+        {
+          fprintf (stderr, "%s: frame %zu is %.9g, expected %.9g\n", what, i,
+                   decoded[i], frames[i]);
+          ++test_nfailures;
+          return 0;
+        }
+    }
+  return size;
+}
+
+/* Check blocks of noise in WIDTH bit integers scaled to [-1, 1), which
+   must be coded as integers in little more than WIDTH bits per frame.  */
+static void
+test_integers (uint32_t width)
+{
+  float frames[NFRAMES];
+  uint32_t seed = width;
+  test_noise (frames, NFRAMES, &seed);
+  for (size_t i = 0; i < NFRAMES; ++i)
+    {
+      /* Adding zero turns negative zeros, which PCM has none of, positive.  */
+      float x = truncf (ldexpf (frames[i], width - 1)) + 0.f;
+      frames[i] = ldexpf (x, 1 - (int32_t) width);
+    }
+
+  size_t size = round_trip ("integers", frames, NFRAMES);
+  TEST_CHECK (size > 0 && encoded[0] == MODE_INT);
+  TEST_CHECK (size < NFRAMES * (width + 2) / 8);
+}
+
+/* Check a block of floats that aren't integers of any width, with NaN,
+   infinities, signed zeros and denormals among them.  */
+static void
+test_floats ()
+{
+  const float specials[] = {
+    NAN, -NAN, INFINITY, -INFINITY, 0.f, -0.f, FLT_MIN / 4, -FLT_MIN / 3,
+    FLT_MIN, FLT_MAX, -FLT_MAX, 1e-45f
+  };
+  const size_t nspecials = sizeof specials / sizeof specials[0];
+  float frames[NFRAMES];
+  uint32_t seed = 7;
+  test_noise (frames, NFRAMES, &seed);
+  for (size_t i = 0; i < nspecials; ++i)
+    frames[(i * 331) % NFRAMES] = specials[i];
+  round_trip ("floats", frames, NFRAMES);
+
+  /* A lone negative zero keeps a block from being coded as integers.  */
+  memset (frames, 0, sizeof frames);
+  frames[10] = -0.f;
+  round_trip ("negative zero", frames, NFRAMES);
+}
+
+/* Check residuals too large for their Rice code, which are escaped.  */
+static void
+test_escape ()
+{
+  float frames[NFRAMES];
+  memset (frames, 0, sizeof frames);
+  frames[100] = 1.f - ldexpf (1.f, -23);
+  frames[101] = -1.f;
+  round_trip ("escaped integers", frames, NFRAMES);
+
+  uint32_t seed = 9;
+  test_noise (frames, NFRAMES, &seed);
+  for (size_t i = 0; i < NFRAMES; ++i)
+    frames[i] *= 1e-6f;
+  frames[2000] = 3e38f;
+  round_trip ("escaped floats", frames, NFRAMES);
+}
+
+/* Check the short last blocks of a sample, down to fewer frames than the
+   order of the predictor.  */
+static void
+test_short ()
+{
+  const size_t lengths[] = {1, 2, 3, 4, 5, 1000, NFRAMES - 1};
+  float frames[NFRAMES];
+  for (size_t l = 0; l < sizeof lengths / sizeof lengths[0]; ++l)
+    {
+      uint32_t seed = lengths[l];
+      test_noise (frames, lengths[l], &seed);
+      round_trip ("short floats", frames, lengths[l]);
+      for (size_t i = 0; i < lengths[l]; ++i)
+        frames[i] = roundf (frames[i] * INT16_MAX) / 32768;
+      round_trip ("short integers", frames, lengths[l]);
+    }
+}
+
+/* Check that blocks cut short anywhere and blocks with fields out of range
+   are rejected.  */
+static void
+test_reject ()
+{
+  float frames[NFRAMES], decoded[NFRAMES];
+  uint32_t seed = 11;
+  test_noise (frames, NFRAMES, &seed);
+  frames[500] = 3e38f; /* Escaped.  */
+  for (size_t i = 0; i < NFRAMES / 2; ++i)
+    frames[i] = roundf (frames[i] * INT16_MAX) / 32768;
+
+  const size_t lengths[] = {NFRAMES / 2, NFRAMES};
+  for (size_t l = 0; l < sizeof lengths / sizeof lengths[0]; ++l)
+    {
+      size_t size = pckt_codec_encode (frames, lengths[l], encoded);
+      if (!TEST_CHECK (size > 4))
+        continue;
+
+      size_t ntruncated = 0;
+      for (size_t n = 0; n < size; ++n)
+        ntruncated += pckt_codec_decode (encoded, n, decoded, lengths[l]);
+      TEST_CHECK (ntruncated == 0);
+
+      /* More frames than were encoded.  */
+      TEST_CHECK (!pckt_codec_decode (encoded, size, decoded,
+                                      lengths[l] + 1));
+    }
+
+  const uint8_t headers[][4] = {
+    {2, 0, 0, 0},   /* Unknown mode.  */
+    {0, 25, 0, 0},  /* Shift too large.  */
+    {0, 0, 4, 0},   /* Order too high.  */
+    {0, 0, 0, 41},  /* Rice parameter too large.  */
+    {0, 0, 3, 0}    /* Order above the number of frames.  */
+  };
+  uint8_t block[64];
+  memset (block, 0, sizeof block);
+  for (size_t h = 0; h < sizeof headers / sizeof headers[0]; ++h)
+    {
+      memcpy (block, headers[h], sizeof headers[h]);
+      TEST_CHECK (!pckt_codec_decode (block, sizeof block, decoded, 2));
+    }
+
+  TEST_CHECK (!pckt_codec_decode (NULL, sizeof block, decoded, 2));
+  TEST_CHECK (!pckt_codec_decode (block, sizeof block, decoded, 0));
+  TEST_CHECK (!pckt_codec_decode (block, sizeof block, decoded,
+                                  NFRAMES + 1));
+  TEST_CHECK (!pckt_codec_encode (frames, 0, encoded));
+  TEST_CHECK (!pckt_codec_encode (frames, NFRAMES + 1, encoded));
+}
+
+int
+main ()
+{
+  test_integers (16);
+  test_integers (24);
+  test_floats ();
+  test_escape ();
+  test_short ();
+  test_reject ();
+  return test_exit_status ();
+}
@@ -0,0 +1,239 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Checks of the vector kernels in `dsp.c' against plain scalar loops.  All
+   lengths up to a few vectors are tried, starting off vector alignment, so
+   that both the vector body and the scalar remainder are covered.  */
+
+#include <string.h>
+#include "../pckt/dsp.h"
+#include "test.h"
+
+#define MAX_FRAMES 67
+
+/* Check the kernels that do one float operation per frame, which must
+   give exactly the scalar result.  */
+static void
+test_exact (const float *a, const float *b)
+{
+  float got[MAX_FRAMES + 1], want[MAX_FRAMES + 1];
+  int16_t i16[MAX_FRAMES + 1];
+  uint8_t i24[(MAX_FRAMES + 1) * 3];
+
+  for (size_t i = 0; i <= MAX_FRAMES; ++i)
+    {
+      i16[i] = (int16_t) (a[i] * INT16_MAX);
+      int32_t x = (int32_t) (b[i] * ((1 << 23) - 1));
+      i24[3 * i] = (uint8_t) x;
+      i24[3 * i + 1] = (uint8_t) (x >> 8);
+      i24[3 * i + 2] = (uint8_t) (x >> 16);
+    }
+
+  for (size_t n = 0; n <= MAX_FRAMES; ++n)
+    {
+      memcpy (got, a + 1, n * sizeof (float));
+      pckt_dsp_scale (got, n, .7f);
+      for (size_t i = 0; i < n; ++i)
+        want[i] = a[i + 1] * .7f;
+      test_close ("scale", got, want, n, 0);
+
+      memcpy (got, a + 1, n * sizeof (float));
+      pckt_dsp_mix (got, b + 1, n);
+      for (size_t i = 0; i < n; ++i)
+        want[i] = a[i + 1] + b[i + 1];
+      test_close ("mix", got, want, n, 0);
+
+      float gain = 1.f / INT16_MAX;
+      pckt_dsp_from_int16 (got, i16 + 1, n, gain);
+      for (size_t i = 0; i < n; ++i)
+        want[i] = i16[i + 1] * gain;
+      test_close ("from_int16", got, want, n, 0);
+
+      gain = 1.f / ((1 << 23) - 1);
+      pckt_dsp_from_int24 (got, i24 + 3, n, gain);
+      for (size_t i = 0; i < n; ++i)
+        want[i] = (float) (int32_t) (b[i + 1] * ((1 << 23) - 1)) * gain;
+      test_close ("from_int24", got, want, n, 0);
+
+      float peak = 0;
+      for (size_t i = 0; i < n; ++i)
+        peak = fmaxf (peak, fabsf (a[i + 1]));
+      TEST_CHECK (pckt_dsp_peak (a + 1, n) == peak);
+    }
+}
+
+/* Check the kernels that sum over frames, whose vector lanes add up in
+   another order than the scalar loop, to within rounding of the sum of
+   the magnitudes of the terms.  */
+static void
+test_sums (const float *a, const float *b)
+{
+  for (size_t n = 0; n <= MAX_FRAMES; ++n)
+    {
+      double dot = 0, sum = 0, sum2 = 0;
+      double dot_mag = 0, sum_mag = 0;
+      float ref = a[1];
+      for (size_t i = 0; i < n; ++i)
+        {
+          double d = (double) a[i + 1] - ref;
+          dot += (double) a[i + 1] * b[i + 1];
+          dot_mag += fabs ((double) a[i + 1] * b[i + 1]);
+          sum += d;
+          sum_mag += fabs (d);
+          sum2 += d * d;
+        }
+
+      float got = pckt_dsp_dot (a + 1, b + 1, n);
+      TEST_CHECK (fabs (got - dot) <= 1e-6 * (1 + dot_mag));
+
+      float s = 0, s2 = 0;
+      pckt_dsp_moments (a + 1, n, ref, &s, &s2);
+      TEST_CHECK (fabs (s - sum) <= 1e-6 * (1 + sum_mag));
+      TEST_CHECK (fabs (s2 - sum2) <= 1e-6 * (1 + sum2));
+
+      /* Moments are added to what is already there.  */
+      float t = s, t2 = s2;
+      pckt_dsp_moments (a + 1, n, ref, &t, &t2);
+      TEST_CHECK (t == 2 * s && t2 == 2 * s2);
+    }
+}
+
+/* Check the unrolled one-pole lowpass against its recurrence.  */
+static void
+test_smooth (const float *a)
+{
+  const float coeffs[] = {.01f, .5f, .9f, .999f, 1.f};
+  float got[MAX_FRAMES], want[MAX_FRAMES];
+
+  for (size_t c = 0; c < sizeof coeffs / sizeof coeffs[0]; ++c)
+    {
+      PcktDspSmoother smoother;
+      pckt_dsp_smoother_init (&smoother, coeffs[c]);
+      for (size_t n = 0; n <= MAX_FRAMES; ++n)
+        {
+          float tail = .25f;
+          memcpy (got, a + 1, n * sizeof (float));
+          float got_tail = pckt_dsp_smooth (&smoother, got, n, tail);
+          for (size_t i = 0; i < n; ++i)
+            {
+              want[i] = (a[i + 1] * (1.f - coeffs[c])) + (tail * coeffs[c]);
+              tail = want[i];
+            }
+          test_close ("smooth", got, want, n, 1e-6f);
+          TEST_CHECK (n ? got_tail == got[n - 1] : got_tail == tail);
+        }
+    }
+}
+
+/* Render N frames of noise A through envelopes of gain GAIN changing by
+   DECAY or FACTOR per frame, as set up for blocks of BLOCK frames by
+   `pckt_sound_process', into GOT and as the per frame recurrence it
+   replaced into WANT.  */
+static void
+render_envelope (const float *a, size_t n, size_t block, float gain,
+                 float decay, float factor, float *got, float *want)
+{
+  float bleed = gain;
+  for (size_t i = 0; i < n; ++i)
+    {
+      if (decay >= bleed)
+        bleed = 0;
+      else if (decay > 0)
+        bleed -= decay;
+      else if (factor > 0)
+        bleed *= factor;
+      want[i] = a[i] * bleed;
+    }
+
+  memcpy (got, a, n * sizeof (float));
+  bleed = gain;
+  for (size_t i = 0; i < n; i += block)
+    {
+      PcktDspEnvelope envelope;
+      if (decay > 0)
+        pckt_dsp_envelope_linear (&envelope, bleed, decay);
+      else if (factor > 0)
+        pckt_dsp_envelope_exp (&envelope, bleed, factor);
+      else
+        pckt_dsp_envelope_constant (&envelope, bleed);
+      bleed = pckt_dsp_envelope_apply (&envelope, got + i,
+                                       (n - i < block) ? n - i : block);
+    }
+}
+
+/* Check the closed form envelopes against the per frame recurrence over a
+   second of a 48 kHz sound at typical block sizes.  Both drift from the
+   exact envelope by up to about 1e-4 of full scale in that time, and only
+   a block of one frame must give exactly the recurrence.  */
+static void
+test_envelopes ()
+{
+  const size_t blocks[] = {1, 7, 64, 4096};
+  const float decays[] = {1.f / 24000, 1.f / 4410, .3f};
+  const float factors[] = {1 - 1e-5f, .9995f, .9f};
+  const size_t n = 48000;
+  float *a = malloc (n * sizeof (float));
+  float *got = malloc (n * sizeof (float));
+  float *want = malloc (n * sizeof (float));
+  uint32_t seed = 2;
+  if (!TEST_CHECK (a && got && want))
+    {
+      free (a);
+      free (got);
+      free (want);
+      return;
+    }
+  test_noise (a, n, &seed);
+
+  for (size_t b = 0; b < sizeof blocks / sizeof blocks[0]; ++b)
+    {
+      float tolerance = (blocks[b] > 1) ? 2e-4f : 0;
+      render_envelope (a, n, blocks[b], .8f, 0, 0, got, want);
+      test_close ("constant envelope", got, want, n, 0);
+
+      for (size_t d = 0; d < sizeof decays / sizeof decays[0]; ++d)
+        {
+          render_envelope (a, n, blocks[b], .8f, decays[d], 0, got, want);
+          test_close ("linear envelope", got, want, n, tolerance);
+        }
+
+      for (size_t f = 0; f < sizeof factors / sizeof factors[0]; ++f)
+        {
+          render_envelope (a, n, blocks[b], .8f, 0, factors[f], got, want);
+          test_close ("exponential envelope", got, want, n, tolerance);
+        }
+    }
+
+  free (a);
+  free (got);
+  free (want);
+}
+
+int
+main ()
+{
+  float a[MAX_FRAMES + 1], b[MAX_FRAMES + 1];
+  uint32_t seed = 1;
+  test_noise (a, MAX_FRAMES + 1, &seed);
+  test_noise (b, MAX_FRAMES + 1, &seed);
+
+  test_exact (a, b);
+  test_sums (a, b);
+  test_smooth (a);
+  test_envelopes ();
+  return test_exit_status ();
+}
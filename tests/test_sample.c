@@ -0,0 +1,242 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Checks of reading samples stored in the compact integer formats against
+   the same samples stored as floats, and of the quality of the sinc
+   interpolation.  */
+
+#include <string.h>
+#include "../pckt/sample.h"
+#include "test.h"
+
+#define NFRAMES 20000
+
+#ifndef M_PI
+# define M_PI 3.14159265358979323846
+#endif
+
+/* Check that SAMPLE compacted to FORMAT takes at most WIDTH bytes per frame
+   and reads like REF, the same sample as floats, to within the rounding to
+   LIMIT steps of full scale.  */
+static void
+test_format (const PcktSample *ref, PcktSample *sample,
+             PcktSampleFormat format, size_t width, float limit)
+{
+  const PcktInterpolation intrpls[] = {
+    PCKT_INTRPL_NONE, PCKT_INTRPL_CONSTANT, PCKT_INTRPL_LINEAR,
+    PCKT_INTRPL_SINC
+  };
+  const float pitches[] = {1.f, 1.37f, .61f};
+  const size_t blocks[] = {1, 64, 4096};
+  static float got[3 * NFRAMES], want[3 * NFRAMES];
+  char what[128];
+
+  if (!TEST_CHECK (pckt_sample_compact (sample, format)))
+    return;
+  TEST_CHECK (pckt_sample_get_format (sample) == format);
+  TEST_CHECK (pckt_sample_get_memory (sample) <= NFRAMES * width);
+  TEST_CHECK (pckt_sample_get_length (sample) == NFRAMES);
+
+  /* Frames peak below one and interpolation weighs a few of them, so
+     allow twice the rounding of one plus that of the float arithmetic of
+     the sinc taps.  */
+  size_t n;
+  float tolerance = (2.f / limit) + 1e-6f;
+  for (size_t i = 0; i < sizeof intrpls / sizeof intrpls[0]; ++i)
+    {
+      for (size_t p = 0; p < sizeof pitches / sizeof pitches[0]; ++p)
+        {
+          uint64_t step = pckt_sample_step (ref, 48000, pitches[p]);
+          uint64_t phase = 0;
+          size_t nwant = pckt_sample_read_phase (ref, want, 3 * NFRAMES,
+                                                 &phase, step, intrpls[i]);
+          for (size_t b = 0; b < sizeof blocks / sizeof blocks[0]; ++b)
+            {
+              snprintf (what, sizeof what,
+                        "format %d, interpolation %d, pitch %g, blocks of "
+                        "%zu", format, intrpls[i], pitches[p], blocks[b]);
+              size_t ngot = 0;
+              phase = 0;
+              memset (got, 0, sizeof got);
+              while ((n = pckt_sample_read_phase (sample, got + ngot,
+                                                  blocks[b], &phase, step,
+                                                  intrpls[i])) > 0)
+                ngot += n;
+              TEST_CHECK (ngot == nwant);
+              test_close (what, got, want, nwant, tolerance);
+            }
+        }
+    }
+
+  /* A zero step must not divide the window of packed frames by zero.  */
+  uint64_t phase = 0;
+  TEST_CHECK (pckt_sample_read_phase (sample, got, 64, &phase, 0,
+                                      PCKT_INTRPL_LINEAR) <= 64);
+}
+
+/* Get a sample of one second of a sine of HZ at 44.1 kHz and amplitude
+   one half, interpolated with INTRPL.  */
+static PcktSample *
+tone_new (float hz, PcktInterpolation intrpl)
+{
+  PcktSample *sample = pckt_sample_new ();
+  float *frames = malloc (44100 * sizeof (float));
+  if (sample && frames)
+    {
+      for (size_t i = 0; i < 44100; ++i)
+        frames[i] = .5f * sinf (2 * M_PI * hz * i / 44100);
+      pckt_sample_rate (sample, 44100);
+      pckt_sample_write (sample, frames, 44100);
+      pckt_sample_set_interpolation (sample, intrpl);
+    }
+  free (frames);
+  return sample;
+}
+
+/* Get the largest difference between SAMPLE resampled to 48 kHz and the
+   sine of HZ it was made from, away from the ends.  */
+static float
+get_resample_error (float hz, PcktInterpolation intrpl)
+{
+  static float frames[48000];
+  float error = INFINITY;
+  PcktSample *sample = tone_new (hz, intrpl);
+  if (sample && pckt_resample (sample, 48000)
+      && pckt_sample_read (sample, frames, 48000, 0, 48000) == 48000)
+    {
+      error = 0;
+      for (size_t i = 100; i < 48000 - 100; ++i)
+        error = fmaxf (error, fabsf (frames[i] - .5f * sinf (2 * M_PI * hz
+                                                            * i / 48000)));
+    }
+  pckt_sample_free (sample);
+  return error;
+}
+
+/* Get the RMS level of a sine of HZ transposed up by PITCH using INTRPL,
+   away from the ends.  */
+static float
+get_transposed_level (float hz, float pitch, PcktInterpolation intrpl)
+{
+  static float frames[44100];
+  float level = INFINITY;
+  PcktSample *sample = tone_new (hz, intrpl);
+  PcktSample *copy = pckt_sample_transpose (sample, pitch, intrpl);
+  size_t n = pckt_sample_read (copy, frames, 44100, 0, 44100);
+  if (n > 400)
+    {
+      double sum2 = 0;
+      for (size_t i = 200; i < n - 200; ++i)
+        sum2 += frames[i] * frames[i];
+      level = sqrt (sum2 / (n - 400));
+    }
+  pckt_sample_free (sample);
+  pckt_sample_free (copy);
+  return level;
+}
+
+/* Check that sinc interpolation resamples tones well within the audio
+   band, unlike linear interpolation, and removes tones that are pitched
+   past the Nyquist frequency rather than aliasing them.  */
+static void
+test_sinc ()
+{
+  TEST_CHECK (get_resample_error (1000, PCKT_INTRPL_SINC) < 1e-3f);
+  TEST_CHECK (get_resample_error (10000, PCKT_INTRPL_SINC) < 2e-3f);
+  TEST_CHECK (get_resample_error (10000, PCKT_INTRPL_LINEAR) > 5e-2f);
+
+  /* 18 kHz up a fifth is 27 kHz, which aliases to 17.1 kHz.  */
+  TEST_CHECK (get_transposed_level (18000, 1.5f, PCKT_INTRPL_SINC) < 2e-3f);
+  TEST_CHECK (get_transposed_level (18000, 1.5f, PCKT_INTRPL_LINEAR) > .1f);
+
+  /* A tone that stays in the audio band keeps its level of 0.5 / sqrt 2.  */
+  float level = get_transposed_level (5000, 1.5f, PCKT_INTRPL_SINC);
+  TEST_CHECK (fabsf (level - .3536f) < 2e-3f);
+}
+
+/* Bytes allocated and not yet freed through the counting allocator.  */
+static size_t nallocated = 0;
+
+static void *
+counting_alloc (size_t size, void *data)
+{
+  (void) data;
+  nallocated += size;
+  return malloc (size);
+}
+
+static void
+counting_free (void *mem, size_t size, void *data)
+{
+  (void) data;
+  nallocated -= size;
+  free (mem);
+}
+
+/* Check that the frames of a sample, its compact frames and those of its
+   transposed copies all come from and go back to its own allocator.  */
+static void
+test_allocator ()
+{
+  const PcktAllocator counting = {counting_alloc, counting_free, NULL};
+  float frames[NFRAMES];
+  uint32_t seed = 5;
+  test_noise (frames, NFRAMES, &seed);
+
+  PcktSample *sample = pckt_sample_new ();
+  if (!TEST_CHECK (sample && pckt_sample_set_allocator (sample, &counting)))
+    {
+      pckt_sample_free (sample);
+      return;
+    }
+  pckt_sample_write (sample, frames, NFRAMES);
+  TEST_CHECK (nallocated >= NFRAMES * sizeof (float));
+  TEST_CHECK (!pckt_sample_set_allocator (sample, NULL));
+
+  TEST_CHECK (pckt_sample_compact (sample, PCKT_SAMPLE_INT16));
+  TEST_CHECK (nallocated == pckt_sample_get_memory (sample));
+  PcktSample *copy = pckt_sample_transpose (sample, 1.37f,
+                                            PCKT_INTRPL_LINEAR);
+  TEST_CHECK (copy && pckt_sample_get_allocator (copy) == &counting);
+  TEST_CHECK (nallocated == pckt_sample_get_memory (sample)
+              + pckt_sample_get_memory (copy));
+
+  pckt_sample_free (copy);
+  pckt_sample_free (sample);
+  TEST_CHECK (nallocated == 0);
+}
+
+int
+main ()
+{
+  PcktSample *ref = test_sample_new (NFRAMES, 4);
+  PcktSample *int16 = test_sample_new (NFRAMES, 4);
+  PcktSample *int24 = test_sample_new (NFRAMES, 4);
+  if (TEST_CHECK (ref && int16 && int24))
+    {
+      TEST_CHECK (pckt_sample_get_memory (ref) >= NFRAMES * sizeof (float));
+      test_format (ref, int16, PCKT_SAMPLE_INT16, 2, INT16_MAX);
+      test_format (ref, int24, PCKT_SAMPLE_INT24, 3, 0x7fffff);
+    }
+  test_sinc ();
+  test_allocator ();
+
+  pckt_sample_free (ref);
+  pckt_sample_free (int16);
+  pckt_sample_free (int24);
+  return test_exit_status ();
+}
@@ -0,0 +1,127 @@
+/* Copyright (C) 2016 Henrik Hedelund.
+
+   This file is part of IndiePocket.
+
+   IndiePocket is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   IndiePocket is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with IndiePocket.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Checks that `pckt_sound_process' renders the same sound whatever the
+   block size of the host.  */
+
+#include <string.h>
+#include "../pckt/sound.h"
+#include "test.h"
+
+#define RATE 48000
+#define NFRAMES 24000 /* Outlasts the sample played back at RATE.  */
+
+typedef struct {
+  const char *name;
+  float pitch;
+  float impact;
+  bool choke;
+  float stiffness;
+  float smoothness;
+} SoundCase;
+
+static const SoundCase cases[] = {
+  {"plain", 1.f, 1.f, false, 0, 0},
+  {"tuned", 1.37f, 1.f, false, 0, 0},
+  {"tuned down", .61f, 1.f, false, 0, 0},
+  {"choked", 1.f, .4f, true, 0, 0},
+  {"stiff", 1.2f, 1.f, false, .6f, 0},
+  {"smooth", 1.f, 1.f, false, 0, .7f},
+  {"everything", .89f, .7f, true, .3f, .5f}
+};
+
+/* Render NFRAMES frames of the sound of CASE playing SAMPLE with INTRPL
+   into OUT, in blocks of BLOCK frames.  */
+static void
+render (const SoundCase *c, PcktSample *sample, PcktInterpolation intrpl,
+        size_t block, float *out)
+{
+  PcktSound sound;
+  pckt_sound_clear (&sound);
+  sound.samples[PCKT_CH0] = sample;
+  sound.bleed[PCKT_CH0] = .8f;
+  sound.active = PCKT_CHANNEL_BIT (PCKT_CH0);
+  sound.impact = c->impact;
+  sound.pitch = c->pitch;
+  sound.choke = c->choke;
+  sound.stiffness = c->stiffness;
+  sound.smoothness = c->smoothness;
+  sound.interpolation = intrpl;
+
+  memset (out, 0, NFRAMES * sizeof (float));
+  for (size_t i = 0; i < NFRAMES; i += block)
+    {
+      float *channels[PCKT_NCHANNELS] = {out + i};
+      size_t n = (NFRAMES - i < block) ? NFRAMES - i : block;
+      pckt_sound_process (&sound, channels, n, RATE);
+    }
+}
+
+/* Check that SAMPLE renders the same in blocks of any size as in one
+   block.  The read position is exact so the frames read must be too.  The
+   gain envelopes and smoothing round differently at block boundaries,
+   which adds up to about 1e-5 of full scale, or a few times 1e-4 when the
+   gain is stepped every frame in blocks of one frame.  */
+static void
+test_blocks (PcktSample *sample, const char *format, float *want,
+             float *got)
+{
+  const PcktInterpolation intrpls[] = {
+    PCKT_INTRPL_CONSTANT, PCKT_INTRPL_LINEAR, PCKT_INTRPL_SINC
+  };
+  const size_t blocks[] = {1, 37, 64, 4096};
+  char what[128];
+
+  for (size_t c = 0; c < sizeof cases / sizeof cases[0]; ++c)
+    {
+      for (size_t i = 0; i < sizeof intrpls / sizeof intrpls[0]; ++i)
+        {
+          render (cases + c, sample, intrpls[i], NFRAMES, want);
+          for (size_t b = 0; b < sizeof blocks / sizeof blocks[0]; ++b)
+            {
+              snprintf (what, sizeof what,
+                        "%s %s sound, interpolation %d, blocks of %zu",
+                        cases[c].name, format, intrpls[i], blocks[b]);
+              float tolerance = 0;
+              if (cases[c].choke || cases[c].stiffness > 0
+                  || cases[c].smoothness > 0)
+                tolerance = (blocks[b] > 1) ? 1e-5f : 5e-4f;
+              render (cases + c, sample, intrpls[i], blocks[b], got);
+              test_close (what, got, want, NFRAMES, tolerance);
+            }
+        }
+    }
+}
+
+int
+main ()
+{
+  PcktSample *sample = test_sample_new (20000, 3);
+  float *want = malloc (NFRAMES * sizeof (float));
+  float *got = malloc (NFRAMES * sizeof (float));
+  if (TEST_CHECK (sample && want && got))
+    {
+      test_blocks (sample, "float", want, got);
+      TEST_CHECK (pckt_sample_compact (sample, PCKT_SAMPLE_INT16));
+      test_blocks (sample, "int16", want, got);
+    }
+
+  pckt_sample_free (sample);
+  free (want);
+  free (got);
+  return test_exit_status ();
+}